@@ -0,0 +1,181 @@
+"""Boundary-crossing micro-benchmarks for jscore.
+
+Each benchmark reports the time per operation and how many wrapper and
+private-data allocations it caused (see jscore.alloc_stats()).
+
+    python bench_jscore.py [-n ITERATIONS] [benchmark ...]
+"""
+from __future__ import print_function
+
+import StringIO
+import json
+import optparse
+import sys
+import time
+
+import jscore
+
+
+class Obj(object):
+    def __init__(self):
+        self.a = 1
+
+    def method(self, x):
+        return x
+
+
+def bench_js_getattr(g, n):
+    obj = g.eval('({a: 1, b: 2})')
+    for i in xrange(n):
+        obj.a
+
+
+def bench_js_get_many(g, n):
+    obj = g.eval('({a: 1, b: 2, c: 3, d: 4})')
+    keys = ('a', 'b', 'c', 'd')
+    for i in xrange(n // 4):
+        obj.js_get_many(keys)
+
+
+def bench_js_method_call(g, n):
+    g.eval('foo = {bar: function (x) { return x; }}')
+    foo = g.foo
+    for i in xrange(n):
+        foo.bar(i)
+
+
+def bench_js_callmethod(g, n):
+    g.eval('foo = {bar: function (x) { return x; }}')
+    foo = g.foo
+    for i in xrange(n):
+        foo.js_callmethod('bar', i)
+
+
+def bench_js_path(g, n):
+    resp = g.eval('({data: {items: [{meta: {id: 7}}]}})')
+    for i in xrange(n):
+        resp.data.items[0].meta.id
+
+
+def bench_js_accessor(g, n):
+    resp = g.eval('({data: {items: [{meta: {id: 7}}]}})')
+    # accessors are not bound to the context they were compiled by
+    path = jscore.Context().accessor('data.items[0].meta.id')
+    for i in xrange(n):
+        path(resp)
+
+
+def bench_js_list_vector(g, n):
+    vec = g.eval('var v = []; for (var i = 0; i < 256; i++) v.push(i / 2); v')
+    for i in xrange(n):
+        list(vec)
+
+
+def bench_js_to_buffer(g, n):
+    vec = g.eval('var v = []; for (var i = 0; i < 256; i++) v.push(i / 2); v')
+    for i in xrange(n):
+        vec.js_to_buffer()
+
+
+def bench_js_map(g, n):
+    g.eval('function sq(x) { return x * x; }')
+    for x in g.sq.js_map(xrange(n)):
+        pass
+
+
+def bench_py_getattr_from_js(g, n):
+    g.o = Obj()
+    g.eval('(function (n) { var s = 0; for (var i = 0; i < n; i++) s += o.a; return s; })')(n)
+
+
+def bench_py_dict_from_js(g, n):
+    g.cfg = {'timeout': 1}
+    g.eval('(function (n) { var s = 0; for (var i = 0; i < n; i++) s += cfg.timeout; return s; })')(n)
+
+
+def bench_py_call_from_js(g, n):
+    g.f = lambda x: x
+    g.eval('(function (n) { for (var i = 0; i < n; i++) f(i); })')(n)
+
+
+class ExportedObj(Obj):
+    __jsexport__ = ['a', 'method']
+
+
+def bench_py_exported_call_from_js(g, n):
+    g.o = ExportedObj()
+    g.eval('(function (n) { for (var i = 0; i < n; i++) o.method(i); })')(n)
+
+
+def bench_py_exported_getattr_from_js(g, n):
+    g.o = ExportedObj()
+    g.eval('(function (n) { var s = 0; for (var i = 0; i < n; i++) s += o.a; return s; })')(n)
+
+
+def bench_py_proxy_churn(g, n):
+    objs = [Obj() for i in xrange(100)]
+    g.eval('function keep(o) { return o; }')
+    keep = g.keep
+    for i in xrange(n):
+        keep(objs[i % 100])
+
+
+
+TRANSFORM = 'function (r) { return {id: r.id, total: r.price * r.qty}; }'
+
+
+def transform_input(n):
+    return ''.join('{"id": %d, "price": 2.5, "qty": %d, "tags": ["a", "b"]}\n' % (i, i % 7)
+                   for i in xrange(n))
+
+
+def bench_js_transform_lines(g, n):
+    # the per-record round trip transform_stream replaces
+    infile, outfile = StringIO.StringIO(transform_input(n)), StringIO.StringIO()
+    fn = g.eval('(%s)' % TRANSFORM)
+    keys = ('id', 'total')
+    for line in infile:
+        r = fn(g.eval('(%s)' % line))
+        outfile.write(json.dumps(dict(zip(keys, r.js_get_many(keys)))) + '\n')
+
+
+def bench_js_transform_stream(g, n):
+    infile, outfile = StringIO.StringIO(transform_input(n)), StringIO.StringIO()
+    jscore.Context().transform_stream('(%s)' % TRANSFORM, infile, outfile)
+
+
+BENCHMARKS = [(name[len('bench_'):], func)
+              for name, func in sorted(globals().items())
+              if name.startswith('bench_')]
+
+
+def alloc_counts():
+    stats = jscore.alloc_stats()
+    return (stats['objects']['allocs'], stats['objects']['reuses'],
+            stats['private_data']['slab_allocs'])
+
+
+def run(name, func, n):
+    g = jscore.Context().globalObject
+    before = alloc_counts()
+    start = time.time()
+    func(g, n)
+    elapsed = time.time() - start
+    after = alloc_counts()
+    allocs, reuses, slabs = [b - a for a, b in zip(before, after)]
+    print('%-24s %9.1f ns/op  %8d wrapper allocs  %8d reused  %4d slabs'
+          % (name, elapsed * 1e9 / n, allocs, reuses, slabs))
+    return elapsed
+
+
+def main(argv):
+    parser = optparse.OptionParser(usage='%prog [-n ITERATIONS] [benchmark ...]')
+    parser.add_option('-n', '--iterations', type='int', default=100000)
+    options, names = parser.parse_args(argv)
+    for name, func in BENCHMARKS:
+        if not names or name in names:
+            run(name, func, options.iterations)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
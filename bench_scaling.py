@@ -0,0 +1,174 @@
+"""Scaling benchmark for contexts running on concurrent threads.
+
+For each thread count from 1 to N, every thread creates its own Context
+and repeatedly runs an operation from one mix for a fixed time:
+
+    cpu       a CPU-bound script (arithmetic, string building, JSON)
+    callback  a JS loop calling into Python and reading its attributes
+
+Throughput (operations per second, all threads together), its ratio to
+linear scaling from one thread, and the p50/p99 latency of an operation
+are reported per mix and thread count. Serialization on shared state, the
+GIL or locks in the engine shows up as efficiency well below 1.
+
+Results can be saved with --save, and compared to a saved run with
+--compare, which fails if the throughput of any mix and thread count
+dropped by more than --tolerance.
+
+    python bench_scaling.py [-t THREADS] [-d SECONDS] [--mix MIX]
+                            [--save FILE] [--compare FILE [--tolerance T]]
+"""
+from __future__ import print_function
+
+import json
+import multiprocessing
+import optparse
+import sys
+import threading
+import time
+
+import jscore
+
+
+SCRIPT = '''
+function cpu(n) {
+    var s = 0, parts = [];
+    for (var i = 0; i < n; i++) {
+        s += Math.sqrt(i) * (i & 7);
+        if (i % 100 == 0) parts.push(i.toString(16));
+    }
+    return JSON.parse(JSON.stringify({s: s, parts: parts})).parts.length;
+}
+function callback(h, n) {
+    var s = 0;
+    for (var i = 0; i < n; i++) s += h.f(i) + h.x;
+    return s;
+}
+'''
+
+
+class Handler(object):
+    x = 1
+
+    def f(self, i):
+        return i & 3
+
+
+def setup_cpu(g):
+    cpu = g.cpu
+    return lambda: cpu(2000)
+
+
+def setup_callback(g):
+    callback, h = g.callback, Handler()
+    return lambda: callback(h, 50)
+
+
+MIXES = [('cpu', setup_cpu), ('callback', setup_callback)]
+
+
+def worker(setup, start, duration, latencies):
+    g = jscore.Context().globalObject
+    g.eval(SCRIPT)
+    op = setup(g)
+    for i in xrange(10):
+        op()
+    start.wait()
+    append, clock = latencies.append, time.time
+    end = clock() + duration
+    t = clock()
+    while t < end:
+        op()
+        now = clock()
+        append(now - t)
+        t = now
+
+
+def guarded(errors, target, *args):
+    # runs target, keeping its exception for the main thread to raise
+    try:
+        target(*args)
+    except BaseException:
+        errors.append(sys.exc_info())
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def run(setup, nthreads, duration):
+    start = threading.Event()
+    latencies = [[] for i in xrange(nthreads)]
+    errors = []
+    threads = [threading.Thread(target=guarded,
+                                args=(errors, worker, setup, start, duration, latencies[i]))
+               for i in xrange(nthreads)]
+    for t in threads:
+        t.start()
+    # let every thread set up its context before timing starts
+    time.sleep(0.1)
+    start.set()
+    for t in threads:
+        t.join()
+    # a failed worker leaves the numbers meaningless
+    if errors:
+        if len(errors) > 1:
+            print('%d of %d worker threads failed' % (len(errors), nthreads), file=sys.stderr)
+        raise errors[0][0], errors[0][1], errors[0][2]
+    ops = sorted(x for l in latencies for x in l)
+    return {'ops': len(ops) / duration,
+            'p50': percentile(ops, 0.50) if ops else 0.0,
+            'p99': percentile(ops, 0.99) if ops else 0.0}
+
+
+def main(argv):
+    parser = optparse.OptionParser(
+        usage='%prog [-t THREADS] [-d SECONDS] [--mix MIX] [--save FILE] [--compare FILE]')
+    parser.add_option('-t', '--threads', type='int', default=multiprocessing.cpu_count())
+    parser.add_option('-d', '--duration', type='float', default=2.0,
+                      help='seconds per mix and thread count')
+    parser.add_option('--mix', action='append', choices=[name for name, setup in MIXES],
+                      help='run only this mix (may be repeated)')
+    parser.add_option('--save', metavar='FILE', help='write the results as JSON')
+    parser.add_option('--compare', metavar='FILE', help='compare to saved results')
+    parser.add_option('--tolerance', type='float', default=0.15,
+                      help='allowed throughput drop against --compare')
+    options, args = parser.parse_args(argv)
+
+    results = {}
+    for name, setup in MIXES:
+        if options.mix and name not in options.mix:
+            continue
+        results[name] = {}
+        base = None
+        for n in xrange(1, options.threads + 1):
+            r = run(setup, n, options.duration)
+            base = base or r['ops']
+            results[name][str(n)] = r
+            print('%-8s %3d threads  %10.0f ops/s  %5.2f efficiency  '
+                  'p50 %8.1f us  p99 %8.1f us'
+                  % (name, n, r['ops'], r['ops'] / (base * n) if base else 0,
+                     r['p50'] * 1e6, r['p99'] * 1e6))
+
+    if options.save:
+        with open(options.save, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    status = 0
+    if options.compare:
+        with open(options.compare) as f:
+            saved = json.load(f)
+        for name in sorted(results):
+            for n, r in sorted(results[name].items(), key=lambda item: int(item[0])):
+                old = saved.get(name, {}).get(n)
+                if not old or not old['ops']:
+                    continue
+                change = r['ops'] / old['ops'] - 1
+                if change < -options.tolerance:
+                    print('REGRESSION %-8s %3s threads: %+.1f%% throughput'
+                          % (name, n, change * 100))
+                    status = 1
+    return status
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
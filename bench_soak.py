@@ -0,0 +1,81 @@
+"""Soak test for cycles between Python objects and JS closures.
+
+Each round creates many Python objects holding a JS callback that closes
+over the object itself, in one long-lived context, and then calls
+Context.collect(). RSS should stay flat across rounds; with --no-collect
+the cycles are left to the ordinary collectors, which cannot free them.
+
+    python bench_soak.py [-r ROUNDS] [-n CYCLES] [--no-collect]
+
+Context.collect() needs a build with a synchronous JS collection
+(jscore.HAVE_SYNC_GC); without it only --no-collect runs.
+"""
+from __future__ import print_function
+
+import gc
+import optparse
+import resource
+import sys
+import time
+
+import jscore
+
+
+class Handler(object):
+    def __init__(self, payload):
+        self.payload = payload
+
+
+def rss_kb():
+    """Current resident set size in kB (peak RSS where /proc is missing)."""
+    try:
+        with open('/proc/self/statm') as f:
+            pages = int(f.read().split()[1])
+        return pages * resource.getpagesize() // 1024
+    except IOError:
+        rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        return rss // 1024 if sys.platform == 'darwin' else rss
+
+
+def soak_round(context, make, n, collect):
+    for i in xrange(n):
+        h = Handler('x' * 256)
+        h.callback = make(h)
+    gc.collect()
+    return context.collect() if collect else 0
+
+
+def main(argv):
+    parser = optparse.OptionParser(usage='%prog [-r ROUNDS] [-n CYCLES] [--no-collect]')
+    parser.add_option('-r', '--rounds', type='int', default=20)
+    parser.add_option('-n', '--cycles', type='int', default=10000)
+    parser.add_option('--no-collect', action='store_true', default=False)
+    parser.add_option('--tolerance', type='float', default=0.10,
+                      help='allowed RSS growth after the first rounds')
+    options, args = parser.parse_args(argv)
+    if not options.no_collect and not jscore.HAVE_SYNC_GC:
+        parser.error('this build cannot collect() (jscore.HAVE_SYNC_GC is false); '
+                     'use --no-collect')
+
+    context = jscore.Context()
+    make = context.eval('(function (h) { return function () { return h.payload; }; })')
+    baseline = None
+    for r in xrange(options.rounds):
+        start = time.time()
+        released = soak_round(context, make, options.cycles, not options.no_collect)
+        rss = rss_kb()
+        if r == 2:
+            # the first rounds warm up the heaps
+            baseline = rss
+        print('round %3d  %7.2f s  %8d released  %8d proxies  %9d kB RSS'
+              % (r, time.time() - start, released, context.proxies, rss))
+    if baseline:
+        growth = float(rss - baseline) / baseline
+        print('RSS growth since round 2: %+.1f%%' % (growth * 100))
+        if growth > options.tolerance:
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -1,16 +1,180 @@
-from distutils.core import setup, Extension
+"""Build the jscore extension.
+
+    python setup.py build_ext --inplace
+
+The build is configured with environment variables:
+
+    PYJSCORE_BUILD   debug (the default; assertions on) or release (-O3,
+                     NDEBUG and link-time optimization)
+    PYJSCORE_BIGINT  1 if JavaScriptCore has the JSBigInt API
+    PYJSCORE_SYNC_GC 1 or 0 if JavaScriptCore does or does not export
+                     JSSynchronousGarbageCollectForDebugging (by default,
+                     probed by linking a test program); Context.collect()
+                     needs it, and raises NotImplementedError without it
+    PYJSCORE_JSC     pkg-config package of JavaScriptCore on Linux (by
+                     default the first found of WebKitGTK's packages)
+    PYJSCORE_PGO     generate or use a profile in PYJSCORE_PGO_DIR
+                     (build/pgo by default); set by the pgo command
+
+    python setup.py pgo [-n ITERATIONS]
+
+builds an instrumented release, trains it on bench_jscore.py, and rebuilds
+the release in place with the profile.
+
+jscore.Executor returns concurrent.futures Futures, so it needs the futures
+backport (pip install futures); the rest of the module does not.
+"""
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+from distutils import ccompiler, sysconfig
+from distutils.core import setup, Command, Extension
+from distutils.errors import CompileError, DistutilsError, LinkError
+
+BUILD = os.environ.get('PYJSCORE_BUILD', 'debug')
+PGO = os.environ.get('PYJSCORE_PGO')
+PGO_DIR = os.path.abspath(os.environ.get('PYJSCORE_PGO_DIR', os.path.join('build', 'pgo')))
+JSC_PACKAGES = ['javascriptcoregtk-4.1', 'javascriptcoregtk-4.0']
+
+if BUILD not in ('debug', 'release'):
+    sys.exit('PYJSCORE_BUILD must be debug or release, not %r' % BUILD)
+if PGO not in (None, 'generate', 'use'):
+    sys.exit('PYJSCORE_PGO must be generate or use, not %r' % PGO)
+
+
+def is_clang():
+    return 'clang' in (sysconfig.get_config_var('CC') or '')
+
+
+def pkg_config(package, option):
+    return subprocess.check_output(['pkg-config', option, package]).decode().split()
+
+
+def javascriptcore():
+    """returns the (compile, link) arguments for JavaScriptCore"""
+    if sys.platform == 'darwin':
+        return [], ['-framework', 'JavaScriptCore']
+    packages = [os.environ['PYJSCORE_JSC']] if 'PYJSCORE_JSC' in os.environ else JSC_PACKAGES
+    for package in packages:
+        if subprocess.call(['pkg-config', '--exists', package]) == 0:
+            return pkg_config(package, '--cflags'), pkg_config(package, '--libs')
+    sys.exit('JavaScriptCore not found by pkg-config (tried %s); install '
+             'WebKitGTK\'s development package or set PYJSCORE_JSC' % ', '.join(packages))
+
+
+def links(function, compile_args, link_args):
+    """whether a program calling function links against JavaScriptCore"""
+    compiler = ccompiler.new_compiler()
+    sysconfig.customize_compiler(compiler)
+    tmp = tempfile.mkdtemp()
+    try:
+        source = os.path.join(tmp, 'probe.c')
+        with open(source, 'w') as f:
+            f.write('void %s(const void *);\n'
+                    'int main(void) { %s(0); return 0; }\n' % (function, function))
+        try:
+            objects = compiler.compile([source], output_dir=tmp, extra_postargs=compile_args)
+            compiler.link_executable(objects, os.path.join(tmp, 'probe'),
+                                     extra_postargs=link_args)
+        except (CompileError, LinkError):
+            return False
+        return True
+    finally:
+        shutil.rmtree(tmp)
+
+
+compile_args, link_args = javascriptcore()
+macros, undef_macros = [], []
+if os.environ.get('PYJSCORE_BIGINT') == '1':
+    macros.append(('HAVE_JSBIGINT', None)) # JavaScriptCore with JSBigInt API
+sync_gc = os.environ.get('PYJSCORE_SYNC_GC')
+if sync_gc == '1' or (sync_gc is None and links('JSSynchronousGarbageCollectForDebugging',
+                                                 compile_args, link_args)):
+    macros.append(('HAVE_JSSYNCGC', None)) # Context.collect() can run finalizers
+# macros.append(('TRACE_MALLOC', None))
+if BUILD == 'release':
+    macros.append(('NDEBUG', None))
+    compile_args += ['-O3', '-flto']
+    link_args += ['-O3', '-flto']
+else:
+    undef_macros.append('NDEBUG') # enable assertions
+    # compile_args.append('-O0')
+if PGO == 'generate':
+    compile_args.append('-fprofile-generate=' + PGO_DIR)
+    link_args.append('-fprofile-generate=' + PGO_DIR)
+elif PGO == 'use':
+    profile = os.path.join(PGO_DIR, 'default.profdata') if is_clang() else PGO_DIR
+    compile_args.append('-fprofile-use=' + profile)
+    if not is_clang():
+        # counters are updated racily by threads; objects not trained warn
+        compile_args += ['-fprofile-correction', '-Wno-missing-profile']
+
+
+class pgo(Command):
+    description = "build a release trained on bench_jscore.py"
+    user_options = [('iterations=', 'n', "iterations of each benchmark (default 20000)")]
+
+    def initialize_options(self):
+        self.iterations = '20000'
+
+    def finalize_options(self):
+        pass
+
+    def build(self, mode, *options):
+        # both builds compile into one build-temp: GCC finds the profile of
+        # an object by its path
+        env = dict(os.environ, PYJSCORE_BUILD='release', PYJSCORE_PGO=mode,
+                   PYJSCORE_PGO_DIR=PGO_DIR)
+        subprocess.check_call([sys.executable, 'setup.py', 'build_ext', '--force',
+                               '--build-temp', os.path.join('build', 'pgo-temp')] +
+                              list(options), env=env)
+
+    def run(self):
+        trained = os.path.join('build', 'pgo-lib')
+        # an extension built in place would shadow the trained one, as the
+        # benchmark's directory comes first on sys.path
+        for name in glob.glob(os.path.join(PGO_DIR, '*')) + glob.glob('jscore*.so'):
+            os.remove(name)
+        self.build('generate', '--build-lib', trained)
+        env = dict(os.environ, PYTHONPATH=os.path.abspath(trained))
+        subprocess.check_call([sys.executable, 'bench_jscore.py', '-n', self.iterations], env=env)
+        if is_clang():
+            subprocess.check_call(['llvm-profdata', 'merge', '-o',
+                                   os.path.join(PGO_DIR, 'default.profdata')] +
+                                  glob.glob(os.path.join(PGO_DIR, '*.profraw')))
+        if not glob.glob(os.path.join(PGO_DIR, '*')):
+            raise DistutilsError('training wrote no profile to %s' % PGO_DIR)
+        self.build('use', '--inplace')
+
 
 pyjscore = Extension(
-    "jscore", ["src/jscore.c", "src/conversions.c", "src/jsobj.c"],
-    depends=['src/conversions.h', 'src/jscore.h', 'src/jsobj.h'],
-    # define_macros=[('TRACE_MALLOC', None)],
-    undef_macros=['NDEBUG'], # enable assertions
-    # extra_compile_args=['-O0'],
-    extra_link_args=['-framework', 'JavaScriptCore'],
+    "jscore", ["src/jscore.c", "src/conversions.c", "src/jsobj.c",
+               "src/script.c", "src/jsexport.c", "src/transfer.c",
+               "src/executor.c", "src/clone.c", "src/jsstring.c",
+               "src/iterator.c", "src/collect.c", "src/accessor.c",
+               "src/buffer.c", "src/eventloop.c",
+               "src/profiler.c", "src/checkpoint.c",
+               "src/modules.c", "src/policy.c", "src/stream.c"],
+    depends=['src/conversions.h', 'src/jscore.h', 'src/jsobj.h',
+             'src/script.h', 'src/jsexport.h', 'src/transfer.h',
+             'src/executor.h', 'src/clone.h', 'src/jsstring.h',
+             'src/iterator.h', 'src/collect.h', 'src/accessor.h',
+             'src/buffer.h', 'src/eventloop.h',
+             'src/profiler.h', 'src/checkpoint.h',
+             'src/modules.h', 'src/policy.h', 'src/stream.h'],
+    define_macros=macros,
+    undef_macros=undef_macros,
+    extra_compile_args=compile_args,
+    extra_link_args=link_args,
 )
 
 setup(
     name="pyjscore",
     version="1.0",
-    ext_modules=[pyjscore]
+    ext_modules=[pyjscore],
+    requires=['futures'],
+    cmdclass={'pgo': pgo},
 )
@@ -0,0 +1,326 @@
+#include <Python.h>
+#include <structmember.h>
+
+#include "jscore.h"
+#include "conversions.h"
+#include "accessor.h"
+
+#include <limits.h>
+
+/* parses path into self->steps; returns -1 with ValueError set if it is
+   malformed */
+static int
+PyJSAccessor_parse(PyJSAccessor *self, const char *path, Py_ssize_t length)
+{
+    const char *p = path, *end = path + length;
+    Py_ssize_t capacity = 1;
+
+    /* every step but the first starts with '.' or '[' */
+    while (p < end) {
+        capacity += (*p == '.' || *p == '[');
+        p++;
+    }
+    if (!(self->steps = PyMem_New(JSAccessStep, capacity))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (p = path; p < end; self->nsteps++) {
+        JSAccessStep *step = &self->steps[self->nsteps];
+        if (*p == '[') {
+            if (end - p >= 3 && p[1] == '*' && p[2] == ']') {
+                step->kind = JSACCESS_ALL;
+                p += 3;
+            } else {
+                unsigned long index = 0;
+                const char *digits = ++p;
+                while (p < end && *p >= '0' && *p <= '9' && index <= UINT_MAX / 10) {
+                    index = index * 10 + (*p++ - '0');
+                }
+                if (p == digits || p >= end || *p != ']' || index >= UINT_MAX) {
+                    goto malformed;
+                }
+                step->kind = JSACCESS_INDEX;
+                step->index = (unsigned)index;
+                p++;
+            }
+        } else {
+            const char *name;
+            if (self->nsteps > 0 && *p++ != '.') {
+                goto malformed;
+            }
+            for (name = p; p < end && *p != '.' && *p != '['; p++)
+                ;
+            if (p == name) {
+                goto malformed;
+            }
+            if (!(step->name = UTF8_to_JSString(name, p - name))) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            step->kind = JSACCESS_PROPERTY;
+        }
+    }
+    if (!self->nsteps) {
+        goto malformed;
+    }
+    return 0;
+  malformed:
+    PyErr_Format(PyExc_ValueError, "malformed property path at offset %d: '%.200s'",
+        (int)(p - path), path);
+    return -1;
+}
+
+PyObject *
+PyJSAccessor_new(PyObject *path)
+{
+    PyJSAccessor *self;
+    PyObject *utf8;
+
+    if (PyUnicode_Check(path)) {
+        utf8 = PyUnicode_AsUTF8String(path);
+    } else if (PyString_Check(path)) {
+        Py_INCREF(path);
+        utf8 = path;
+    } else {
+        PyErr_SetString(PyExc_TypeError, "accessor() needs a path string");
+        return NULL;
+    }
+    if (!utf8) {
+        return NULL;
+    }
+    if (!(self = PyObject_New(PyJSAccessor, &jscore_PyJSAccessorType))) {
+        Py_DECREF(utf8);
+        return NULL;
+    }
+    Py_INCREF(path);
+    self->path = path;
+    self->nsteps = 0;
+    self->steps = NULL;
+    if (PyJSAccessor_parse(self, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8)) < 0) {
+        Py_DECREF(self);
+        self = NULL;
+    }
+    Py_DECREF(utf8);
+    return (PyObject *)self;
+}
+
+static PyObject *PyJSAccessor_fanOut(PyJSAccessor *self, PyJSContext *context,
+                                     JSObjectRef array, Py_ssize_t step, PyObject *dflt);
+
+/* applies the steps from step on to value; a path leading through a
+   non-object or ending at undefined yields dflt */
+static PyObject *
+PyJSAccessor_walk(PyJSAccessor *self, PyJSContext *context, JSValueRef value,
+                  Py_ssize_t step, PyObject *dflt)
+{
+    JSContextRef ctx = context->context;
+    JSValueRef exception = NULL;
+    JSObjectRef object;
+
+    for (; step < self->nsteps; step++) {
+        JSAccessStep *s = &self->steps[step];
+        if (!JSValueIsObject(ctx, value)) {
+            Py_INCREF(dflt);
+            return dflt;
+        }
+        object = JSValueToObject(ctx, value, NULL);
+        if (s->kind == JSACCESS_ALL) {
+            return PyJSAccessor_fanOut(self, context, object, step + 1, dflt);
+        } else if (s->kind == JSACCESS_INDEX) {
+            value = JSObjectGetPropertyAtIndex(ctx, object, s->index, &exception);
+        } else {
+            value = JSObjectGetProperty(ctx, object, s->name, &exception);
+        }
+        if (!value) {
+            return JSException_to_PyErr(context, exception);
+        }
+    }
+    if (JSValueIsUndefined(ctx, value)) {
+        Py_INCREF(dflt);
+        return dflt;
+    }
+    return JSValue_to_PyJSObject(value, &context->dummy);
+}
+
+/* returns a list of the results of the steps from step on for each element
+   of an array (or typed array); other objects yield dflt */
+static PyObject *
+PyJSAccessor_fanOut(PyJSAccessor *self, PyJSContext *context, JSObjectRef array,
+                    Py_ssize_t step, PyObject *dflt)
+{
+    JSContextRef ctx = context->context;
+    JSValueRef value, exception = NULL;
+    PyObject *result, *item;
+    unsigned i, length;
+
+    if (!JSValueIsArray(ctx, array) &&
+        JSValueGetTypedArrayType(ctx, array, NULL) == kJSTypedArrayTypeNone) {
+        Py_INCREF(dflt);
+        return dflt;
+    }
+    if (!(value = JSObjectGetProperty(ctx, array, JSLengthString, &exception))) {
+        return JSException_to_PyErr(context, exception);
+    }
+    length = (unsigned)JSValueToNumber(ctx, value, NULL);
+    if (!(result = PyList_New(length))) {
+        return NULL;
+    }
+    for (i = 0; i < length; i++) {
+        if (!(value = JSObjectGetPropertyAtIndex(ctx, array, i, &exception))) {
+            Py_DECREF(result);
+            return JSException_to_PyErr(context, exception);
+        }
+        if (!(item = PyJSAccessor_walk(self, context, value, step, dflt))) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    return result;
+}
+
+static PyObject *
+PyJSAccessor_call(PyJSAccessor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"root", "default", NULL};
+    PyObject *dflt = Py_None;
+    PyJSObject *root;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O:Accessor", kwlist,
+                                     &jscore_PyJSObjectType, &root, &dflt))
+        return NULL;
+    if (!root->object) {
+        Py_INCREF(dflt);
+        return dflt;
+    }
+    return PyJSAccessor_walk(self, root->context, root->object, 0, dflt);
+}
+
+static PyObject *
+PyJSAccessor_map(PyJSAccessor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"roots", "default", NULL};
+    PyObject *roots, *dflt = Py_None, *seq, *result;
+    Py_ssize_t i, size;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:map", kwlist, &roots, &dflt))
+        return NULL;
+    /* a JS array of roots is walked without wrapping its elements */
+    if (PyObject_TypeCheck(roots, &jscore_PyJSObjectType) && ((PyJSObject *)roots)->object) {
+        PyJSObject *array = (PyJSObject *)roots;
+        if (!JSValueIsArray(array->context->context, array->object)) {
+            PyErr_SetString(PyExc_TypeError, "map() needs an array or a sequence of roots");
+            return NULL;
+        }
+        return PyJSAccessor_fanOut(self, array->context, array->object, 0, dflt);
+    }
+    if (!(seq = PySequence_Fast(roots, "map() needs an array or a sequence of roots")))
+        return NULL;
+    size = PySequence_Fast_GET_SIZE(seq);
+    if (!(result = PyList_New(size)))
+        goto finally;
+    for (i = 0; i < size; i++) {
+        PyJSObject *root = (PyJSObject *)PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *item;
+        if (!PyObject_TypeCheck(root, &jscore_PyJSObjectType)) {
+            PyErr_SetString(PyExc_TypeError, "map() roots must be JSObjects");
+            Py_CLEAR(result);
+            goto finally;
+        }
+        if (!root->object) {
+            Py_INCREF(dflt);
+            item = dflt;
+        } else if (!(item = PyJSAccessor_walk(self, root->context, root->object, 0, dflt))) {
+            Py_CLEAR(result);
+            goto finally;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+  finally:
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+PyJSAccessor_repr(PyJSAccessor *self)
+{
+    PyObject *path = PyObject_Repr(self->path), *result;
+
+    if (!path) {
+        return NULL;
+    }
+    result = PyString_FromFormat("<Accessor %s>", PyString_AS_STRING(path));
+    Py_DECREF(path);
+    return result;
+}
+
+static void
+PyJSAccessor_dealloc(PyJSAccessor *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->nsteps; i++) {
+        if (self->steps[i].kind == JSACCESS_PROPERTY) {
+            JSStringRelease(self->steps[i].name);
+        }
+    }
+    PyMem_Free(self->steps);
+    Py_XDECREF(self->path);
+    PyObject_Del(self);
+}
+
+static PyMethodDef PyJSAccessor_methods[] = {
+    {"map", (PyCFunction)PyJSAccessor_map, METH_VARARGS | METH_KEYWORDS,
+     "map(roots, default=None) -> list of the values at the path from each\n"
+     "root; roots is a JS array or a sequence of JSObjects"},
+    {NULL},
+};
+
+static PyMemberDef PyJSAccessor_members[] = {
+    {"path", T_OBJECT, offsetof(PyJSAccessor, path), READONLY, "the property path"},
+    {NULL},
+};
+
+PyTypeObject jscore_PyJSAccessorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.Accessor",            /* tp_name */
+    sizeof(PyJSAccessor),           /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSAccessor_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    (reprfunc)PyJSAccessor_repr,    /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    (ternaryfunc)PyJSAccessor_call, /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "accessor(root, default=None) -> the value at the property path from\n"
+    "root; each [*] step gives a list over the elements of an array, and\n"
+    "a missing value gives default.", /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    PyJSAccessor_methods,           /* tp_methods */
+    PyJSAccessor_members,           /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    0,                              /* tp_new */
+};
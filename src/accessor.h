@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+typedef struct JSAccessStep JSAccessStep;
+typedef struct PyJSAccessor PyJSAccessor;
+
+#define JSACCESS_PROPERTY   0   /* .name */
+#define JSACCESS_INDEX      1   /* [n] */
+#define JSACCESS_ALL        2   /* [*]: every element of an array */
+
+struct JSAccessStep {
+    int                 kind;
+    JSStringRef         name;       /* retain; JSACCESS_PROPERTY only */
+    unsigned            index;      /* JSACCESS_INDEX only */
+};
+
+/* A property path such as "data.items[*].meta.id", parsed once into steps
+   with their property names interned; applying it walks the JS objects
+   without wrapping the intermediate values */
+struct PyJSAccessor {
+    PyObject_HEAD
+    PyObject            *path;      /* retain */
+    Py_ssize_t          nsteps;
+    JSAccessStep        *steps;
+};
+
+extern PyTypeObject jscore_PyJSAccessorType;
+
+/* returns a new accessor for the path (a str or unicode);
+   if the path is malformed, raises ValueError and returns NULL */
+PyObject *PyJSAccessor_new(PyObject *path);
@@ -0,0 +1,445 @@
+#include <Python.h>
+
+#include "jscore.h"
+#include "conversions.h"
+#include "buffer.h"
+
+#include <limits.h>
+#include <string.h>
+
+static PyObject *array_class = NULL;
+
+static const JSBufferType JSBufferTypes[] = {
+    {'b', 'i', sizeof(signed char)},
+    {'B', 'u', sizeof(unsigned char)},
+    {'h', 'i', sizeof(short)},
+    {'H', 'u', sizeof(unsigned short)},
+    {'i', 'i', sizeof(int)},
+    {'I', 'u', sizeof(unsigned int)},
+    {'l', 'i', sizeof(long)},
+    {'L', 'u', sizeof(unsigned long)},
+    {'q', 'i', sizeof(long long)},
+    {'Q', 'u', sizeof(unsigned long long)},
+    {'f', 'f', sizeof(float)},
+    {'d', 'f', sizeof(double)},
+    {0},
+};
+
+#define JSBUFFER_BYTE   (&JSBufferTypes[1])
+#define JSBUFFER_DOUBLE (&JSBufferTypes[11])
+
+/* looks up a struct format of a single element, such as "d" or "<i";
+   returns NULL if it is not supported */
+static const JSBufferType *
+JSBufferType_fromFormat(const char *format)
+{
+    static const union { int i; char little; } native = {1};
+    const JSBufferType *type;
+
+    if (*format == '@' || *format == '=' ||
+        (*format == '<' && native.little) ||
+        ((*format == '>' || *format == '!') && !native.little)) {
+        format++;
+    }
+    if (!format[0] || format[1]) {
+        return NULL;
+    }
+    for (type = JSBufferTypes; type->code; type++) {
+        if (type->code == *format) {
+            return type;
+        }
+    }
+    return NULL;
+}
+
+static int
+JSBufferType_same(const JSBufferType *a, const JSBufferType *b)
+{
+    return a->kind == b->kind && a->size == b->size;
+}
+
+/* returns the element type of a typed array, or NULL if it has none */
+static const JSBufferType *
+JSBufferType_ofArray(JSTypedArrayType array)
+{
+    switch (array) {
+    case kJSTypedArrayTypeInt8Array:            return JSBufferType_fromFormat("b");
+    case kJSTypedArrayTypeUint8Array:
+    case kJSTypedArrayTypeUint8ClampedArray:    return JSBufferType_fromFormat("B");
+    case kJSTypedArrayTypeInt16Array:           return JSBufferType_fromFormat("h");
+    case kJSTypedArrayTypeUint16Array:          return JSBufferType_fromFormat("H");
+    case kJSTypedArrayTypeInt32Array:           return JSBufferType_fromFormat("i");
+    case kJSTypedArrayTypeUint32Array:          return JSBufferType_fromFormat("I");
+    case kJSTypedArrayTypeFloat32Array:         return JSBufferType_fromFormat("f");
+    case kJSTypedArrayTypeFloat64Array:         return JSBUFFER_DOUBLE;
+#ifdef HAVE_JSBIGINT
+    case kJSTypedArrayTypeBigInt64Array:        return JSBufferType_fromFormat("q");
+    case kJSTypedArrayTypeBigUint64Array:       return JSBufferType_fromFormat("Q");
+#endif
+    default:                                    return NULL;
+    }
+}
+
+/* returns the typed array holding elements of the type; 64-bit integers
+   have none (without BigInt support) and go into a Float64Array */
+static JSTypedArrayType
+JSBufferType_array(const JSBufferType *type)
+{
+    if (type->kind == 'f') {
+        return type->size == 4 ? kJSTypedArrayTypeFloat32Array : kJSTypedArrayTypeFloat64Array;
+    }
+    switch (type->size) {
+    case 1: return type->kind == 'i' ? kJSTypedArrayTypeInt8Array : kJSTypedArrayTypeUint8Array;
+    case 2: return type->kind == 'i' ? kJSTypedArrayTypeInt16Array : kJSTypedArrayTypeUint16Array;
+    case 4: return type->kind == 'i' ? kJSTypedArrayTypeInt32Array : kJSTypedArrayTypeUint32Array;
+#ifdef HAVE_JSBIGINT
+    case 8: return type->kind == 'i' ? kJSTypedArrayTypeBigInt64Array : kJSTypedArrayTypeBigUint64Array;
+#endif
+    default: return kJSTypedArrayTypeFloat64Array;
+    }
+}
+
+/* elements are copied through memcpy, as buffers need not be aligned */
+#define LOAD(ctype) do {                                                    \
+        ctype v;                                                            \
+        memcpy(&v, p, sizeof(v));                                           \
+        return (double)v;                                                   \
+    } while (0)
+
+static double
+JSBuffer_load(const JSBufferType *type, const char *p)
+{
+    switch (type->code) {
+    case 'b': LOAD(signed char);
+    case 'B': LOAD(unsigned char);
+    case 'h': LOAD(short);
+    case 'H': LOAD(unsigned short);
+    case 'i': LOAD(int);
+    case 'I': LOAD(unsigned int);
+    case 'l': LOAD(long);
+    case 'L': LOAD(unsigned long);
+    case 'q': LOAD(long long);
+    case 'Q': LOAD(unsigned long long);
+    case 'f': LOAD(float);
+    default:  LOAD(double);
+    }
+}
+
+/* integers are truncated; NaN and values out of range are rejected */
+#define STORE(ctype, min, max) do {                                         \
+        ctype v;                                                            \
+        if (!(x > (double)(min) - 1.0 && x < (double)(max) + 1.0))          \
+            return -1;                                                      \
+        v = (ctype)x;                                                       \
+        memcpy(p, &v, sizeof(v));                                           \
+        return 0;                                                           \
+    } while (0)
+
+/* returns -1 if x does not fit the type */
+static int
+JSBuffer_store(const JSBufferType *type, char *p, double x)
+{
+    switch (type->code) {
+    case 'b': STORE(signed char, SCHAR_MIN, SCHAR_MAX);
+    case 'B': STORE(unsigned char, 0, UCHAR_MAX);
+    case 'h': STORE(short, SHRT_MIN, SHRT_MAX);
+    case 'H': STORE(unsigned short, 0, USHRT_MAX);
+    case 'i': STORE(int, INT_MIN, INT_MAX);
+    case 'I': STORE(unsigned int, 0, UINT_MAX);
+    case 'l': STORE(long, LONG_MIN, LONG_MAX);
+    case 'L': STORE(unsigned long, 0, ULONG_MAX);
+    case 'q': STORE(long long, LLONG_MIN, LLONG_MAX);
+    case 'Q': STORE(unsigned long long, 0, ULLONG_MAX);
+    case 'f': {
+        float v = (float)x;
+        memcpy(p, &v, sizeof(v));
+        return 0;
+    }
+    default:
+        memcpy(p, &x, sizeof(x));
+        return 0;
+    }
+}
+
+/* copies length elements between buffers, converting them unless the
+   types match; if an element does not fit, raises OverflowError */
+static int
+JSBuffer_convert(char *dst, const JSBufferType *to, const char *src,
+                 const JSBufferType *from, size_t length)
+{
+    size_t i;
+
+    if (JSBufferType_same(to, from)) {
+        memcpy(dst, src, length * to->size);
+        return 0;
+    }
+    for (i = 0; i < length; i++, dst += to->size, src += from->size) {
+        if (JSBuffer_store(to, dst, JSBuffer_load(from, src)) < 0) {
+            PyErr_Format(PyExc_OverflowError, "element %zu does not fit dtype '%c'",
+                         i, to->code);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+JSBuffer_loadArrayClass(void)
+{
+    if (!array_class) {
+        PyObject *module = PyImport_ImportModule("array");
+        if (!module)
+            return -1;
+        array_class = PyObject_GetAttrString(module, "array");
+        Py_DECREF(module);
+        if (!array_class)
+            return -1;
+    }
+    return 0;
+}
+
+/* The memory of a Python object, through the new buffer protocol if it
+   supports it (array.array only has the old one) */
+typedef struct JSBufferView {
+    Py_buffer           view;
+    int                 has_view;
+    char                *data;
+    Py_ssize_t          length;     /* in bytes */
+    const JSBufferType  *type;      /* NULL if the object does not say */
+} JSBufferView;
+
+static int
+JSBufferView_acquire(JSBufferView *self, PyObject *obj, int writable)
+{
+    const char *format = NULL;
+    PyObject *typecode = NULL;
+
+    self->has_view = 0;
+    self->type = NULL;
+    if (PyObject_CheckBuffer(obj)) {
+        if (PyObject_GetBuffer(obj, &self->view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT |
+                               (writable ? PyBUF_WRITABLE : 0)) < 0)
+            return -1;
+        self->has_view = 1;
+        self->data = self->view.buf;
+        self->length = self->view.len;
+        format = self->view.format ? self->view.format : "B";
+    } else {
+        if (writable) {
+            void *data;
+            if (PyObject_AsWriteBuffer(obj, &data, &self->length) < 0)
+                return -1;
+            self->data = data;
+        } else {
+            const void *data;
+            if (PyObject_AsReadBuffer(obj, &data, &self->length) < 0)
+                return -1;
+            self->data = (char *)data;
+        }
+        if (JSBuffer_loadArrayClass() < 0)
+            goto error;
+        if (PyObject_IsInstance(obj, array_class) > 0) {
+            if (!(typecode = PyObject_GetAttrString(obj, "typecode")))
+                goto error;
+            if (PyString_Check(typecode))
+                format = PyString_AS_STRING(typecode);
+        }
+    }
+    if (format && !(self->type = JSBufferType_fromFormat(format))) {
+        PyErr_Format(PyExc_ValueError, "unsupported buffer format '%.20s'", format);
+        goto error;
+    }
+    Py_XDECREF(typecode);
+    return 0;
+  error:
+    Py_XDECREF(typecode);
+    if (self->has_view)
+        PyBuffer_Release(&self->view);
+    return -1;
+}
+
+static void
+JSBufferView_release(JSBufferView *self)
+{
+    if (self->has_view)
+        PyBuffer_Release(&self->view);
+}
+
+/* unboxes the numbers of a plain array into dst */
+static int
+JSBuffer_unbox(char *dst, const JSBufferType *to, PyJSContext *context,
+               JSObjectRef array, unsigned length)
+{
+    JSContextRef ctx = context->context;
+    JSValueRef value, exception = NULL;
+    unsigned i;
+
+    for (i = 0; i < length; i++, dst += to->size) {
+        if (!(value = JSObjectGetPropertyAtIndex(ctx, array, i, &exception))) {
+            JSException_to_PyErr(context, exception);
+            return -1;
+        }
+        if (!JSValueIsNumber(ctx, value)) {
+            PyErr_Format(PyExc_TypeError, "element %u is not a number", i);
+            return -1;
+        }
+        if (JSBuffer_store(to, dst, JSValueToNumber(ctx, value, NULL)) < 0) {
+            PyErr_Format(PyExc_OverflowError, "element %u does not fit dtype '%c'",
+                         i, to->code);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* returns a new array.array of length zeroed elements */
+static PyObject *
+JSBuffer_newArray(const JSBufferType *type, size_t length)
+{
+    PyObject *one, *result;
+    char zero[sizeof(double) * 2] = {0};
+
+    if (JSBuffer_loadArrayClass() < 0)
+        return NULL;
+    if (!(one = PyObject_CallFunction(array_class, "cs#", type->code, zero,
+                                      (int)type->size)))
+        return NULL;
+    result = PySequence_Repeat(one, (Py_ssize_t)length);
+    Py_DECREF(one);
+    return result;
+}
+
+PyObject *
+PyJSObject_toBuffer(PyJSObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"dtype", "out", NULL};
+    const char *dtype = NULL;
+    const JSBufferType *type = NULL, *from = NULL;
+    PyObject *out = Py_None, *result;
+    JSContextRef ctx;
+    JSTypedArrayType array;
+    JSValueRef value, exception = NULL;
+    JSBufferView view;
+    size_t length;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zO:js_to_buffer", kwlist, &dtype, &out))
+        return NULL;
+    if (dtype && !(type = JSBufferType_fromFormat(dtype))) {
+        PyErr_Format(PyExc_ValueError, "unsupported dtype '%.20s'", dtype);
+        return NULL;
+    }
+    if (!self->object) {
+        PyErr_SetString(PyExc_TypeError, "js_to_buffer() needs an array or a typed array");
+        return NULL;
+    }
+    ctx = self->context->context;
+    array = JSValueGetTypedArrayType(ctx, self->object, NULL);
+    if (array != kJSTypedArrayTypeNone) {
+        if (!(from = JSBufferType_ofArray(array))) {
+            PyErr_SetString(PyExc_TypeError, "js_to_buffer() does not support this typed array");
+            return NULL;
+        }
+        length = JSObjectGetTypedArrayLength(ctx, self->object, NULL);
+    } else if (JSValueIsArray(ctx, self->object)) {
+        if (!(value = JSObjectGetProperty(ctx, self->object, JSLengthString, &exception)))
+            return JSException_to_PyErr(self->context, exception);
+        length = (unsigned)JSValueToNumber(ctx, value, NULL);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "js_to_buffer() needs an array or a typed array");
+        return NULL;
+    }
+
+    if (out == Py_None) {
+        if (!type)
+            type = JSBUFFER_DOUBLE;
+        /* array.array has no 64-bit type codes in Python 2 */
+        if (type->code == 'q' || type->code == 'Q') {
+            PyErr_Format(PyExc_ValueError, "dtype '%c' needs out (array.array "
+                         "cannot hold it)", type->code);
+            return NULL;
+        }
+        if (!(result = JSBuffer_newArray(type, length)))
+            return NULL;
+    } else {
+        Py_INCREF(out);
+        result = out;
+    }
+    if (JSBufferView_acquire(&view, result, 1) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    if (!type) {
+        type = view.type ? view.type : JSBUFFER_DOUBLE;
+    } else if (view.type && !JSBufferType_same(type, view.type)) {
+        PyErr_Format(PyExc_ValueError, "dtype '%c' does not match out ('%c')",
+                     type->code, view.type->code);
+        goto error;
+    }
+    if ((size_t)view.length != length * type->size) {
+        PyErr_Format(PyExc_ValueError, "out holds %zd bytes, not %zu",
+                     view.length, length * type->size);
+        goto error;
+    }
+
+    if (from) {
+        const char *src = (char *)JSObjectGetTypedArrayBytesPtr(ctx, self->object, NULL) +
+            JSObjectGetTypedArrayByteOffset(ctx, self->object, NULL);
+        status = JSBuffer_convert(view.data, type, src, from, length);
+    } else {
+        status = JSBuffer_unbox(view.data, type, self->context, self->object, length);
+    }
+    if (status < 0)
+        goto error;
+    JSBufferView_release(&view);
+    return result;
+  error:
+    JSBufferView_release(&view);
+    Py_DECREF(result);
+    return NULL;
+}
+
+PyObject *
+PyJSContext_arrayFromBuffer(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"buf", "dtype", NULL};
+    const char *dtype = NULL;
+    const JSBufferType *type = NULL, *from;
+    PyObject *buf, *result = NULL;
+    JSTypedArrayType array;
+    JSObjectRef object;
+    JSValueRef exception = NULL;
+    JSBufferView view;
+    size_t length;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|z:array_from_buffer", kwlist,
+                                     &buf, &dtype))
+        return NULL;
+    if (dtype && !(type = JSBufferType_fromFormat(dtype))) {
+        PyErr_Format(PyExc_ValueError, "unsupported dtype '%.20s'", dtype);
+        return NULL;
+    }
+    if (JSBufferView_acquire(&view, buf, 0) < 0)
+        return NULL;
+    /* untyped memory (such as a str) is bytes */
+    from = view.type ? view.type : JSBUFFER_BYTE;
+    if (view.length % from->size) {
+        PyErr_Format(PyExc_ValueError, "buffer size is not a multiple of %zu", from->size);
+        goto finally;
+    }
+    length = view.length / from->size;
+    array = JSBufferType_array(type ? type : from);
+    type = JSBufferType_ofArray(array);
+
+    if (!(object = JSObjectMakeTypedArray(self->context, array, length, &exception))) {
+        JSException_to_PyErr(self, exception);
+        goto finally;
+    }
+    if (JSBuffer_convert(JSObjectGetTypedArrayBytesPtr(self->context, object, NULL),
+                         type, view.data, from, length) < 0)
+        goto finally;
+    result = JSValue_to_PyJSObject(object, &self->dummy);
+  finally:
+    JSBufferView_release(&view);
+    return result;
+}
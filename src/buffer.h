@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+/* An element type of a buffer, named by its struct/array typecode */
+typedef struct JSBufferType {
+    char                code;
+    char                kind;       /* 'i'nteger, 'u'nsigned or 'f'loat */
+    size_t              size;
+} JSBufferType;
+
+/* JSObject.js_to_buffer(dtype=None, out=None): copies the numbers of an array
+   or a typed array into a new array.array (or out, any writable buffer)
+   in one pass; typed arrays of the same element type are memcpy'd */
+PyObject *PyJSObject_toBuffer(PyJSObject *self, PyObject *args, PyObject *kwds);
+
+/* Context.array_from_buffer(buf, dtype=None): returns a new typed array
+   holding the elements of a buffer (array.array, str, bytearray, numpy
+   arrays, ...), converted to dtype if given */
+PyObject *PyJSContext_arrayFromBuffer(PyJSContext *self, PyObject *args, PyObject *kwds);
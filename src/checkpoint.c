@@ -0,0 +1,113 @@
+#include <Python.h>
+
+#include "jscore.h"
+#include "conversions.h"
+#include "eventloop.h"
+#include "checkpoint.h"
+
+/* records the own properties of global, returning a function that restores
+   them and returns the number of properties it changed. The functions it
+   relies on are captured up front, so a script replacing them (or the
+   prototypes' methods) cannot break the restore. Globals declared with var
+   cannot be deleted: they are set to undefined instead, and kept in the
+   checkpoint so later resets count them only if they changed again */
+static const char *JSCheckpoint_source =
+    "(function (global) {"
+    "    var ownKeys = Reflect.ownKeys, getDesc = Object.getOwnPropertyDescriptor,"
+    "        define = Object.defineProperty, same = Object.is,"
+    "        keys = ownKeys(global), descs = [], saved = Object.create(null), i;"
+    "    for (i = 0; i < keys.length; i++) {"
+    "        descs[i] = getDesc(global, keys[i]);"
+    "        saved[keys[i]] = true;"
+    "    }"
+    "    return function () {"
+    "        var now = ownKeys(global), changed = 0, i, d, c;"
+    "        for (i = 0; i < now.length; i++) {"
+    "            if (!(now[i] in saved)) {"
+    "                if (!delete global[now[i]]) {"
+    "                    global[now[i]] = undefined;"
+    "                    saved[now[i]] = true;"
+    "                    descs[keys.length] = getDesc(global, now[i]);"
+    "                    keys[keys.length] = now[i];"
+    "                }"
+    "                changed++;"
+    "            }"
+    "        }"
+    "        for (i = 0; i < keys.length; i++) {"
+    "            d = descs[i];"
+    "            c = getDesc(global, keys[i]);"
+    "            if (c && c.enumerable === d.enumerable && c.configurable === d.configurable &&"
+    "                ('value' in d ? c.writable === d.writable && same(c.value, d.value)"
+    "                              : c.get === d.get && c.set === d.set))"
+    "                continue;"
+    "            try {"
+    "                define(global, keys[i], d);"
+    "            } catch (e) {"
+    "                if ('value' in d) global[keys[i]] = d.value;"
+    "            }"
+    "            changed++;"
+    "        }"
+    "        return changed;"
+    "    };"
+    "})";
+
+PyObject *
+PyJSContext_checkpoint(PyJSContext *self)
+{
+    JSGlobalContextRef ctx = self->context;
+    JSValueRef value, global, exception = NULL;
+    JSObjectRef recorder, restore;
+    JSStringRef source;
+
+    source = JSStringCreateWithUTF8CString(JSCheckpoint_source);
+    value = JSEvaluateScript(ctx, source, NULL, NULL, 1, &exception);
+    JSStringRelease(source);
+    if (!value || !(recorder = JSValueToObject(ctx, value, &exception))) {
+        return JSException_to_PyErr(self, exception);
+    }
+    global = JSContextGetGlobalObject(ctx);
+    if (!(value = JSObjectCallAsFunction(ctx, recorder, NULL, 1, &global, &exception)) ||
+        !(restore = JSValueToObject(ctx, value, &exception))) {
+        return JSException_to_PyErr(self, exception);
+    }
+    PyJSCheckpoint_clearContext(self);
+    JSValueProtect(ctx, restore);
+    self->restore = restore;
+    Py_RETURN_NONE;
+}
+
+PyObject *
+PyJSContext_reset(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"gc", NULL};
+    JSValueRef value, exception = NULL;
+    int gc = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:reset", kwlist, &gc))
+        return NULL;
+    if (!self->restore) {
+        PyErr_SetString(PyExc_ValueError, "reset() needs a checkpoint()");
+        return NULL;
+    }
+    /* timers scheduled since would run against the restored globals */
+    PyJSEventLoop_clearTimers(self);
+    value = JSObjectCallAsFunction(self->context, self->restore, NULL, 0, NULL, &exception);
+    if (!value) {
+        return JSException_to_PyErr(self, exception);
+    }
+    /* JSGarbageCollect() asks the VM to collect soon; it does not block
+       on a full collection */
+    if (gc) {
+        JSGarbageCollect(self->context);
+    }
+    return PyInt_FromLong((long)JSValueToNumber(self->context, value, NULL));
+}
+
+void
+PyJSCheckpoint_clearContext(PyJSContext *context)
+{
+    if (context->restore) {
+        JSValueUnprotect(context->context, context->restore);
+        context->restore = NULL;
+    }
+}
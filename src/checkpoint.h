@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+/* Context.checkpoint(): records the own properties of the global object
+   (names, symbols and their descriptors), typically after the prelude;
+   returns None, or NULL with an exception set */
+PyObject *PyJSContext_checkpoint(PyJSContext *self);
+
+/* Context.reset(gc=False): restores the global object to the checkpoint,
+   deleting the globals added since and redefining the ones changed, and
+   drops pending timers; objects reachable from the globals are not rolled
+   back, nor are let, const and class declarations, which are not properties
+   of the global object. returns the number of globals restored, or NULL with an exception
+   set */
+PyObject *PyJSContext_reset(PyJSContext *self, PyObject *args, PyObject *kwds);
+
+/* releases the checkpoint of the context (before the context is released) */
+void PyJSCheckpoint_clearContext(PyJSContext *context);
@@ -0,0 +1,267 @@
+#include "jscore.h"
+#include "jsobj.h"
+#include "conversions.h"
+#include "clone.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Maps the objects already cloned to their copies, so that shared
+   references stay shared and cycles terminate. The copies in the map are
+   kept alive by the C stack (while they are being filled) or by their
+   parents (afterwards) */
+typedef struct CloneEntry {
+    JSObjectRef         from;
+    JSObjectRef         to;
+} CloneEntry;
+
+typedef struct CloneMemo {
+    CloneEntry          *entries;
+    size_t              capacity;   /* a power of two */
+    size_t              used;
+} CloneMemo;
+
+typedef struct CloneState {
+    PyJSContext         *to;
+    PyJSContext         *from;
+    CloneMemo           memo;
+    size_t              bytes;
+} CloneState;
+
+static size_t
+CloneMemo_hash(JSObjectRef object)
+{
+    return (size_t)(((uintptr_t)object >> 4) * 2654435761u);
+}
+
+static JSObjectRef
+CloneMemo_get(CloneMemo *memo, JSObjectRef from)
+{
+    size_t i;
+
+    if (!memo->capacity) {
+        return NULL;
+    }
+    for (i = CloneMemo_hash(from) & (memo->capacity - 1);
+         memo->entries[i].from;
+         i = (i + 1) & (memo->capacity - 1)) {
+        if (memo->entries[i].from == from) {
+            return memo->entries[i].to;
+        }
+    }
+    return NULL;
+}
+
+/* returns -1 with a Python exception set if memory is exhausted */
+static int
+CloneMemo_put(CloneMemo *memo, JSObjectRef from, JSObjectRef to)
+{
+    size_t i;
+
+    if ((memo->used + 1) * 2 > memo->capacity) {
+        CloneMemo grown;
+        grown.capacity = memo->capacity ? memo->capacity * 2 : 64;
+        grown.used = 0;
+        if (!(grown.entries = calloc(grown.capacity, sizeof(CloneEntry)))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < memo->capacity; i++) {
+            if (memo->entries[i].from) {
+                CloneMemo_put(&grown, memo->entries[i].from, memo->entries[i].to);
+            }
+        }
+        free(memo->entries);
+        *memo = grown;
+    }
+    for (i = CloneMemo_hash(from) & (memo->capacity - 1);
+         memo->entries[i].from;
+         i = (i + 1) & (memo->capacity - 1))
+        ;
+    memo->entries[i].from = from;
+    memo->entries[i].to = to;
+    memo->used++;
+    return 0;
+}
+
+static JSValueRef JSValue_cloneValue(CloneState *state, JSValueRef value);
+
+static JSObjectRef
+JSValue_cloneTypedArray(CloneState *state, JSObjectRef object, JSTypedArrayType type)
+{
+    JSContextRef from = state->from->context, to = state->to->context;
+    JSValueRef exception = NULL;
+    JSObjectRef copy;
+    size_t length;
+    char *src, *dst;
+
+    if (type == kJSTypedArrayTypeArrayBuffer) {
+        /* there is no ArrayBuffer constructor in the API: make a byte view
+           and take its buffer */
+        length = JSObjectGetArrayBufferByteLength(from, object, NULL);
+        src = JSObjectGetArrayBufferBytesPtr(from, object, NULL);
+        if (!(copy = JSObjectMakeTypedArray(to, kJSTypedArrayTypeUint8Array, length, &exception))) {
+            goto err;
+        }
+        dst = JSObjectGetTypedArrayBytesPtr(to, copy, NULL);
+        copy = JSObjectGetTypedArrayBuffer(to, copy, NULL);
+    } else {
+        length = JSObjectGetTypedArrayByteLength(from, object, NULL);
+        src = (char *)JSObjectGetTypedArrayBytesPtr(from, object, NULL) +
+            JSObjectGetTypedArrayByteOffset(from, object, NULL);
+        if (!(copy = JSObjectMakeTypedArray(to, type,
+                JSObjectGetTypedArrayLength(from, object, NULL), &exception))) {
+            goto err;
+        }
+        dst = JSObjectGetTypedArrayBytesPtr(to, copy, NULL);
+    }
+    if (length) {
+        memcpy(dst, src, length);
+    }
+    state->bytes += length;
+    return copy;
+  err:
+    JSException_to_PyErr(state->to, exception);
+    return NULL;
+}
+
+static JSObjectRef
+JSValue_cloneObject(CloneState *state, JSObjectRef object)
+{
+    JSContextRef from = state->from->context, to = state->to->context;
+    JSValueRef exception = NULL, item, copied;
+    JSObjectRef copy;
+    JSTypedArrayType type;
+    size_t i, count;
+
+    if ((copy = CloneMemo_get(&state->memo, object))) {
+        return copy;
+    }
+    if (JSValueIsObjectOfClass(from, object, JSPyClass)) {
+        JSPrivateData *data = JSObjectGetPrivate(object);
+        copy = PyJS_new(state->to, data->obj);
+    } else if (JSObjectIsFunction(from, object)) {
+        PyErr_SetString(PyExc_TypeError, "functions cannot be cloned");
+        return NULL;
+    } else if ((type = JSValueGetTypedArrayType(from, object, NULL)) != kJSTypedArrayTypeNone) {
+        copy = JSValue_cloneTypedArray(state, object, type);
+    } else if (JSValueIsArray(from, object)) {
+        if (!(item = JSObjectGetProperty(from, object, JSLengthString, &exception))) {
+            goto from_err;
+        }
+        count = (size_t)JSValueToNumber(from, item, NULL);
+        if (!(copy = JSObjectMakeArray(to, 0, NULL, &exception)) ||
+            CloneMemo_put(&state->memo, object, copy) < 0) {
+            goto to_err;
+        }
+        for (i = 0; i < count; i++) {
+            if (!(item = JSObjectGetPropertyAtIndex(from, object, (unsigned)i, &exception))) {
+                goto from_err;
+            }
+            if (!(copied = JSValue_cloneValue(state, item))) {
+                return NULL;
+            }
+            JSObjectSetPropertyAtIndex(to, copy, (unsigned)i, copied, &exception);
+            if (exception) {
+                goto to_err;
+            }
+        }
+        return copy;
+    } else {
+        JSPropertyNameArrayRef names;
+        copy = JSObjectMake(to, NULL, NULL);
+        if (CloneMemo_put(&state->memo, object, copy) < 0) {
+            return NULL;
+        }
+        names = JSObjectCopyPropertyNames(from, object);
+        count = JSPropertyNameArrayGetCount(names);
+        for (i = 0; i < count; i++) {
+            JSStringRef name = JSPropertyNameArrayGetNameAtIndex(names, i);
+            if (!(item = JSObjectGetProperty(from, object, name, &exception))) {
+                JSPropertyNameArrayRelease(names);
+                goto from_err;
+            }
+            if (!(copied = JSValue_cloneValue(state, item))) {
+                JSPropertyNameArrayRelease(names);
+                return NULL;
+            }
+            state->bytes += JSStringGetLength(name) * sizeof(JSChar);
+            JSObjectSetProperty(to, copy, name, copied, kJSPropertyAttributeNone, &exception);
+            if (exception) {
+                JSPropertyNameArrayRelease(names);
+                goto to_err;
+            }
+        }
+        JSPropertyNameArrayRelease(names);
+        return copy;
+    }
+    if (copy && CloneMemo_put(&state->memo, object, copy) < 0) {
+        return NULL;
+    }
+    return copy;
+  from_err:
+    JSException_to_PyErr(state->from, exception);
+    return NULL;
+  to_err:
+    if (exception) {
+        JSException_to_PyErr(state->to, exception);
+    }
+    return NULL;
+}
+
+static JSValueRef
+JSValue_cloneValue(CloneState *state, JSValueRef value)
+{
+    JSContextRef from = state->from->context, to = state->to->context;
+    JSValueRef exception = NULL, result;
+    JSObjectRef object;
+    JSStringRef jsstr;
+
+    switch (JSValueGetType(from, value)) {
+        case kJSTypeUndefined:
+            return JSValueMakeUndefined(to);
+        case kJSTypeNull:
+            return JSValueMakeNull(to);
+        case kJSTypeBoolean:
+            return JSValueMakeBoolean(to, JSValueToBoolean(from, value));
+        case kJSTypeNumber:
+            state->bytes += sizeof(double);
+            return JSValueMakeNumber(to, JSValueToNumber(from, value, NULL));
+        case kJSTypeString:
+            /* JSStrings are not bound to a context */
+            if (!(jsstr = JSValueToStringCopy(from, value, &exception))) {
+                JSException_to_PyErr(state->from, exception);
+                return NULL;
+            }
+            state->bytes += JSStringGetLength(jsstr) * sizeof(JSChar);
+            result = JSValueMakeString(to, jsstr);
+            JSStringRelease(jsstr);
+            return result;
+        case kJSTypeObject:
+            if (Py_EnterRecursiveCall(" while cloning a value")) {
+                return NULL;
+            }
+            if ((object = JSValueToObject(from, value, &exception))) {
+                result = JSValue_cloneObject(state, object);
+            } else {
+                JSException_to_PyErr(state->from, exception);
+                result = NULL;
+            }
+            Py_LeaveRecursiveCall();
+            return result;
+        default:
+            PyErr_SetString(PyExc_TypeError, "symbols and BigInts cannot be cloned");
+            return NULL;
+    }
+}
+
+JSValueRef
+JSValue_clone(PyJSContext *to, PyJSContext *from, JSValueRef value, size_t *bytes)
+{
+    CloneState state = {to, from, {NULL, 0, 0}, 0};
+    JSValueRef result = JSValue_cloneValue(&state, value);
+
+    free(state.memo.entries);
+    *bytes += state.bytes;
+    return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+/* copies a value of the context from into the context to: primitives,
+   strings, arrays, plain objects (their enumerable properties), typed
+   arrays and ArrayBuffers, preserving shared references and cycles;
+   Python objects are wrapped again in the target context.
+   adds the number of bytes of data copied to *bytes.
+   returns a JSValueRef (NOT protected/retained), or NULL with a Python
+   exception set */
+JSValueRef JSValue_clone(PyJSContext *to, PyJSContext *from, JSValueRef value,
+                         size_t *bytes);
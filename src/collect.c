@@ -0,0 +1,515 @@
+#include "jscore.h"
+#include "jsobj.h"
+#include "conversions.h"
+#include "collect.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_JSSYNCGC
+/* exported by JavaScriptCore, but declared only in its private headers;
+   collects and sweeps before it returns, so the finalizers have run */
+extern void JSSynchronousGarbageCollectForDebugging(JSContextRef ctx);
+#endif
+
+/* The Python objects reachable from the objects proxied by a context, and
+   how many references each has from outside the graph, as in the cycle
+   collector's own pass. Nothing here allocates Python objects, so the
+   collector cannot run (and free objects of the graph) while it is built.
+   Other contexts are left out: the references their proxies hold count as
+   outside references */
+typedef struct CollectGraph {
+    PyObject            **objects;  /* borrowed */
+    Py_ssize_t          *refs;      /* references from outside the graph */
+    Py_ssize_t          *seen;      /* reachable (-1) or last walk visiting it */
+    Py_ssize_t          size;
+    Py_ssize_t          capacity;
+    Py_ssize_t          *slots;     /* index + 1 of the object hashed there */
+    size_t              nslots;     /* a power of two */
+    Py_ssize_t          *stack;
+    Py_ssize_t          depth;
+    Py_ssize_t          walk;       /* number of the current walk */
+    Py_ssize_t          *visited;   /* by the current walk */
+    Py_ssize_t          nvisited;
+} CollectGraph;
+
+/* a pair of a proxy and the wrappers reachable only through its object */
+typedef struct CollectLink {
+    JSObjectRef         proxy;
+    Py_ssize_t          start;      /* in the list of weak wrapper indices */
+    Py_ssize_t          count;
+} CollectLink;
+
+/* the JS side of a collection: the ephemerons (proxy -> wrapped objects)
+   and weak references telling which wrapped objects survived; null without
+   WeakRef, as nothing else tells whether a wrapped object was collected */
+static const char *JSCollect_stateSource =
+    "(function (WeakRef) {"
+    "    if (typeof WeakRef !== 'function') return null;"
+    "    var links = new WeakMap(), refs = [];"
+    "    return {"
+    "        link: function (proxy, objects) { links.set(proxy, objects); },"
+    "        watch: function (object) { refs.push(new WeakRef(object)); },"
+    "        alive: function (i) { return refs[i].deref() !== undefined; }"
+    "    };"
+    "})(this.WeakRef)";
+
+static size_t
+CollectGraph_hash(PyObject *object)
+{
+    return (size_t)(((uintptr_t)object >> 4) * 2654435761u);
+}
+
+static Py_ssize_t
+CollectGraph_find(CollectGraph *g, PyObject *object)
+{
+    size_t i;
+
+    if (!g->nslots) {
+        return -1;
+    }
+    for (i = CollectGraph_hash(object) & (g->nslots - 1);
+         g->slots[i];
+         i = (i + 1) & (g->nslots - 1)) {
+        if (g->objects[g->slots[i] - 1] == object) {
+            return g->slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+static int
+CollectGraph_grow(CollectGraph *g)
+{
+    Py_ssize_t i, capacity = g->capacity ? g->capacity * 2 : 256;
+    size_t j, nslots = (size_t)capacity * 2;
+    void *p;
+
+    if (!(p = realloc(g->objects, capacity * sizeof(PyObject *)))) return -1;
+    g->objects = p;
+    if (!(p = realloc(g->refs, capacity * sizeof(Py_ssize_t)))) return -1;
+    g->refs = p;
+    if (!(p = realloc(g->seen, capacity * sizeof(Py_ssize_t)))) return -1;
+    g->seen = p;
+    if (!(p = realloc(g->stack, capacity * sizeof(Py_ssize_t)))) return -1;
+    g->stack = p;
+    if (!(p = realloc(g->visited, capacity * sizeof(Py_ssize_t)))) return -1;
+    g->visited = p;
+    if (!(p = calloc(nslots, sizeof(Py_ssize_t)))) return -1;
+    free(g->slots);
+    g->slots = p;
+    g->nslots = nslots;
+    g->capacity = capacity;
+    for (i = 0; i < g->size; i++) {
+        for (j = CollectGraph_hash(g->objects[i]) & (nslots - 1);
+             g->slots[j];
+             j = (j + 1) & (nslots - 1))
+            ;
+        g->slots[j] = i + 1;
+    }
+    return 0;
+}
+
+/* returns -1 if memory is exhausted */
+static int
+CollectGraph_add(CollectGraph *g, PyObject *object)
+{
+    size_t i;
+
+    if (CollectGraph_find(g, object) >= 0) {
+        return 0;
+    }
+    if (g->size == g->capacity && CollectGraph_grow(g) < 0) {
+        return -1;
+    }
+    for (i = CollectGraph_hash(object) & (g->nslots - 1);
+         g->slots[i];
+         i = (i + 1) & (g->nslots - 1))
+        ;
+    g->slots[i] = g->size + 1;
+    g->objects[g->size] = object;
+    g->seen[g->size] = 0;
+    g->size++;
+    return 0;
+}
+
+static void
+CollectGraph_free(CollectGraph *g)
+{
+    free(g->objects);
+    free(g->refs);
+    free(g->seen);
+    free(g->stack);
+    free(g->visited);
+    free(g->slots);
+}
+
+/* whether the cycle collector would leave the object in gc.garbage rather
+   than free it (as gcmodule's has_finalizer); what it reaches keeps its
+   roots, as it may outlive the collection */
+static int
+CollectGraph_hasFinalizer(PyObject *object, PyObject *del_str)
+{
+    if (PyInstance_Check(object)) {
+        return _PyInstance_Lookup(object, del_str) != NULL;
+    }
+    if (PyType_HasFeature(Py_TYPE(object), Py_TPFLAGS_HEAPTYPE)) {
+        return Py_TYPE(object)->tp_del != NULL;
+    }
+    if (PyGen_CheckExact(object)) {
+        return PyGen_NeedsFinalizing((PyGenObject *)object);
+    }
+    return 0;
+}
+
+/* contexts are not followed: a context reaches every object it proxies */
+static int
+CollectGraph_follows(PyObject *object)
+{
+    return PyObject_IS_GC(object) && Py_TYPE(object)->tp_traverse &&
+        !PyObject_TypeCheck(object, &jscore_PyJSContextType);
+}
+
+static int
+CollectGraph_traverse(CollectGraph *g, PyObject *object, visitproc visit)
+{
+    if (!CollectGraph_follows(object)) {
+        return 0;
+    }
+    return Py_TYPE(object)->tp_traverse(object, visit, g);
+}
+
+static int
+visit_add(PyObject *object, void *arg)
+{
+    if (!CollectGraph_follows(object)) {
+        return 0;
+    }
+    return CollectGraph_add((CollectGraph *)arg, object);
+}
+
+static int
+visit_decref(PyObject *object, void *arg)
+{
+    CollectGraph *g = arg;
+    Py_ssize_t i = CollectGraph_find(g, object);
+
+    if (i >= 0) {
+        g->refs[i]--;
+    }
+    return 0;
+}
+
+/* pushes the objects not yet visited by the current walk; a walk number of
+   -1 marks what is reachable from outside */
+static int
+visit_push(PyObject *object, void *arg)
+{
+    CollectGraph *g = arg;
+    Py_ssize_t i = CollectGraph_find(g, object);
+
+    if (i >= 0 && g->seen[i] != -1 && g->seen[i] != g->walk) {
+        g->seen[i] = g->walk;
+        g->stack[g->depth++] = i;
+        g->visited[g->nvisited++] = i;
+    }
+    return 0;
+}
+
+static void
+CollectGraph_walk(CollectGraph *g, Py_ssize_t from)
+{
+    g->seen[from] = g->walk;
+    g->stack[g->depth++] = from;
+    g->visited[0] = from;
+    g->nvisited = 1;
+    while (g->depth) {
+        CollectGraph_traverse(g, g->objects[g->stack[--g->depth]], visit_push);
+    }
+}
+
+/* whether the object is a wrapper of the context holding a root */
+static int
+PyJSContext_ownsWrapper(PyJSContext *self, PyObject *object)
+{
+    PyJSObject *wrapper = (PyJSObject *)object;
+
+    return Py_TYPE(object) == &jscore_PyJSObjectType && wrapper->context == self &&
+        wrapper->object && wrapper->weak_index < 0;
+}
+
+/* calls a method of the JS collection state; returns NULL with a Python
+   exception set on failure */
+static JSValueRef
+JSCollect_call(PyJSContext *self, JSObjectRef state, const char *name,
+               size_t argc, const JSValueRef argv[])
+{
+    JSStringRef jsname = JSStringCreateWithUTF8CString(name);
+    JSValueRef value, exception = NULL;
+    JSObjectRef function = NULL;
+
+    value = JSObjectGetProperty(self->context, state, jsname, &exception);
+    JSStringRelease(jsname);
+    if (value && (function = JSValueToObject(self->context, value, &exception))) {
+        value = JSObjectCallAsFunction(self->context, function, state, argc, argv, &exception);
+    }
+    if (!function || !value) {
+        JSException_to_PyErr(self, exception);
+        return NULL;
+    }
+    return value;
+}
+
+/* collects and sweeps the heap of the context, running the finalizers of
+   the unreachable proxies before it returns */
+static void
+JSCollect_now(JSGlobalContextRef ctx)
+{
+#ifdef HAVE_JSSYNCGC
+    JSSynchronousGarbageCollectForDebugging(ctx);
+#else
+    JSGarbageCollect(ctx);
+#endif
+}
+
+/* finds the wrappers reachable only from proxied objects, and for each
+   proxy, the wrappers its object leads to; returns the number of such
+   wrappers (listed, with a new reference, in self->weak_wrappers), or -1 */
+static Py_ssize_t
+PyJSContext_findCycles(PyJSContext *self, CollectLink **links, Py_ssize_t *nlinks,
+                       Py_ssize_t **members)
+{
+    static PyObject *del_str = NULL;
+    CollectGraph g;
+    JSPrivateData *data;
+    Py_ssize_t i, nweak = 0, nmembers = 0, capacity = 0;
+
+    if (!del_str && !(del_str = PyString_InternFromString("__del__"))) {
+        return -1;
+    }
+    memset(&g, 0, sizeof(g));
+    *links = NULL;
+    *nlinks = 0;
+    *members = NULL;
+    for (data = self->proxies; data; data = data->next) {
+        if (CollectGraph_add(&g, data->obj) < 0)
+            goto nomem;
+    }
+    /* the graph grows while it is walked */
+    for (i = 0; i < g.size; i++) {
+        if (CollectGraph_traverse(&g, g.objects[i], visit_add) < 0)
+            goto nomem;
+    }
+    for (i = 0; i < g.size; i++) {
+        g.refs[i] = Py_REFCNT(g.objects[i]);
+    }
+    for (i = 0; i < g.size; i++) {
+        CollectGraph_traverse(&g, g.objects[i], visit_decref);
+    }
+    for (data = self->proxies; data; data = data->next) {
+        g.refs[CollectGraph_find(&g, data->obj)]--;
+    }
+    g.walk = -1;
+    for (i = 0; i < g.size; i++) {
+        if ((g.refs[i] > 0 || CollectGraph_hasFinalizer(g.objects[i], del_str)) &&
+            g.seen[i] != -1)
+            CollectGraph_walk(&g, i);
+    }
+    for (i = 0; i < g.size; i++) {
+        if (g.seen[i] != -1 && PyJSContext_ownsWrapper(self, g.objects[i]))
+            nweak++;
+    }
+    if (!nweak)
+        goto finally;
+    if (!(self->weak_wrappers = malloc(nweak * sizeof(PyJSObject *))) ||
+        !(*links = malloc(self->nproxies * sizeof(CollectLink))))
+        goto nomem;
+    for (i = 0; i < g.size; i++) {
+        if (g.seen[i] != -1 && PyJSContext_ownsWrapper(self, g.objects[i])) {
+            PyJSObject *wrapper = (PyJSObject *)g.objects[i];
+            Py_INCREF(wrapper);
+            wrapper->weak_index = self->nweak;
+            self->weak_wrappers[self->nweak++] = wrapper;
+        }
+    }
+    g.walk = 0;
+    for (data = self->proxies; data; data = data->next) {
+        CollectLink *link = &(*links)[*nlinks];
+        Py_ssize_t from = CollectGraph_find(&g, data->obj);
+        if (g.seen[from] == -1)
+            continue;
+        g.walk++;
+        CollectGraph_walk(&g, from);
+        link->proxy = data->object;
+        link->start = nmembers;
+        for (i = 0; i < g.nvisited; i++) {
+            PyJSObject *wrapper = (PyJSObject *)g.objects[g.visited[i]];
+            if (Py_TYPE(wrapper) != &jscore_PyJSObjectType ||
+                wrapper->weak_index < 0 || wrapper->context != self)
+                continue;
+            if (nmembers == capacity) {
+                Py_ssize_t *grown;
+                capacity = capacity ? capacity * 2 : 64;
+                if (!(grown = realloc(*members, capacity * sizeof(Py_ssize_t))))
+                    goto nomem;
+                *members = grown;
+            }
+            (*members)[nmembers++] = wrapper->weak_index;
+        }
+        link->count = nmembers - link->start;
+        if (link->count)
+            (*nlinks)++;
+    }
+    goto finally;
+  nomem:
+    PyErr_NoMemory();
+    nweak = -1;
+  finally:
+    CollectGraph_free(&g);
+    return nweak;
+}
+
+/* gives the roots back to the wrappers (which are all alive) */
+static void
+PyJSContext_endCollect(PyJSContext *self)
+{
+    Py_ssize_t k;
+
+    for (k = 0; k < self->nweak; k++) {
+        PyJSObject *wrapper = self->weak_wrappers[k];
+        if (wrapper) {
+            wrapper->weak_index = -1;
+            Py_DECREF(wrapper);
+        }
+    }
+    free(self->weak_wrappers);
+    self->weak_wrappers = NULL;
+    self->nweak = 0;
+}
+
+PyObject *
+PyJSContext_collect(PyJSContext *self)
+{
+    JSGlobalContextRef ctx = self->context;
+    JSStringRef source;
+    JSValueRef value, args[2], exception = NULL;
+    JSObjectRef state = NULL, *objects = NULL;
+    CollectLink *links = NULL;
+    Py_ssize_t *members = NULL;
+    Py_ssize_t before = self->nproxies, nlinks = 0, i, k;
+
+    if (self->weak_wrappers) {
+        PyErr_SetString(PyExc_RuntimeError, "collect() is already running");
+        return NULL;
+    }
+#ifndef HAVE_JSSYNCGC
+    /* JSGarbageCollect() only asks for a collection, whose finalizers run
+       at some later sweep, so nothing would tell which objects are gone */
+    PyErr_SetString(PyExc_NotImplementedError, "collect() needs a JavaScriptCore "
+                    "with JSSynchronousGarbageCollectForDebugging");
+    return NULL;
+#endif
+    source = JSStringCreateWithUTF8CString(JSCollect_stateSource);
+    value = JSEvaluateScript(ctx, source, NULL, NULL, 1, &exception);
+    JSStringRelease(source);
+    if (value && JSValueIsNull(ctx, value)) {
+        PyErr_SetString(PyExc_NotImplementedError,
+                        "collect() needs WeakRef, which this JavaScriptCore lacks");
+        return NULL;
+    }
+    if (!value || !(state = JSValueToObject(ctx, value, &exception))) {
+        return JSException_to_PyErr(self, exception);
+    }
+    JSValueProtect(ctx, state);
+    /* first release what the JS collector can release on its own */
+    JSCollect_now(ctx);
+    if (PyJSContext_findCycles(self, &links, &nlinks, &members) < 0) {
+        PyJSContext_endCollect(self);
+        goto finally;
+    }
+    if (!self->nweak)
+        goto finally;
+
+    /* the proxies are pinned while the ephemerons are set up */
+    for (i = 0; i < nlinks; i++) {
+        JSValueProtect(ctx, links[i].proxy);
+    }
+    if (!(objects = malloc(self->nweak * sizeof(JSObjectRef)))) {
+        PyErr_NoMemory();
+        goto abort;
+    }
+    for (i = 0; i < nlinks; i++) {
+        /* the wrapped objects are still protected by their wrappers */
+        for (k = 0; k < links[i].count; k++) {
+            objects[k] = self->weak_wrappers[members[links[i].start + k]]->object;
+        }
+        args[0] = links[i].proxy;
+        if (!(args[1] = JSObjectMakeArray(ctx, links[i].count,
+                                          (const JSValueRef *)objects, &exception))) {
+            JSException_to_PyErr(self, exception);
+            goto abort;
+        }
+        if (!JSCollect_call(self, state, "link", 2, args))
+            goto abort;
+    }
+    for (k = 0; k < self->nweak; k++) {
+        args[0] = self->weak_wrappers[k]->object;
+        if (!JSCollect_call(self, state, "watch", 1, args))
+            goto abort;
+    }
+
+    /* weak mode: only the ephemerons and the JS roots keep the wrapped
+       objects alive, so proxies in cycles are finalized, releasing their
+       Python objects, and then the wrappers those led to */
+    for (k = 0; k < self->nweak; k++) {
+        JSValueUnprotect(ctx, self->weak_wrappers[k]->object);
+    }
+    for (i = 0; i < nlinks; i++) {
+        JSValueUnprotect(ctx, links[i].proxy);
+    }
+    /* the collector scans the stack, so stale references are dropped */
+    args[0] = args[1] = value = NULL;
+    JSCollect_now(ctx);
+    for (k = 0; k < self->nweak; k++) {
+        PyJSObject *wrapper = self->weak_wrappers[k];
+        Py_XDECREF(wrapper);
+    }
+    PyGC_Collect();
+    for (k = 0; k < self->nweak; k++) {
+        PyJSObject *wrapper = self->weak_wrappers[k];
+        if (!wrapper)
+            continue;
+        args[0] = JSValueMakeNumber(ctx, (double)k);
+        value = JSCollect_call(self, state, "alive", 1, args);
+        /* the finalizers have run, so a wrapper still in use was reached
+           from outside the cycles, and its object kept */
+        assert(!value || JSValueToBoolean(ctx, value));
+        if (value && JSValueToBoolean(ctx, value)) {
+            JSValueProtect(ctx, wrapper->object);
+        } else if (value && !PyErr_Occurred()) {
+            PyErr_SetString(PyExc_SystemError,
+                            "collect() released the object of a wrapper in use");
+        }
+        wrapper->weak_index = -1;
+    }
+    free(self->weak_wrappers);
+    self->weak_wrappers = NULL;
+    self->nweak = 0;
+    goto finally;
+  abort:
+    for (i = 0; i < nlinks; i++) {
+        JSValueUnprotect(ctx, links[i].proxy);
+    }
+    PyJSContext_endCollect(self);
+  finally:
+    if (state) {
+        JSValueUnprotect(ctx, state);
+    }
+    free(objects);
+    free(links);
+    free(members);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    return PyInt_FromSsize_t(before - self->nproxies);
+}
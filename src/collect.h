@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+/* Context.collect(): releases the cycles that run through both heaps, where
+   Python objects proxied by the context reach wrappers of JS objects that
+   in turn reach the proxies. Neither collector sees the whole cycle, so the
+   wrappers found to be reachable only from proxied objects drop their roots
+   for one JS collection; a WeakMap keyed by the proxies keeps each wrapped
+   object alive for as long as a proxy leading to it survives. Whether a
+   wrapped object survived is told by a WeakRef once a synchronous
+   collection has run the finalizers, so without WeakRef, or a build without
+   JSSynchronousGarbageCollectForDebugging (HAVE_JSSYNCGC), this raises
+   NotImplementedError. Objects that the cycle collector would leave in
+   gc.garbage (those with __del__) and what they reach keep their roots.
+   returns the number of proxies released, or NULL with an exception set */
+PyObject *PyJSContext_collect(PyJSContext *self);
@@ -1,8 +1,15 @@
 #include "jscore.h"
 #include "jsobj.h"
 #include "conversions.h"
+#include "jsstring.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
+
+/* Number.MAX_SAFE_INTEGER: every integer of smaller magnitude is exactly
+   representable as a double */
+#define MAX_SAFE_INTEGER 9007199254740991LL
 
 PyObject *
 JSException_to_PyErr(PyJSContext *context, JSValueRef exception)
@@ -16,7 +23,7 @@ JSException_to_PyErr(PyJSContext *context, JSValueRef exception)
         assert(exception_object);
         JSPyErrPrivateData *data = JSObjectGetPrivate(exception_object);
         exc = data->exc_type;
-        val = data->exc_value;
+        val = data->base.obj;
         tb = data->exc_tb;
         Py_INCREF(exc);
         Py_INCREF(val);
@@ -61,6 +68,15 @@ set_JSException(PyJSContext *context, JSValueRef *exception)
     Py_XDECREF(tb);
 }
 
+void
+set_JSError(JSContextRef ctx, const char *message, JSValueRef *exception)
+{
+    JSStringRef string = JSStringCreateWithUTF8CString(message);
+    JSValueRef arg = JSValueMakeString(ctx, string);
+    JSStringRelease(string);
+    *exception = JSObjectMakeError(ctx, 1, &arg, NULL);
+}
+
 /* returns a new PyObject or NULL */
 PyObject *
 JSString_to_PyString(JSStringRef jsstr)
@@ -92,18 +108,181 @@ JSValue_to_PyString(PyJSContext *context, JSValueRef value)
     return pystr;
 }
 
+/* direct-mapped cache of interned property names, indexed by a hash of
+   their UTF-16 characters */
+#define KEY_CACHE_SIZE      256
+#define KEY_CACHE_MAXLEN    64
+
+static PyObject *key_cache[KEY_CACHE_SIZE];
+
+/* returns a new PyObject or NULL */
+PyObject *
+JSString_to_PyKey(JSStringRef jsstr)
+{
+    const JSChar *chars = JSStringGetCharactersPtr(jsstr);
+    size_t i, len = JSStringGetLength(jsstr);
+    unsigned int hash = 2166136261u;
+    PyObject **slot, *key;
+    char *str;
+    
+    if (len > KEY_CACHE_MAXLEN) {
+        return JSString_to_PyString(jsstr);
+    }
+    for (i = 0; i < len; i++) {
+        if (chars[i] >= 0x80) {
+            return JSString_to_PyString(jsstr);
+        }
+        hash = (hash ^ chars[i]) * 16777619u;
+    }
+    slot = &key_cache[hash % KEY_CACHE_SIZE];
+    if ((key = *slot) && PyString_GET_SIZE(key) == len) {
+        str = PyString_AS_STRING(key);
+        for (i = 0; i < len && str[i] == chars[i]; i++)
+            ;
+        if (i == len) {
+            Py_INCREF(key);
+            return key;
+        }
+    }
+    if (!(key = PyString_FromStringAndSize(NULL, len))) {
+        return NULL;
+    }
+    str = PyString_AS_STRING(key);
+    for (i = 0; i < len; i++) {
+        str[i] = (char)chars[i];
+    }
+    PyString_InternInPlace(&key);
+    Py_XDECREF(*slot);
+    Py_INCREF(key);
+    *slot = key;
+    return key;
+}
+
+/* returns a new JSStringRef or NULL */
+JSStringRef
+UTF8_to_JSString(const char *buffer, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)buffer;
+    const unsigned char *end = p + length;
+    JSChar *chars, *out;
+    JSStringRef jsstr;
+    
+    /* skip a byte order mark */
+    if (length >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+        p += 3;
+    }
+    /* a UTF-8 sequence never yields more UTF-16 units than it has bytes */
+    chars = (JSChar *)malloc((end - p + 1) * sizeof(JSChar));
+    if (chars == NULL) {
+        return NULL;
+    }
+    out = chars;
+    while (p < end) {
+        unsigned int c = *p;
+        int n, i;
+        if (c < 0x80) {
+            *out++ = c;
+            p++;
+            continue;
+        }
+        if (c >= 0xC2 && c <= 0xDF) {
+            n = 1; c &= 0x1F;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            n = 2; c &= 0x0F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 3; c &= 0x07;
+        } else {
+            *out++ = 0xFFFD;
+            p++;
+            continue;
+        }
+        if (end - p <= n) {
+            n = -1;
+        }
+        for (i = 1; i <= n; i++) {
+            if ((p[i] & 0xC0) != 0x80) {
+                n = -1;
+                break;
+            }
+            c = (c << 6) | (p[i] & 0x3F);
+        }
+        /* reject truncated, overlong, surrogate and out-of-range sequences */
+        if (n < 0 || (n == 2 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+            (n == 3 && (c < 0x10000 || c > 0x10FFFF))) {
+            *out++ = 0xFFFD;
+            p++;
+            continue;
+        }
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            *out++ = 0xD800 | (c >> 10);
+            *out++ = 0xDC00 | (c & 0x3FF);
+        } else {
+            *out++ = c;
+        }
+        p += n + 1;
+    }
+    jsstr = JSStringCreateWithCharacters(chars, out - chars);
+    free(chars);
+    return jsstr;
+}
+
 /* returns a new JSStringRef or NULL */
 JSStringRef
 PyUnicode_to_JSString(PyObject *obj)
 {
+#if Py_UNICODE_SIZE == 2
+    /* Py_UNICODE is UTF-16 already: no transcoding needed */
+    return JSStringCreateWithCharacters((const JSChar *)PyUnicode_AS_UNICODE(obj),
+        PyUnicode_GET_SIZE(obj));
+#else
     JSStringRef value = NULL;
-    PyObject *pystr = PyUnicode_AsUTF8String(obj);
+#ifdef WORDS_BIGENDIAN
+    int byteorder = 1;
+#else
+    int byteorder = -1;
+#endif
+    /* an explicit byte order suppresses the BOM */
+    PyObject *pystr = PyUnicode_EncodeUTF16(PyUnicode_AS_UNICODE(obj),
+        PyUnicode_GET_SIZE(obj), NULL, byteorder);
     if (pystr) {
-        char *str = PyString_AsString(pystr);
-        value = JSStringCreateWithUTF8CString(str);
+        value = JSStringCreateWithCharacters((const JSChar *)PyString_AS_STRING(pystr),
+            PyString_GET_SIZE(pystr) / sizeof(JSChar));
         Py_DECREF(pystr);
     }
     return value;
+#endif
+}
+
+/* returns a new JSStringRef, or NULL (without an exception set) if the
+   str contains non-ASCII characters */
+static JSStringRef
+PyASCIIString_to_JSString(PyObject *obj)
+{
+    JSChar stackbuf[128];
+    JSChar *buffer = stackbuf;
+    const unsigned char *str = (const unsigned char *)PyString_AS_STRING(obj);
+    Py_ssize_t i, len = PyString_GET_SIZE(obj);
+    JSStringRef value;
+    
+    if (len > sizeof(stackbuf) / sizeof(JSChar)) {
+        buffer = (JSChar *)malloc(len * sizeof(JSChar));
+        if (buffer == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    for (i = 0; i < len; i++) {
+        if (str[i] & 0x80) {
+            break;
+        }
+        buffer[i] = str[i];
+    }
+    value = (i == len) ? JSStringCreateWithCharacters(buffer, len) : NULL;
+    if (buffer != stackbuf) {
+        free(buffer);
+    }
+    return value;
 }
 
 /* returns a new JSStringRef or NULL */
@@ -111,11 +290,17 @@ JSStringRef
 PyString_to_JSString(PyObject *obj)
 {
     PyObject *unicode;
+    JSStringRef jsstr;
     if (PyUnicode_Check(obj)) {
         return PyUnicode_to_JSString(obj);
     } else if (PyString_Check(obj)) {
+        /* attribute names and most str values are ASCII: skip the
+           intermediate unicode object for them */
+        if ((jsstr = PyASCIIString_to_JSString(obj)) || PyErr_Occurred()) {
+            return jsstr;
+        }
         if ((unicode = PyObject_Unicode(obj))) {
-            JSStringRef jsstr = PyUnicode_to_JSString(unicode);
+            jsstr = PyUnicode_to_JSString(unicode);
             Py_DECREF(unicode);
             return jsstr;
         }
@@ -130,8 +315,10 @@ PyObject_to_JSString(PyObject *obj)
 {
     PyObject *unicode = NULL;
     
-    if (PyUnicode_Check(obj)) {
-        return PyUnicode_to_JSString(obj);
+    if (PyUnicode_Check(obj) || PyString_Check(obj)) {
+        return PyString_to_JSString(obj);
+    } else if (PyJSString_Check(obj)) {
+        return JSStringRetain(((PyJSString *)obj)->string);
     } else if ((unicode = PyObject_Unicode(obj))) {
         JSStringRef jsstr = PyUnicode_to_JSString(unicode);
         Py_DECREF(unicode);
@@ -140,6 +327,88 @@ PyObject_to_JSString(PyObject *obj)
     return NULL;
 }
 
+PyObject *
+JSNumber_to_PyNumber(int flags, double number)
+{
+    if ((flags & INT_NUMBERS) &&
+        number >= -MAX_SAFE_INTEGER && number <= MAX_SAFE_INTEGER &&
+        number == floor(number) && !(number == 0 && signbit(number))) {
+        PY_LONG_LONG n = (PY_LONG_LONG)number;
+        if (n >= LONG_MIN && n <= LONG_MAX) {
+            return PyInt_FromLong((long)n);
+        }
+        return PyLong_FromLongLong(n);
+    }
+    return PyFloat_FromDouble(number);
+}
+
+#ifdef HAVE_JSBIGINT
+/* returns a new PyObject or NULL */
+static PyObject *
+JSBigInt_to_PyLong(PyJSContext *context, JSValueRef value)
+{
+    JSStringRef jsstr = NULL;
+    JSValueRef exception = NULL;
+    PyObject *result;
+    char *buffer;
+    
+    jsstr = JSValueToStringCopy(context->context, value, &exception);
+    if (!jsstr) {
+        return JSException_to_PyErr(context, exception);
+    }
+    buffer = (char *)malloc(JSStringGetMaximumUTF8CStringSize(jsstr));
+    if (buffer == NULL) {
+        JSStringRelease(jsstr);
+        return PyErr_NoMemory();
+    }
+    JSStringGetUTF8CString(jsstr, buffer, JSStringGetMaximumUTF8CStringSize(jsstr));
+    JSStringRelease(jsstr);
+    result = PyLong_FromString(buffer, NULL, 10);
+    free(buffer);
+    return result;
+}
+#endif
+
+/* returns a JSValueRef (NOT protected/retained), or NULL with a Python
+   exception set; ints and longs outside the safe integer range become
+   BigInts where the engine supports them */
+static JSValueRef
+PyLong_to_JSValue(PyObject *obj, PyJSContext *context)
+{
+    int overflow;
+    PY_LONG_LONG n = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (!overflow && n >= -MAX_SAFE_INTEGER && n <= MAX_SAFE_INTEGER) {
+        return JSValueMakeNumber(context->context, (double)n);
+    }
+#ifdef HAVE_JSBIGINT
+    {
+        JSValueRef exception = NULL;
+        JSValueRef value;
+        JSStringRef jsstr = PyObject_to_JSString(obj);
+        if (!jsstr) {
+            return NULL;
+        }
+        value = JSBigIntCreateWithString(context->context, jsstr, &exception);
+        JSStringRelease(jsstr);
+        if (!value) {
+            JSException_to_PyErr(context, exception);
+        }
+        return value;
+    }
+#else
+    {
+        double floatVal = PyInt_Check(obj) ? (double)PyInt_AS_LONG(obj) : PyLong_AsDouble(obj);
+        if (floatVal == -1.0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        return JSValueMakeNumber(context->context, floatVal);
+    }
+#endif
+}
 
 PyObject *
 JSValue_to_PyJSObject(JSValueRef value, PyJSObject *thisObject)
@@ -152,16 +421,23 @@ JSValue_to_PyJSObject(JSValueRef value, PyJSObject *thisObject)
         case kJSTypeBoolean:
             return PyBool_FromLong(JSValueToBoolean(context, value));
         case kJSTypeNumber:
-            /* TODO check exception */
-            return PyFloat_FromDouble(JSValueToNumber(context, value, NULL));
+            return JSNumber_to_PyNumber(thisObject->context->flags,
+                JSValueToNumber(context, value, NULL));
         case kJSTypeUndefined:
             Py_RETURN_NONE;
         case kJSTypeNull:
             Py_INCREF(PyJSNull);
             return (PyObject *)PyJSNull;
         case kJSTypeString:
+            if (thisObject->context->flags & LAZY_STRINGS) {
+                return PyJSString_fromValue(thisObject->context, value);
+            }
             /* TODO check exception */
             return JSValue_to_PyString(thisObject->context, value);
+#ifdef HAVE_JSBIGINT
+        case kJSTypeBigInt:
+            return JSBigInt_to_PyLong(thisObject->context, value);
+#endif
         default:
             jsobj = JSValueToObject(context, value, &exception);
             if (!jsobj) {
@@ -185,16 +461,38 @@ PyObject_to_JSValue(PyObject *obj, PyJSContext *context)
         return JSValueMakeUndefined(context->context);
     }
     if (PyObject_TypeCheck(obj, &jscore_PyJSObjectType)) {
-        assert(((PyJSObject *)obj)->context == context);
         JSObjectRef jsobj = ((PyJSObject *)obj)->object;
-        if (jsobj) {
-            return jsobj;
+        if (!jsobj) {
+            return JSValueMakeNull(context->context);
+        }
+        if (((PyJSObject *)obj)->context != context) {
+            PyErr_SetString(PyExc_ValueError,
+                "JSObject belongs to another context (see Context.clone_from)");
+            return NULL;
         }
-        return JSValueMakeNull(context->context);
+        return jsobj;
     }
     if (PyBool_Check(obj)) {
         return JSValueMakeBoolean(context->context, obj == Py_True);
     }
+    if (PyInt_Check(obj)) {
+        long n = PyInt_AS_LONG(obj);
+        /* a 64-bit long can exceed the integers a double holds exactly */
+        if (n >= -MAX_SAFE_INTEGER && n <= MAX_SAFE_INTEGER) {
+            return JSValueMakeNumber(context->context, (double)n);
+        }
+        return PyLong_to_JSValue(obj, context);
+    }
+    if (PyFloat_Check(obj)) {
+        return JSValueMakeNumber(context->context, PyFloat_AS_DOUBLE(obj));
+    }
+    if (PyLong_Check(obj)) {
+        return PyLong_to_JSValue(obj, context);
+    }
+    if (PyJSString_Check(obj)) {
+        /* shares the characters */
+        return JSValueMakeString(context->context, ((PyJSString *)obj)->string);
+    }
     if (PyNumber_Check(obj)) {
         double floatVal = PyFloat_AsDouble(obj);
         if (!PyErr_Occurred()) {
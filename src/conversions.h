@@ -14,6 +14,10 @@ PyObject *JSException_to_PyErr(PyJSContext *, JSValueRef);
    clears the Python exception */
 void set_JSException(PyJSContext *, JSValueRef *exception);
 
+/* sets *exception to a new Error with the message; does not use the
+   Python API, so it may be called without the GIL */
+void set_JSError(JSContextRef, const char *message, JSValueRef *exception);
+
 /* returns a new PyObject;
    if an error occurs, sets a Python exception and returns NULL */
 PyObject *JSString_to_PyString(JSStringRef);
@@ -22,10 +26,26 @@ PyObject *JSString_to_PyString(JSStringRef);
    if an error occurs, sets a Python exception and returns NULL */
 PyObject *JSValue_to_PyString(PyJSContext *, JSValueRef);
 
+/* returns a new reference to an interned str for ASCII property names
+   (served from a small cache, without allocating, on repeated lookups),
+   or a unicode object for other names;
+   if an error occurs, sets a Python exception and returns NULL */
+PyObject *JSString_to_PyKey(JSStringRef);
+
+/* returns a new PyObject; with INT_NUMBERS in flags, integral numbers in
+   the safe range become ints */
+PyObject *JSNumber_to_PyNumber(int flags, double number);
+
 /* returns a new PyObject;
    if an error occurs, sets a Python exception and returns NULL */
 PyObject *JSValue_to_PyJSObject(JSValueRef, PyJSObject *thisObject);
 
+/* decodes a (not necessarily NUL-terminated) UTF-8 buffer into a new
+   JSString, replacing malformed sequences with U+FFFD; does not use the
+   Python API, so it may be called without the GIL.
+   returns NULL if memory is exhausted */
+JSStringRef UTF8_to_JSString(const char *buffer, size_t length);
+
 /* given a unicode object, return the corresponding JSString;
    if an error occurs (a non-unicode object was passed int),
    sets a Python exception and returns NULL */
@@ -0,0 +1,438 @@
+#include <Python.h>
+
+#include "jscore.h"
+#include "conversions.h"
+#include "eventloop.h"
+
+#include <math.h>
+#include <time.h>
+
+/* longest sleep between checks for signals, in ms */
+#define JSEVENTLOOP_SLICE   50.0
+
+static JSClassRef JSEventLoopHostClass = NULL;
+
+/* installs the timer functions on the global object; they reach the loop
+   through host, whose private data is the context. Extra timer arguments
+   are bound in JS, and microtasks go to the VM's own queue, which runs
+   whenever a call into the context returns */
+static const char *JSEventLoop_installSource =
+    "(function (global, host, schedule, cancel) {"
+    "    function timer(repeat) {"
+    "        return function (callback, delay) {"
+    "            if (typeof callback !== 'function')"
+    "                throw new TypeError('timer callback must be a function');"
+    "            if (arguments.length > 2) {"
+    "                var f = callback, args = Array.prototype.slice.call(arguments, 2);"
+    "                callback = function () { return f.apply(undefined, args); };"
+    "            }"
+    "            return schedule(host, callback, +delay || 0, repeat);"
+    "        };"
+    "    }"
+    "    function clear(id) { cancel(host, +id || 0); }"
+    "    global.setTimeout = timer(false);"
+    "    global.setInterval = timer(true);"
+    "    global.clearTimeout = global.clearInterval = clear;"
+    "    global.queueMicrotask = function (callback) {"
+    "        if (typeof callback !== 'function')"
+    "            throw new TypeError('microtask callback must be a function');"
+    "        Promise.resolve().then(function () { callback(); });"
+    "    };"
+    "})";
+
+/* returns the monotonic time in ms */
+static double
+JSEventLoop_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int
+JSTimer_before(const JSTimer *a, const JSTimer *b)
+{
+    return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static void
+JSEventLoop_siftUp(JSEventLoop *loop, size_t i)
+{
+    JSTimer timer = loop->heap[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!JSTimer_before(&timer, &loop->heap[parent]))
+            break;
+        loop->heap[i] = loop->heap[parent];
+        i = parent;
+    }
+    loop->heap[i] = timer;
+}
+
+static void
+JSEventLoop_siftDown(JSEventLoop *loop, size_t i)
+{
+    JSTimer timer = loop->heap[i];
+    size_t child;
+
+    while ((child = 2 * i + 1) < loop->size) {
+        if (child + 1 < loop->size && JSTimer_before(&loop->heap[child + 1], &loop->heap[child]))
+            child++;
+        if (!JSTimer_before(&loop->heap[child], &timer))
+            break;
+        loop->heap[i] = loop->heap[child];
+        i = child;
+    }
+    loop->heap[i] = timer;
+}
+
+/* returns -1 if memory is exhausted */
+static int
+JSEventLoop_push(JSEventLoop *loop, const JSTimer *timer)
+{
+    if (loop->size == loop->capacity) {
+        size_t capacity = loop->capacity ? loop->capacity * 2 : 16;
+        JSTimer *heap = PyMem_Resize(loop->heap, JSTimer, capacity);
+        if (!heap)
+            return -1;
+        loop->heap = heap;
+        loop->capacity = capacity;
+    }
+    loop->heap[loop->size++] = *timer;
+    JSEventLoop_siftUp(loop, loop->size - 1);
+    return 0;
+}
+
+/* removes the timer at i into *timer (its callback stays protected) */
+static void
+JSEventLoop_remove(JSEventLoop *loop, size_t i, JSTimer *timer)
+{
+    *timer = loop->heap[i];
+    if (i == --loop->size)
+        return;
+    loop->heap[i] = loop->heap[loop->size];
+    if (i > 0 && JSTimer_before(&loop->heap[i], &loop->heap[(i - 1) / 2]))
+        JSEventLoop_siftUp(loop, i);
+    else
+        JSEventLoop_siftDown(loop, i);
+}
+
+/* returns the context of the host argument, or NULL with a JS exception */
+static PyJSContext *
+JSEventLoop_host(JSContextRef ctx, size_t argumentCount, const JSValueRef arguments[],
+                 JSValueRef *exception)
+{
+    PyJSContext *context;
+
+    if (argumentCount < 1 || !JSValueIsObjectOfClass(ctx, arguments[0], JSEventLoopHostClass)) {
+        set_JSError(ctx, "expected the event loop host", exception);
+        return NULL;
+    }
+    context = JSObjectGetPrivate(JSValueToObject(ctx, arguments[0], NULL));
+    if (!context->loop) {
+        set_JSError(ctx, "the event loop is closed", exception);
+        return NULL;
+    }
+    return context;
+}
+
+/* schedule(host, callback, delay, repeat): returns the id of a new timer */
+static JSValueRef
+JSEventLoop_schedule(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                     size_t argumentCount, const JSValueRef arguments[],
+                     JSValueRef *exception)
+{
+    PyJSContext *context = JSEventLoop_host(ctx, argumentCount, arguments, exception);
+    JSEventLoop *loop;
+    JSTimer timer;
+    double delay;
+
+    if (!context)
+        return NULL;
+    if (argumentCount < 4 || !JSValueIsObject(ctx, arguments[1])) {
+        set_JSError(ctx, "expected a callback", exception);
+        return NULL;
+    }
+    loop = context->loop;
+    delay = JSValueToNumber(ctx, arguments[2], NULL);
+    if (!(delay >= 0))
+        delay = 0;
+    timer.when = JSEventLoop_now() + delay;
+    timer.interval = JSValueToBoolean(ctx, arguments[3]) ? delay : -1;
+    timer.seq = loop->next_seq++;
+    if (!(timer.id = loop->next_id++))
+        timer.id = loop->next_id++;
+    timer.callback = JSValueToObject(ctx, arguments[1], NULL);
+    if (JSEventLoop_push(loop, &timer) < 0) {
+        set_JSError(ctx, "out of memory", exception);
+        return NULL;
+    }
+    JSValueProtect(ctx, timer.callback);
+
+    /* an external loop only needs to hear about a new earliest deadline */
+    if (loop->hook && loop->heap[0].id == timer.id) {
+        PyObject *result = PyObject_CallFunction(loop->hook, "d", delay / 1000.0);
+        if (!result) {
+            set_JSException(context, exception);
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    return JSValueMakeNumber(ctx, timer.id);
+}
+
+/* cancel(host, id): clears the timer if it is still pending */
+static JSValueRef
+JSEventLoop_cancel(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                   size_t argumentCount, const JSValueRef arguments[],
+                   JSValueRef *exception)
+{
+    PyJSContext *context = JSEventLoop_host(ctx, argumentCount, arguments, exception);
+    JSEventLoop *loop;
+    JSTimer timer;
+    double id;
+    size_t i;
+
+    if (!context)
+        return NULL;
+    loop = context->loop;
+    id = argumentCount > 1 ? JSValueToNumber(ctx, arguments[1], NULL) : 0;
+    /* a linear search; pending timers are few compared to the runs */
+    for (i = 0; i < loop->size; i++) {
+        if (loop->heap[i].id == id) {
+            JSEventLoop_remove(loop, i, &timer);
+            JSValueUnprotect(ctx, timer.callback);
+            break;
+        }
+    }
+    return JSValueMakeUndefined(ctx);
+}
+
+int
+PyJSEventLoop_install(PyJSContext *context)
+{
+    JSGlobalContextRef ctx = context->context;
+    JSValueRef args[4], value, exception = NULL;
+    JSObjectRef installer;
+    JSStringRef jsstr;
+
+    if (!JSEventLoopHostClass) {
+        JSClassDefinition definition = kJSClassDefinitionEmpty;
+        definition.className = "EventLoop";
+        JSEventLoopHostClass = JSClassCreate(&definition);
+    }
+    if (!(context->loop = PyMem_New(JSEventLoop, 1))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    context->loop->heap = NULL;
+    context->loop->size = context->loop->capacity = 0;
+    context->loop->next_id = 1;
+    context->loop->next_seq = 0;
+    context->loop->hook = NULL;
+
+    jsstr = JSStringCreateWithUTF8CString(JSEventLoop_installSource);
+    value = JSEvaluateScript(ctx, jsstr, NULL, NULL, 1, &exception);
+    JSStringRelease(jsstr);
+    if (!value || !(installer = JSValueToObject(ctx, value, &exception))) {
+        JSException_to_PyErr(context, exception);
+        return -1;
+    }
+    args[0] = JSContextGetGlobalObject(ctx);
+    args[1] = JSObjectMake(ctx, JSEventLoopHostClass, context);
+    jsstr = JSStringCreateWithUTF8CString("schedule");
+    args[2] = JSObjectMakeFunctionWithCallback(ctx, jsstr, JSEventLoop_schedule);
+    JSStringRelease(jsstr);
+    jsstr = JSStringCreateWithUTF8CString("cancel");
+    args[3] = JSObjectMakeFunctionWithCallback(ctx, jsstr, JSEventLoop_cancel);
+    JSStringRelease(jsstr);
+    if (!JSObjectCallAsFunction(ctx, installer, NULL, 4, args, &exception)) {
+        JSException_to_PyErr(context, exception);
+        return -1;
+    }
+    return 0;
+}
+
+void
+PyJSEventLoop_clearTimers(PyJSContext *context)
+{
+    JSEventLoop *loop = context->loop;
+    JSTimer timer;
+
+    while (loop && loop->size) {
+        JSEventLoop_remove(loop, loop->size - 1, &timer);
+        JSValueUnprotect(context->context, timer.callback);
+    }
+}
+
+void
+PyJSEventLoop_clearContext(PyJSContext *context)
+{
+    JSEventLoop *loop = context->loop;
+
+    if (loop) {
+        PyJSEventLoop_clearTimers(context);
+        context->loop = NULL;
+        Py_XDECREF(loop->hook);
+        PyMem_Free(loop->heap);
+        PyMem_Free(loop);
+    }
+}
+
+/* runs the timers due now, but not the ones they schedule (or re-arm);
+   returns the number run, or -1 with a Python exception set if one threw */
+static Py_ssize_t
+JSEventLoop_runDue(PyJSContext *context)
+{
+    JSGlobalContextRef ctx = context->context;
+    JSValueRef exception = NULL;
+    unsigned long seq;
+    double now = JSEventLoop_now();
+    Py_ssize_t count = 0;
+    JSTimer timer;
+
+    if (!context->loop)
+        return 0;
+    seq = context->loop->next_seq;
+    /* the loop is looked up again after each call, which may close it */
+    while (context->loop && context->loop->size &&
+           context->loop->heap[0].when <= now && context->loop->heap[0].seq < seq) {
+        JSEventLoop *loop = context->loop;
+        JSEventLoop_remove(loop, 0, &timer);
+        if (timer.interval >= 0) {
+            JSTimer next = timer;
+            next.when = now + timer.interval;
+            next.seq = loop->next_seq++;
+            /* cannot fail: the heap just shrank */
+            JSEventLoop_push(loop, &next);
+            /* the callback is also protected for the call, in case the
+               interval clears itself */
+            JSValueProtect(ctx, timer.callback);
+        }
+        count++;
+        if (!JSObjectCallAsFunction(ctx, timer.callback, NULL, 0, NULL, &exception)) {
+            JSValueUnprotect(ctx, timer.callback);
+            JSException_to_PyErr(context, exception);
+            return -1;
+        }
+        JSValueUnprotect(ctx, timer.callback);
+    }
+    return count;
+}
+
+/* sleeps until the monotonic time when (ms) without the GIL, waking up to
+   run signal handlers; returns -1 if one raised */
+static int
+JSEventLoop_sleepUntil(double when)
+{
+    double now, ms;
+    struct timespec ts;
+
+    while ((now = JSEventLoop_now()) < when) {
+        ms = when - now < JSEVENTLOOP_SLICE ? when - now : JSEVENTLOOP_SLICE;
+        ts.tv_sec = (time_t)(ms / 1000);
+        ts.tv_nsec = (long)(fmod(ms, 1000) * 1e6);
+        Py_BEGIN_ALLOW_THREADS
+        nanosleep(&ts, NULL);
+        Py_END_ALLOW_THREADS
+        if (PyErr_CheckSignals() < 0)
+            return -1;
+    }
+    return 0;
+}
+
+PyObject *
+PyJSContext_runUntilIdle(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"deadline", NULL};
+    PyObject *deadline = Py_None;
+    double limit = HUGE_VAL, when;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:run_until_idle", kwlist, &deadline))
+        return NULL;
+    if (deadline != Py_None) {
+        /* the deadline is a time.time() value; timers use the monotonic
+           clock, which the wall clock may jump against */
+        double wall = PyFloat_AsDouble(deadline);
+        struct timespec ts;
+        if (wall == -1 && PyErr_Occurred())
+            return NULL;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        limit = JSEventLoop_now() + (wall - ts.tv_sec - ts.tv_nsec / 1e9) * 1000.0;
+    }
+    for (;;) {
+        if (!self->loop || !self->loop->size)
+            Py_RETURN_TRUE;
+        when = self->loop->heap[0].when;
+        if (JSEventLoop_sleepUntil(when < limit ? when : limit) < 0)
+            return NULL;
+        if (when > limit)
+            Py_RETURN_FALSE;
+        if (JSEventLoop_runDue(self) < 0)
+            return NULL;
+        /* timers already due never sleep, which is where signals are
+           otherwise checked (as for setInterval(f, 0)) */
+        if (PyErr_CheckSignals() < 0)
+            return NULL;
+    }
+}
+
+PyObject *
+PyJSContext_runReady(PyJSContext *self)
+{
+    Py_ssize_t count = JSEventLoop_runDue(self);
+
+    if (count < 0)
+        return NULL;
+    return PyInt_FromSsize_t(count);
+}
+
+PyObject *
+PyJSContext_nextDeadline(PyJSContext *self)
+{
+    double delay;
+
+    if (!self->loop || !self->loop->size)
+        Py_RETURN_NONE;
+    delay = self->loop->heap[0].when - JSEventLoop_now();
+    return PyFloat_FromDouble(delay > 0 ? delay / 1000.0 : 0.0);
+}
+
+PyObject *
+PyJSContext_getTimerHook(PyJSContext *self)
+{
+    PyObject *hook = self->loop && self->loop->hook ? self->loop->hook : Py_None;
+
+    Py_INCREF(hook);
+    return hook;
+}
+
+int
+PyJSContext_setTimerHook(PyJSContext *self, PyObject *value)
+{
+    PyObject *old;
+
+    if (!self->loop) {
+        PyErr_SetString(PyExc_ValueError, "the context has no event loop (see Context(timers=True))");
+        return -1;
+    }
+    if (value == Py_None)
+        value = NULL;
+    if (value && !PyCallable_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "timer_hook must be callable or None");
+        return -1;
+    }
+    old = self->loop->hook;
+    Py_XINCREF(value);
+    self->loop->hook = value;
+    Py_XDECREF(old);
+    return 0;
+}
+
+PyObject *
+PyJSContext_getPendingTimers(PyJSContext *self)
+{
+    return PyInt_FromSize_t(self->loop ? self->loop->size : 0);
+}
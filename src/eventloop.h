@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+typedef struct JSTimer JSTimer;
+
+struct JSTimer {
+    double              when;       /* monotonic time due, in ms */
+    double              interval;   /* ms between runs; < 0 if run once */
+    unsigned long       seq;        /* orders timers due at the same time */
+    unsigned            id;
+    JSObjectRef         callback;   /* protect */
+};
+
+/* The timers of a context, in a binary min-heap ordered by (when, seq);
+   setTimeout() and friends schedule them without calling into Python */
+struct JSEventLoop {
+    JSTimer             *heap;      /* PyMem */
+    size_t              size;
+    size_t              capacity;
+    unsigned            next_id;
+    unsigned long       next_seq;
+    PyObject            *hook;      /* retain; may be NULL */
+};
+
+/* creates the event loop of the context and installs setTimeout,
+   setInterval, clearTimeout, clearInterval and queueMicrotask on its
+   global object; returns -1 with a Python exception set on failure */
+int PyJSEventLoop_install(PyJSContext *context);
+
+/* drops the pending timers of the context, keeping its loop */
+void PyJSEventLoop_clearTimers(PyJSContext *context);
+
+/* releases the event loop of the context (before the context is released) */
+void PyJSEventLoop_clearContext(PyJSContext *context);
+
+/* Context methods and attributes */
+PyObject *PyJSContext_runUntilIdle(PyJSContext *self, PyObject *args, PyObject *kwds);
+PyObject *PyJSContext_runReady(PyJSContext *self);
+PyObject *PyJSContext_nextDeadline(PyJSContext *self);
+PyObject *PyJSContext_getTimerHook(PyJSContext *self);
+int PyJSContext_setTimerHook(PyJSContext *self, PyObject *value);
+PyObject *PyJSContext_getPendingTimers(PyJSContext *self);
@@ -0,0 +1,615 @@
+#include <Python.h>
+#include <structmember.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include "jscore.h"
+#include "jsobj.h"
+#include "conversions.h"
+#include "script.h"
+#include "executor.h"
+
+/* arguments passed without a heap allocation */
+#define JSJOB_STACK_ARGS    16
+
+/* JSC derives its recursion limit from the size of the thread stack */
+#define WORKER_STACK_SIZE   (8 * 1024 * 1024)
+
+static PyObject *future_class = NULL;
+
+/* Jobs */
+
+/* needs the GIL */
+static void
+PyJSJob_free(PyJSJob *job)
+{
+    size_t i;
+
+    if (job->source) JSStringRelease(job->source);
+    if (job->url) JSStringRelease(job->url);
+    for (i = 0; i < job->depth; i++) {
+        JSStringRelease(job->path[i]);
+    }
+    free(job->path);
+    JSTransferBuffer_release(&job->args);
+    JSTransferBuffer_release(&job->result);
+    free(job->error);
+    Py_XDECREF(job->future);
+    free(job);
+}
+
+/* splits a dotted name such as "lib.process" into job->path; returns 0 if
+   the name is not a dotted identifier (it is then evaluated as source),
+   -1 if memory is exhausted */
+static int
+PyJSJob_setPath(PyJSJob *job, const char *name, size_t length)
+{
+    size_t i, start = 0, depth = 1;
+
+    for (i = 0; i < length; i++) {
+        char c = name[i];
+        if (c == '.') {
+            if (i == start) return 0;
+            depth++;
+            start = i + 1;
+        } else if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                     c == '_' || c == '$' || (c >= '0' && c <= '9' && i > start))) {
+            return 0;
+        }
+    }
+    if (length == start) {
+        return 0;
+    }
+    if (!(job->path = calloc(depth, sizeof(JSStringRef)))) {
+        return -1;
+    }
+    for (i = 0, start = 0; i <= length; i++) {
+        if (i == length || name[i] == '.') {
+            JSStringRef segment = UTF8_to_JSString(name + start, i - start);
+            if (!segment) return -1;
+            job->path[job->depth++] = segment;
+            start = i + 1;
+        }
+    }
+    return 1;
+}
+
+/* calls the function named by job->path; does not need the GIL */
+static JSValueRef
+PyJSJob_call(PyJSJob *job, JSContextRef ctx, JSValueRef *exception)
+{
+    JSObjectRef function = JSContextGetGlobalObject(ctx), thisObject = NULL, args;
+    JSValueRef value, result, stackargs[JSJOB_STACK_ARGS], *argv = stackargs;
+    const char *pos = job->args.data;
+    size_t i, argc = job->argc;
+
+    for (i = 0; i < job->depth; i++) {
+        thisObject = function;
+        if (!(value = JSObjectGetProperty(ctx, thisObject, job->path[i], exception)) ||
+            !(function = JSValueToObject(ctx, value, exception))) {
+            return NULL;
+        }
+    }
+    if (!JSObjectIsFunction(ctx, function)) {
+        set_JSError(ctx, "submitted name is not a function", exception);
+        return NULL;
+    }
+    /* the arguments are kept alive by the array, which is on the stack */
+    if (!(value = JSTransfer_toJSValue(ctx, &pos, pos + job->args.size, exception)) ||
+        !(args = JSValueToObject(ctx, value, exception))) {
+        return NULL;
+    }
+    if (argc > JSJOB_STACK_ARGS && !(argv = malloc(argc * sizeof(JSValueRef)))) {
+        set_JSError(ctx, "out of memory", exception);
+        return NULL;
+    }
+    for (i = 0; i < argc; i++) {
+        argv[i] = JSObjectGetPropertyAtIndex(ctx, args, (unsigned)i, NULL);
+    }
+    result = JSObjectCallAsFunction(ctx, function, thisObject, argc, argv, exception);
+    if (argv != stackargs) {
+        free(argv);
+    }
+    return result;
+}
+
+/* runs a job in the context of a worker, without the GIL */
+static void
+PyJSJob_run(PyJSJob *job, JSGlobalContextRef ctx)
+{
+    JSValueRef exception = NULL, value;
+
+    if (job->source) {
+        value = JSEvaluateScript(ctx, job->source, NULL, job->url, 1, &exception);
+    } else {
+        value = PyJSJob_call(job, ctx, &exception);
+    }
+    if (value && JSTransfer_fromJSValue(&job->result, ctx, value, &exception) == 0) {
+        return;
+    }
+    JSTransferBuffer_release(&job->result);
+    job->error = JSException_to_UTF8(ctx, exception);
+}
+
+/* marks the future of a dequeued job as running; a job whose future was
+   cancelled while queued is freed instead, and 0 returned; takes the GIL */
+static int
+PyJSJob_start(PyJSJob *job)
+{
+    static PyObject *notify_str;
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyObject *running;
+    int rv = 0;
+
+    if (!notify_str) {
+        notify_str = PyString_InternFromString("set_running_or_notify_cancel");
+    }
+    if (!(running = PyObject_CallMethodObjArgs(job->future, notify_str, NULL))) {
+        PyErr_WriteUnraisable(job->future);
+    } else {
+        rv = PyObject_IsTrue(running);
+        Py_DECREF(running);
+        if (rv < 0) {
+            PyErr_WriteUnraisable(job->future);
+            rv = 0;
+        }
+    }
+    if (!rv) {
+        PyJSJob_free(job);
+    }
+    PyGILState_Release(state);
+    return rv;
+}
+
+/* resolves the future of a running job and frees it; takes the GIL */
+static void
+PyJSJob_complete(PyJSJob *job, int flags)
+{
+    static PyObject *set_result_str, *set_exception_str;
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyObject *value = NULL, *rv = NULL;
+    PyObject *exc, *tb;
+
+    if (!set_result_str) {
+        set_result_str = PyString_InternFromString("set_result");
+        set_exception_str = PyString_InternFromString("set_exception");
+    }
+    if (!job->result.size) {
+        value = PyObject_CallFunction((PyObject *)&jscore_PyJSErrorType, "s",
+            job->error ? job->error : "out of memory");
+        if (!value) goto err;
+        rv = PyObject_CallMethodObjArgs(job->future, set_exception_str, value, NULL);
+    } else {
+        const char *pos = job->result.data;
+        if ((value = JSTransfer_toPyObject(&pos, pos + job->result.size, flags))) {
+            rv = PyObject_CallMethodObjArgs(job->future, set_result_str, value, NULL);
+        } else {
+            PyErr_Fetch(&exc, &value, &tb);
+            PyErr_NormalizeException(&exc, &value, &tb);
+            Py_XDECREF(exc);
+            Py_XDECREF(tb);
+            rv = PyObject_CallMethodObjArgs(job->future, set_exception_str, value, NULL);
+        }
+    }
+    if (rv) {
+        goto finally;
+    }
+  err:
+    PyErr_WriteUnraisable(job->future);
+  finally:
+    Py_XDECREF(value);
+    Py_XDECREF(rv);
+    PyJSJob_free(job);
+    PyGILState_Release(state);
+}
+
+/* Pools */
+
+static void
+PyJSPool_release(PyJSPool *pool)
+{
+    int last;
+
+    pthread_mutex_lock(&pool->lock);
+    last = --pool->refcnt == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (last) {
+        pthread_cond_destroy(&pool->ready);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->workers);
+        free(pool);
+    }
+}
+
+/* stops the workers once the queue is drained; with wait, joins them
+   (needs the GIL, which is released while waiting) */
+static void
+PyJSPool_shutdown(PyJSPool *pool, int wait)
+{
+    Py_ssize_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    if (!wait || pool->joined) {
+        return;
+    }
+    pool->joined = 1;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < pool->nworkers; i++) {
+        /* the executor may be dropped by a callback on one of its workers */
+        if (pthread_equal(pool->workers[i].thread, pthread_self())) {
+            pthread_detach(pool->workers[i].thread);
+        } else {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+    }
+    Py_END_ALLOW_THREADS
+}
+
+static void *
+PyJSWorker_main(void *arg)
+{
+    PyJSWorker *worker = (PyJSWorker *)arg;
+    PyJSPool *pool = worker->pool;
+    PyJSJob *job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->shutdown) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if ((job = pool->head)) {
+            if (!(pool->head = job->next)) {
+                pool->tail = NULL;
+            }
+            pool->pending--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!job) {
+            break;
+        }
+        if (!PyJSJob_start(job)) {
+            continue;
+        }
+        PyJSJob_run(job, worker->context);
+        PyJSJob_complete(job, pool->flags);
+    }
+    JSGlobalContextRelease(worker->context);
+    worker->context = NULL;
+    PyJSPool_release(pool);
+    return NULL;
+}
+
+/* Executor */
+
+static void
+PyJSExecutor_dealloc(PyJSExecutor *self)
+{
+    if (self->pool) {
+        PyJSPool_shutdown(self->pool, 1);
+        PyJSPool_release(self->pool);
+    }
+    PyObject_Del(self);
+}
+
+/* evaluates the prelude in a new worker context;
+   if it throws, sets a Python exception and returns -1 */
+static int
+PyJSExecutor_prelude(JSGlobalContextRef ctx, JSStringRef source, JSStringRef url)
+{
+    JSValueRef exception = NULL, value;
+    char *message;
+
+    Py_BEGIN_ALLOW_THREADS
+    value = JSEvaluateScript(ctx, source, NULL, url, 1, &exception);
+    Py_END_ALLOW_THREADS
+    if (value) {
+        return 0;
+    }
+    message = JSException_to_UTF8(ctx, exception);
+    if (message) {
+        PyErr_SetString((PyObject *)&jscore_PyJSErrorType, message);
+        free(message);
+    } else {
+        PyErr_NoMemory();
+    }
+    return -1;
+}
+
+static PyObject *
+PyJSExecutor_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"workers", "prelude", "flags", NULL};
+    Py_ssize_t i, nworkers = -1;
+    PyObject *prelude = Py_None;
+    int flags = 0;
+    JSStringRef source = NULL, url = NULL;
+    PyJSExecutor *self = NULL;
+    PyJSPool *pool = NULL;
+    pthread_attr_t attr;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nOi:Executor", kwlist,
+                                     &nworkers, &prelude, &flags))
+        return NULL;
+    if (nworkers < 0) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    if (!future_class) {
+        PyObject *module = PyImport_ImportModule("concurrent.futures");
+        if (!module) {
+            if (PyErr_ExceptionMatches(PyExc_ImportError)) {
+                PyErr_SetString(PyExc_ImportError, "Executor needs concurrent.futures "
+                                "(the futures backport: pip install futures)");
+            }
+            return NULL;
+        }
+        future_class = PyObject_GetAttrString(module, "Future");
+        Py_DECREF(module);
+        if (!future_class)
+            return NULL;
+    }
+    if (PyObject_TypeCheck(prelude, &jscore_PyJSScriptType)) {
+        source = JSStringRetain(((PyJSScript *)prelude)->source);
+        url = JSStringRetain(((PyJSScript *)prelude)->url);
+    } else if (prelude != Py_None && !(source = PyString_to_JSString(prelude))) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "prelude must be a string or a Script");
+        }
+        return NULL;
+    }
+    PyEval_InitThreads();
+
+    if (!(pool = calloc(1, sizeof(PyJSPool))) ||
+        !(pool->workers = calloc(nworkers, sizeof(PyJSWorker)))) {
+        free(pool);
+        PyErr_NoMemory();
+        goto finally;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pool->refcnt = 1;
+    pool->flags = flags;
+
+    for (i = 0; i < nworkers; i++) {
+        PyJSWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->context = JSGlobalContextCreate(NULL);
+        if (source && PyJSExecutor_prelude(worker->context, source, url) < 0) {
+            goto err;
+        }
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    for (i = 0; i < nworkers; i++) {
+        pool->refcnt++;
+        if (pthread_create(&pool->workers[i].thread, &attr, PyJSWorker_main,
+                           &pool->workers[i]) != 0) {
+            pool->refcnt--;
+            PyErr_SetString(PyExc_OSError, "cannot start an executor worker");
+            break;
+        }
+        pool->nworkers++;
+    }
+    pthread_attr_destroy(&attr);
+    if (i < nworkers) {
+        goto err;
+    }
+    if (!(self = (PyJSExecutor *)type->tp_alloc(type, 0))) {
+        goto err;
+    }
+    self->pool = pool;
+    self->nworkers = nworkers;
+    goto finally;
+  err:
+    /* contexts of workers that did not start are released here; the
+       others are released by their workers */
+    for (i = pool->nworkers; i < nworkers; i++) {
+        if (pool->workers[i].context) {
+            JSGlobalContextRelease(pool->workers[i].context);
+        }
+    }
+    PyJSPool_shutdown(pool, 1);
+    PyJSPool_release(pool);
+  finally:
+    if (source) JSStringRelease(source);
+    if (url) JSStringRelease(url);
+    return (PyObject *)self;
+}
+
+static PyObject *
+PyJSExecutor_submit(PyJSExecutor *self, PyObject *args)
+{
+    PyJSPool *pool = self->pool;
+    PyObject *target, *callargs = NULL, *name = NULL;
+    PyJSJob *job;
+    int rv;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "submit() needs a script or a function name");
+        return NULL;
+    }
+    target = PyTuple_GET_ITEM(args, 0);
+    if (!(job = calloc(1, sizeof(PyJSJob)))) {
+        return PyErr_NoMemory();
+    }
+    if (!(job->future = PyObject_CallObject(future_class, NULL))) {
+        goto err;
+    }
+    if (PyObject_TypeCheck(target, &jscore_PyJSScriptType)) {
+        job->source = JSStringRetain(((PyJSScript *)target)->source);
+        job->url = JSStringRetain(((PyJSScript *)target)->url);
+    } else if (PyString_Check(target) || PyUnicode_Check(target)) {
+        if (!(name = PyUnicode_Check(target) ? PyUnicode_AsUTF8String(target) : target)) {
+            goto err;
+        }
+        if (name == target) {
+            Py_INCREF(name);
+        }
+        rv = PyJSJob_setPath(job, PyString_AS_STRING(name), PyString_GET_SIZE(name));
+        Py_DECREF(name);
+        if (rv < 0) {
+            PyErr_NoMemory();
+            goto err;
+        }
+        if (rv == 0 && !(job->source = PyString_to_JSString(target))) {
+            goto err;
+        }
+    } else {
+        PyErr_SetString(PyExc_TypeError, "submit() needs a script or a function name");
+        goto err;
+    }
+    if (job->source) {
+        if (PyTuple_GET_SIZE(args) > 1) {
+            PyErr_SetString(PyExc_TypeError, "only functions can be submitted with arguments");
+            goto err;
+        }
+    } else {
+        if (!(callargs = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args)))) {
+            goto err;
+        }
+        job->argc = PyTuple_GET_SIZE(callargs);
+        rv = JSTransfer_fromPyObject(&job->args, callargs);
+        Py_DECREF(callargs);
+        if (rv < 0) {
+            goto err;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->shutdown) {
+        pthread_mutex_unlock(&pool->lock);
+        PyErr_SetString(PyExc_RuntimeError, "cannot submit after shutdown");
+        goto err;
+    }
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    Py_INCREF(job->future);
+    return job->future;
+  err:
+    PyJSJob_free(job);
+    return NULL;
+}
+
+static PyObject *
+PyJSExecutor_shutdown(PyJSExecutor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"wait", NULL};
+    PyObject *wait = Py_True;
+    int w;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:shutdown", kwlist, &wait))
+        return NULL;
+    if ((w = PyObject_IsTrue(wait)) < 0)
+        return NULL;
+    PyJSPool_shutdown(self->pool, w);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+PyJSExecutor_enter(PyJSExecutor *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+PyJSExecutor_exit(PyJSExecutor *self, PyObject *args)
+{
+    PyJSPool_shutdown(self->pool, 1);
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+PyJSExecutor_getPending(PyJSExecutor *self, void *closure)
+{
+    size_t pending;
+
+    pthread_mutex_lock(&self->pool->lock);
+    pending = self->pool->pending;
+    pthread_mutex_unlock(&self->pool->lock);
+    return PyInt_FromSsize_t(pending);
+}
+
+static PyMethodDef PyJSExecutor_methods[] = {
+    {"submit", (PyCFunction)PyJSExecutor_submit, METH_VARARGS,
+     "submit(script_or_name, *args): queue a script (source or Script), or a\n"
+     "call of the global function with the (dotted) name, on the next free\n"
+     "worker; returns a concurrent.futures.Future of the result"},
+    {"shutdown", (PyCFunction)PyJSExecutor_shutdown, METH_VARARGS | METH_KEYWORDS,
+     "shutdown(wait=True): run the queued jobs, then stop the workers"},
+    {"__enter__", (PyCFunction)PyJSExecutor_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)PyJSExecutor_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyMemberDef PyJSExecutor_members[] = {
+    {"workers", T_PYSSIZET, offsetof(PyJSExecutor, nworkers), READONLY,
+     "the number of worker threads"},
+    {NULL},
+};
+
+static PyGetSetDef PyJSExecutor_getset[] = {
+    {"pending", (getter)PyJSExecutor_getPending, NULL,
+     "the number of queued jobs no worker has taken yet", NULL},
+    {NULL},
+};
+
+PyTypeObject jscore_PyJSExecutorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.Executor",            /* tp_name */
+    sizeof(PyJSExecutor),           /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSExecutor_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Executor(workers=ncpus, prelude=None, flags=0): runs jobs on native\n"
+    "worker threads, each with its own context in which the prelude (source\n"
+    "or Script) was evaluated. Arguments and results are copied between\n"
+    "Python and the workers, so they must be None, jscore.null, booleans,\n"
+    "numbers, strings, and lists and dicts of them. Shut it down (or use it\n"
+    "as a context manager) before the interpreter exits.", /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    PyJSExecutor_methods,           /* tp_methods */
+    PyJSExecutor_members,           /* tp_members */
+    PyJSExecutor_getset,            /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    PyJSExecutor_new,               /* tp_new */
+};
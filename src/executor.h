@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include <pthread.h>
+
+#include "transfer.h"
+
+typedef struct PyJSJob PyJSJob;
+typedef struct PyJSWorker PyJSWorker;
+typedef struct PyJSPool PyJSPool;
+typedef struct PyJSExecutor PyJSExecutor;
+
+/* A script or function call queued on an executor */
+struct PyJSJob {
+    PyJSJob             *next;
+    JSStringRef         source;     /* retain; NULL for a call */
+    JSStringRef         url;        /* retain; may be NULL */
+    JSStringRef         *path;      /* retain; the dotted name of the function */
+    size_t              depth;      /* segments in path */
+    size_t              argc;
+    JSTransferBuffer    args;       /* an array of the arguments */
+    JSTransferBuffer    result;
+    char                *error;     /* malloc'd message if the job failed */
+    PyObject            *future;    /* retain */
+};
+
+/* A native thread with a context of its own (in its own context group, so
+   workers never contend for a VM lock) */
+struct PyJSWorker {
+    pthread_t           thread;
+    JSGlobalContextRef  context;    /* retain */
+    PyJSPool            *pool;
+};
+
+/* The state shared by an executor and its workers; each running worker
+   holds a reference, so the pool outlives the executor object until every
+   worker has exited */
+struct PyJSPool {
+    pthread_mutex_t     lock;
+    pthread_cond_t      ready;      /* signalled when a job is queued or on shutdown */
+    PyJSJob             *head;      /* FIFO of pending jobs */
+    PyJSJob             *tail;
+    size_t              pending;
+    int                 shutdown;
+    int                 joined;
+    int                 refcnt;     /* guarded by lock */
+    int                 flags;      /* context flags for results */
+    Py_ssize_t          nworkers;
+    PyJSWorker          *workers;
+};
+
+struct PyJSExecutor {
+    PyObject_HEAD
+    PyJSPool            *pool;
+    Py_ssize_t          nworkers;
+};
+
+extern PyTypeObject jscore_PyJSExecutorType;
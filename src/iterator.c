@@ -0,0 +1,384 @@
+#include "jscore.h"
+#include "jsobj.h"
+#include "conversions.h"
+#include "iterator.h"
+
+/* returns the iterator of an iterable, or undefined */
+static const char *JSIter_openSource =
+    "(function (o) {"
+    "    var f = o[Symbol.iterator];"
+    "    return typeof f === 'function' ? f.call(o) : undefined;"
+    "})";
+
+/* returns an array of up to n values; a shorter one means the iterator
+   is exhausted */
+static const char *JSIter_pullSource =
+    "(function (it, n) {"
+    "    var out = [], r;"
+    "    while (out.length < n && !(r = it.next()).done) out.push(r.value);"
+    "    return out;"
+    "})";
+
+/* makes the prototype of iterable Python proxies from the native open and
+   pull functions; next() is served from the last batch, and pull() returns
+   an empty array once the Python iterator is exhausted */
+static const char *JSIterable_protoSource =
+    "(function (open, pull) {"
+    "    var proto = {};"
+    "    proto[Symbol.iterator] = function () {"
+    "        var it = open(this), buf = [], i = 0;"
+    "        return {"
+    "            next: function () {"
+    "                if (i >= buf.length) {"
+    "                    if (it) { buf = pull(it); i = 0; }"
+    "                    if (i >= buf.length) {"
+    "                        it = null;"
+    "                        return {value: undefined, done: true};"
+    "                    }"
+    "                }"
+    "                return {value: buf[i++], done: false};"
+    "            }"
+    "        };"
+    "    };"
+    "    return proto;"
+    "})";
+
+/* returns a protected function compiled from source, or NULL with a Python
+   exception set */
+static JSObjectRef
+PyJSContext_compileHelper(PyJSContext *context, const char *source)
+{
+    JSStringRef jsstr = JSStringCreateWithUTF8CString(source);
+    JSValueRef value, exception = NULL;
+    JSObjectRef function = NULL;
+
+    value = JSEvaluateScript(context->context, jsstr, NULL, NULL, 1, &exception);
+    JSStringRelease(jsstr);
+    if (!value || !(function = JSValueToObject(context->context, value, &exception))) {
+        JSException_to_PyErr(context, exception);
+        return NULL;
+    }
+    JSValueProtect(context->context, function);
+    return function;
+}
+
+void
+PyJSIter_clearContext(PyJSContext *context)
+{
+    if (context->iter_open) {
+        JSValueUnprotect(context->context, context->iter_open);
+        context->iter_open = NULL;
+    }
+    if (context->iter_pull) {
+        JSValueUnprotect(context->context, context->iter_pull);
+        context->iter_pull = NULL;
+    }
+    if (context->iter_proto) {
+        JSValueUnprotect(context->context, context->iter_proto);
+        context->iter_proto = NULL;
+    }
+}
+
+/******************************************************************************/
+
+PyObject *
+PyJSIter_new(PyJSObject *object, Py_ssize_t batch, int required)
+{
+    PyJSContext *context = object->context;
+    JSValueRef value, arg, exception = NULL;
+    PyJSIter *iter;
+
+    if (!object->object) {
+        if (required) {
+            PyErr_SetString(PyExc_TypeError, "null is not iterable");
+        }
+        return NULL;
+    }
+    if (!context->iter_open &&
+        !(context->iter_open = PyJSContext_compileHelper(context, JSIter_openSource))) {
+        return NULL;
+    }
+    arg = object->object;
+    value = JSObjectCallAsFunction(context->context, context->iter_open, NULL,
+        1, &arg, &exception);
+    if (!value) {
+        return JSException_to_PyErr(context, exception);
+    }
+    if (!JSValueIsObject(context->context, value)) {
+        if (required) {
+            PyErr_SetString(PyExc_TypeError, "JS object is not iterable");
+        }
+        return NULL;
+    }
+    if (!(iter = JSALLOC(PyJSIter))) {
+        return NULL;
+    }
+    if (!(iter->pending = PyList_New(0))) {
+        iter->context = NULL;
+        iter->iterator = NULL;
+        Py_DECREF(iter);
+        return NULL;
+    }
+    iter->iterator = JSValueToObject(context->context, value, NULL);
+    JSValueProtect(context->context, iter->iterator);
+    Py_INCREF(context);
+    iter->context = context;
+    iter->index = 0;
+    iter->batch = batch > 0 ? batch : 1;
+    return (PyObject *)iter;
+}
+
+/* pulls the next batch into pending; on error, ends the iteration,
+   dropping the values pulled so far, and returns -1 */
+static int
+PyJSIter_fill(PyJSIter *self)
+{
+    PyJSContext *context = self->context;
+    JSValueRef args[2], value, exception = NULL;
+    JSObjectRef values;
+    PyObject *exc, *val, *tb;
+    unsigned i, length;
+
+    if (!context->iter_pull &&
+        !(context->iter_pull = PyJSContext_compileHelper(context, JSIter_pullSource))) {
+        goto err;
+    }
+    args[0] = self->iterator;
+    args[1] = JSValueMakeNumber(context->context, (double)self->batch);
+    value = JSObjectCallAsFunction(context->context, context->iter_pull, NULL,
+        2, args, &exception);
+    if (!value || !(values = JSValueToObject(context->context, value, &exception))) {
+        JSException_to_PyErr(context, exception);
+        goto err;
+    }
+    value = JSObjectGetProperty(context->context, values, JSLengthString, &exception);
+    length = value ? (unsigned)JSValueToNumber(context->context, value, &exception) : 0;
+    for (i = 0; !exception && i < length; i++) {
+        PyObject *item;
+        int rv;
+        if (!(value = JSObjectGetPropertyAtIndex(context->context, values, i, &exception)))
+            break;
+        if (!(item = JSValue_to_PyJSObject(value, &context->dummy)))
+            goto err;
+        rv = PyList_Append(self->pending, item);
+        Py_DECREF(item);
+        if (rv < 0)
+            goto err;
+    }
+    if (exception) {
+        JSException_to_PyErr(context, exception);
+        goto err;
+    }
+    if ((Py_ssize_t)length < self->batch) {
+        JSValueUnprotect(context->context, self->iterator);
+        self->iterator = NULL;
+    }
+    return 0;
+  err:
+    PyErr_Fetch(&exc, &val, &tb);
+    PyList_SetSlice(self->pending, 0, PyList_GET_SIZE(self->pending), NULL);
+    PyErr_Clear();
+    self->index = 0;
+    JSValueUnprotect(context->context, self->iterator);
+    self->iterator = NULL;
+    PyErr_Restore(exc, val, tb);
+    return -1;
+}
+
+static PyObject *
+PyJSIter_next(PyJSIter *self)
+{
+    PyObject *result;
+
+    while (self->index >= PyList_GET_SIZE(self->pending)) {
+        if (!self->iterator) {
+            return NULL;
+        }
+        if (PyList_SetSlice(self->pending, 0, PyList_GET_SIZE(self->pending), NULL) < 0)
+            return NULL;
+        self->index = 0;
+        if (PyJSIter_fill(self) < 0)
+            return NULL;
+    }
+    result = PyList_GET_ITEM(self->pending, self->index);
+    self->index++;
+    Py_INCREF(result);
+    return result;
+}
+
+static void
+PyJSIter_dealloc(PyJSIter *self)
+{
+    if (self->iterator) {
+        JSValueUnprotect(self->context->context, self->iterator);
+    }
+    Py_XDECREF(self->context);
+    Py_XDECREF(self->pending);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+PyTypeObject jscore_PyJSIterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.JSIterator",          /* tp_name */
+    sizeof(PyJSIter),               /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSIter_dealloc,   /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Iterator over the values of a JS iterable, pulled in batches.", /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    PyObject_SelfIter,              /* tp_iter */
+    (iternextfunc)PyJSIter_next,    /* tp_iternext */
+    0,                              /* tp_methods */
+    0,                              /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    0,                              /* tp_new */
+};
+
+/******************************************************************************/
+
+/* returns the private data of a Python proxy argument, or NULL with a JS
+   exception set */
+static JSPrivateData *
+JSIterable_argument(JSContextRef ctx, size_t argumentCount,
+                    const JSValueRef arguments[], JSValueRef *exception)
+{
+    if (argumentCount < 1 || !JSValueIsObjectOfClass(ctx, arguments[0], JSPyClass)) {
+        set_JSError(ctx, "expected a Python object", exception);
+        return NULL;
+    }
+    return JSObjectGetPrivate(JSValueToObject(ctx, arguments[0], NULL));
+}
+
+/* open(proxy): returns a proxy of iter(obj) */
+static JSValueRef
+JSIterable_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                size_t argumentCount, const JSValueRef arguments[],
+                JSValueRef *exception)
+{
+    JSPrivateData *data = JSIterable_argument(ctx, argumentCount, arguments, exception);
+    PyObject *iter;
+    JSObjectRef result;
+
+    if (!data) {
+        return NULL;
+    }
+    if (!(iter = PyObject_GetIter(data->obj))) {
+        set_JSException(data->context, exception);
+        return NULL;
+    }
+    result = PyJS_new(data->context, iter);
+    Py_DECREF(iter);
+    if (!result) {
+        set_JSException(data->context, exception);
+    }
+    return result;
+}
+
+/* pull(iterator proxy): returns an array of up to iter_batch next values */
+static JSValueRef
+JSIterable_pull(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                size_t argumentCount, const JSValueRef arguments[],
+                JSValueRef *exception)
+{
+    JSPrivateData *data = JSIterable_argument(ctx, argumentCount, arguments, exception);
+    JSObjectRef array;
+    JSValueRef value;
+    PyObject *item;
+    Py_ssize_t n;
+
+    if (!data) {
+        return NULL;
+    }
+    if (!PyIter_Check(data->obj)) {
+        set_JSError(ctx, "expected a Python iterator", exception);
+        return NULL;
+    }
+    /* the array is kept on the stack where the collector finds it */
+    if (!(array = JSObjectMakeArray(ctx, 0, NULL, exception))) {
+        return NULL;
+    }
+    for (n = 0; n < data->context->iter_batch; n++) {
+        if (!(item = PyIter_Next(data->obj)))
+            break;
+        value = PyObject_to_JSValue(item, data->context);
+        Py_DECREF(item);
+        if (!value)
+            break;
+        JSObjectSetPropertyAtIndex(ctx, array, (unsigned)n, value, exception);
+        if (*exception)
+            return NULL;
+    }
+    if (PyErr_Occurred()) {
+        set_JSException(data->context, exception);
+        return NULL;
+    }
+    return array;
+}
+
+/* creates the prototype of iterable Python proxies for the context */
+static int
+PyJSIterable_makePrototype(PyJSContext *context)
+{
+    JSValueRef args[2], value, exception = NULL;
+    JSObjectRef factory;
+    JSStringRef name;
+
+    if (!(factory = PyJSContext_compileHelper(context, JSIterable_protoSource))) {
+        return -1;
+    }
+    name = JSStringCreateWithUTF8CString("open");
+    args[0] = JSObjectMakeFunctionWithCallback(context->context, name, JSIterable_open);
+    JSStringRelease(name);
+    name = JSStringCreateWithUTF8CString("pull");
+    args[1] = JSObjectMakeFunctionWithCallback(context->context, name, JSIterable_pull);
+    JSStringRelease(name);
+    value = JSObjectCallAsFunction(context->context, factory, NULL, 2, args, &exception);
+    JSValueUnprotect(context->context, factory);
+    if (!value || !(context->iter_proto = JSValueToObject(context->context, value, &exception))) {
+        JSException_to_PyErr(context, exception);
+        return -1;
+    }
+    JSValueProtect(context->context, context->iter_proto);
+    return 0;
+}
+
+int
+PyJSIterable_setPrototype(PyJSContext *context, JSObjectRef object, PyObject *pyobj)
+{
+    PyTypeObject *type = Py_TYPE(pyobj);
+
+    if (!(PyType_HasFeature(type, Py_TPFLAGS_HAVE_ITER) && type->tp_iter) &&
+        !PySequence_Check(pyobj)) {
+        return 0;
+    }
+    if (!context->iter_proto && PyJSIterable_makePrototype(context) < 0) {
+        return -1;
+    }
+    JSObjectSetPrototype(context->context, object, context->iter_proto);
+    return 0;
+}
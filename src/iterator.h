@@ -0,0 +1,41 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+typedef struct PyJSIter PyJSIter;
+
+/* values pulled per boundary crossing unless configured otherwise */
+#define JSITER_DEFAULT_BATCH 64
+
+/* Iterates a JS iterable (generator, Map, Set, ...) through its
+   Symbol.iterator, gathering up to batch values per call into JS */
+struct PyJSIter {
+    PyObject_HEAD
+    PyJSContext         *context;   /* retain */
+    JSObjectRef         iterator;   /* protect; NULL once exhausted */
+    PyObject            *pending;   /* retain; values of the last batch */
+    Py_ssize_t          index;      /* next value in pending */
+    Py_ssize_t          batch;
+};
+
+extern PyTypeObject jscore_PyJSIterType;
+
+/* returns a new iterator over the values of a JS iterable; if the object
+   has no Symbol.iterator, returns NULL, raising TypeError only if
+   required is set */
+PyObject *PyJSIter_new(PyJSObject *object, Py_ssize_t batch, int required);
+
+/* gives the JS proxy of an iterable Python object a Symbol.iterator, which
+   pulls the context's iter_batch values per call into Python;
+   returns -1 with a Python exception set on failure */
+int PyJSIterable_setPrototype(PyJSContext *context, JSObjectRef object, PyObject *pyobj);
+
+/* releases the helpers of the context (before the context is released) */
+void PyJSIter_clearContext(PyJSContext *context);
@@ -5,27 +5,71 @@
 #include "jscore.h"
 #include "jsobj.h"
 #include "conversions.h"
+#include "script.h"
+#include "jsexport.h"
+#include "executor.h"
+#include "clone.h"
+#include "jsstring.h"
+#include "iterator.h"
+#include "collect.h"
+#include "accessor.h"
+#include "buffer.h"
+#include "eventloop.h"
+#include "profiler.h"
+#include "checkpoint.h"
+#include "modules.h"
+#include "policy.h"
+#include "stream.h"
 
 PyJSObject *PyJSNull;
+JSStringRef JSLengthString;
+
+/* number of call arguments converted into a buffer on the stack */
+#define JSARGS_STACK_SIZE 16
 
 static PyObject *PyJSContext_getGlobalObject(PyJSContext *);
 static PyObject *PyJSObject_repr(PyJSObject *self);
 
+/* Wrappers are short-lived and created in bulk, so freed ones are kept on
+   freelists (chained through their first pointer field) for reuse */
+PyJSFreelistStats PyJSObject_freelist_stats = {256};
+PyJSFreelistStats PyJSObjectIter_freelist_stats = {16};
+static PyJSObject *object_freelist = NULL;
+static PyJSObjectIter *iter_freelist = NULL;
+
 PyObject *
 PyJSObject_new(JSObjectRef object, PyJSObject *thisObject, PyJSContext *context)
 {
-    PyJSObject *self = (PyJSObject *)jscore_PyJSObjectType.tp_alloc(
-        &jscore_PyJSObjectType, 0);
-    if (!self)
-        return NULL;
+    PyJSObject *self;
+    int reused = 0;
+    
+    if (object_freelist) {
+        /* freed objects are untracked; this one is tracked again once
+           its fields are set */
+        self = object_freelist;
+        reused = 1;
+        object_freelist = (PyJSObject *)self->object;
+        PyJSObject_freelist_stats.numfree--;
+        PyJSObject_freelist_stats.reuses++;
+        (void)PyObject_INIT(self, &jscore_PyJSObjectType);
+    } else {
+        self = (PyJSObject *)jscore_PyJSObjectType.tp_alloc(
+            &jscore_PyJSObjectType, 0);
+        if (!self)
+            return NULL;
+        PyJSObject_freelist_stats.allocs++;
+    }
     self->object = object;
     self->thisObject = thisObject;
     self->context = context;
+    self->weak_index = -1;
     
     if (object && context) 
         JSValueProtect(context->context, object);
     Py_XINCREF(thisObject);
     Py_XINCREF(context);
+    if (reused)
+        PyObject_GC_Track(self);
 #ifdef TRACE_MALLOC
     printf("ALLOC ");
     PyObject *repr = PyJSObject_repr(self);
@@ -137,45 +181,185 @@ PyJSObject_setitem(PyJSObject *self, PyObject *key, PyObject *value)
     }
 }
 
+/* returns a new PyObject for the property, or a new reference to dflt if
+   the object does not have the property (dflt may be NULL, in which case
+   NULL is returned without an exception set) */
+static PyObject *
+PyJSObject_lookup(PyJSObject *self, PyObject *key, PyObject *dflt)
+{
+    JSStringRef jsstr = NULL;
+    JSValueRef value = NULL;
+    JSValueRef exception = NULL;
+    JSGlobalContextRef context = self->context->context;
+
+    if (PyInt_Check(key)) {
+        long ikey = PyInt_AS_LONG(key);
+        if (ikey >= 0 && ikey < UINT_MAX) {
+            value = JSObjectGetPropertyAtIndex(context, self->object,
+                ikey, &exception);
+            if (!value) {
+                return JSException_to_PyErr(self->context, exception);
+            }
+            if (!JSValueIsUndefined(context, value)) {
+                return JSValue_to_PyJSObject(value, self);
+            }
+        }
+    }
+    if (!(jsstr = PyObject_to_JSString(key))) {
+        return NULL;
+    }
+    if (!value) {
+        value = JSObjectGetProperty(context, self->object, jsstr, &exception);
+        if (!value) {
+            JSStringRelease(jsstr);
+            return JSException_to_PyErr(self->context, exception);
+        }
+    }
+    /* a single lookup suffices unless the value is undefined, in which
+       case we need to know whether the property exists at all */
+    if (JSValueIsUndefined(context, value) &&
+        !JSObjectHasProperty(context, self->object, jsstr)) {
+        JSStringRelease(jsstr);
+        Py_XINCREF(dflt);
+        return dflt;
+    }
+    JSStringRelease(jsstr);
+    return JSValue_to_PyJSObject(value, self);
+}
+
 static PyObject *
 PyJSObject_getattro(PyJSObject *self, PyObject *key)
 {
     PyObject *result = NULL;
-    JSStringRef jsstr = NULL;
     
-    /* See if we can get the attribute by traditional means */
-    if ((result = PyBaseObject_Type.tp_getattro((PyObject *)self, key))) {
-        return result;
+    /* Attributes of the type (methods, special attributes) take precedence;
+       looking them up directly avoids raising and clearing an
+       AttributeError for every JS property access */
+    if (!self->object || !PyString_Check(key) ||
+        _PyType_Lookup(Py_TYPE(self), key)) {
+        return PyObject_GenericGetAttr((PyObject *)self, key);
     }
-    PyErr_Clear();
-    
     
+    if (!(result = PyJSObject_lookup(self, key, NULL)) && !PyErr_Occurred()) {
+        PyErr_Format(PyExc_AttributeError,
+            "JSObject has no property '%.400s'", PyString_AsString(key));
+    }
+    return result;
+}
+
+static PyObject *
+PyJSObject_get_many(PyJSObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"keys", "default", NULL};
+    PyObject *keys, *dflt = Py_None, *seq, *result;
+    Py_ssize_t i, size;
     
-    if ((jsstr = PyObject_to_JSString(key))) {
-        if (JSObjectHasProperty(self->context->context, self->object, jsstr)) {
-            JSValueRef exception = NULL;
-            JSValueRef value = JSObjectGetProperty(self->context->context,
-                 self->object, jsstr, &exception);
-            JSStringRelease(jsstr);
-            if (!value) {
-                return JSException_to_PyErr(self->context, exception);
-            }
-            return JSValue_to_PyJSObject(value, self);
-        } else {
-            JSStringRelease(jsstr);
-            PyErr_Format(PyExc_AttributeError,
-                "JSObject has no property '%.400s'", PyString_AsString(key));
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:js_get_many", kwlist,
+                                     &keys, &dflt))
+        return NULL;
+    if (!self->object) {
+        PyErr_SetString(PyExc_TypeError, "null has no properties");
+        return NULL;
+    }
+    if (!(seq = PySequence_Fast(keys, "keys must be iterable")))
+        return NULL;
+    size = PySequence_Fast_GET_SIZE(seq);
+    if (!(result = PyTuple_New(size)))
+        goto finally;
+    for (i = 0; i < size; i++) {
+        PyObject *item = PyJSObject_lookup(self,
+            PySequence_Fast_GET_ITEM(seq, i), dflt);
+        if (!item) {
+            Py_CLEAR(result);
+            goto finally;
         }
+        PyTuple_SET_ITEM(result, i, item);
     }
-    return NULL;
+  finally:
+    Py_DECREF(seq);
+    return result;
 }
 
+static int PyJSObject_setitem(PyJSObject *, PyObject *, PyObject *);
+
+/* sets every key/value pair of a dict, mapping or iterable of pairs */
+static int
+PyJSObject_update_from(PyJSObject *self, PyObject *mapping)
+{
+    PyObject *key, *value, *seq;
+    Py_ssize_t i, size;
+    
+    if (PyDict_Check(mapping)) {
+        i = 0;
+        while (PyDict_Next(mapping, &i, &key, &value)) {
+            if (PyJSObject_setitem(self, key, value) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    if (PyObject_HasAttrString(mapping, "keys")) {
+        PyObject *items = PyMapping_Items(mapping);
+        if (!items)
+            return -1;
+        seq = PySequence_Fast(items, "items() must return a sequence");
+        Py_DECREF(items);
+    } else {
+        seq = PySequence_Fast(mapping, "js_update() needs a mapping or pairs");
+    }
+    if (!seq)
+        return -1;
+    size = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < size; i++) {
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "OO", &key, &value) ||
+            PyJSObject_setitem(self, key, value) < 0) {
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+    return 0;
+}
 
+static PyObject *
+PyJSObject_update(PyJSObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *mapping = NULL;
+    
+    if (!PyArg_UnpackTuple(args, "js_update", 0, 1, &mapping))
+        return NULL;
+    if (!self->object) {
+        PyErr_SetString(PyExc_TypeError, "null has no properties");
+        return NULL;
+    }
+    if (mapping && PyJSObject_update_from(self, mapping) < 0)
+        return NULL;
+    if (kwds && PyJSObject_update_from(self, kwds) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
 
+/* iterables other than arrays (generators, Maps, Sets, ...) are iterated
+   through Symbol.iterator; arrays and plain objects yield property names */
 static PyObject *
 PyJSObject_getiter(PyJSObject *self)
 {
-    PyJSObjectIter *iter = JSALLOC(PyJSObjectIter);
+    PyJSObjectIter *iter;
+    
+    if (self->object && !JSValueIsArray(self->context->context, self->object)) {
+        PyObject *values = PyJSIter_new(self, self->context->iter_batch, 0);
+        if (values || PyErr_Occurred())
+            return values;
+    }
+    if (iter_freelist) {
+        iter = iter_freelist;
+        iter_freelist = (PyJSObjectIter *)iter->object;
+        PyJSObjectIter_freelist_stats.numfree--;
+        PyJSObjectIter_freelist_stats.reuses++;
+        (void)PyObject_INIT(iter, &jscore_PyJSObjectIterType);
+    } else {
+        iter = JSALLOC(PyJSObjectIter);
+        PyJSObjectIter_freelist_stats.allocs++;
+    }
 #ifdef TRACE_MALLOC
     printf("ALLOC <JSObjectIter>\n");
 #endif
@@ -203,6 +387,102 @@ PyJSObject_repr(PyJSObject *self)
     }
 }
 
+/* the object a function wrapper passes as this when called, or NULL */
+static JSObjectRef
+PyJSObject_boundThis(PyJSObject *self)
+{
+    if (!self->thisObject || !self->object ||
+        !JSObjectIsFunction(self->context->context, self->object)) {
+        return NULL;
+    }
+    return self->thisObject->object;
+}
+
+/* wrappers compare by the identity of their objects (strict equality, for
+   objects) and, for functions, of the this they are bound to; wrappers of
+   one object hash alike for as long as it lives, as the collector does not
+   move objects */
+static long
+PyJSObject_hash(PyJSObject *self)
+{
+    long hash = _Py_HashPointer(self->object);
+    JSObjectRef bound = PyJSObject_boundThis(self);
+
+    if (bound) {
+        hash = hash * 1000003 ^ _Py_HashPointer(bound);
+    }
+    return hash == -1 ? -2 : hash;
+}
+
+static PyObject *
+PyJSObject_richcompare(PyObject *a, PyObject *b, int op)
+{
+    JSObjectRef x, y;
+    int result;
+
+    /* JS objects have no order */
+    if ((op != Py_EQ && op != Py_NE) ||
+        !PyObject_TypeCheck(a, &jscore_PyJSObjectType) ||
+        !PyObject_TypeCheck(b, &jscore_PyJSObjectType)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    x = ((PyJSObject *)a)->object;
+    y = ((PyJSObject *)b)->object;
+    result = x == y && PyJSObject_boundThis((PyJSObject *)a) ==
+        PyJSObject_boundThis((PyJSObject *)b);
+    return PyBool_FromLong(op == Py_EQ ? result : !result);
+}
+
+/* compares with JS semantics (==), converting other to a JS value */
+static PyObject *
+PyJSObject_js_equals(PyJSObject *self, PyObject *other)
+{
+    JSGlobalContextRef context;
+    JSValueRef value, exception = NULL;
+    bool result;
+
+    if (!self->context) {
+        PyErr_SetString(PyExc_TypeError, "js_equals() needs a JSObject of a context");
+        return NULL;
+    }
+    context = self->context->context;
+    if (!(value = PyObject_to_JSValue(other, self->context))) {
+        return NULL;
+    }
+    result = JSValueIsEqual(context,
+        self->object ? (JSValueRef)self->object : JSValueMakeNull(context),
+        value, &exception);
+    if (exception) {
+        return JSException_to_PyErr(self->context, exception);
+    }
+    return PyBool_FromLong(result);
+}
+
+static int
+PyJSObject_traverse(PyJSObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->thisObject);
+    Py_VISIT(self->context);
+    return 0;
+}
+
+static int
+PyJSObject_clear(PyJSObject *self)
+{
+    if (self->weak_index >= 0) {
+        /* Context.collect() holds no root for the object; it may be gone */
+        self->context->weak_wrappers[self->weak_index] = NULL;
+        self->weak_index = -1;
+    } else if (self->object && self->context->context) {
+        JSValueUnprotect(self->context->context, self->object);
+    }
+    self->object = NULL;
+    Py_CLEAR(self->thisObject);
+    Py_CLEAR(self->context);
+    return 0;
+}
+
 static void
 PyJSObject_dealloc(PyJSObject *self)
 {
@@ -214,53 +494,179 @@ PyJSObject_dealloc(PyJSObject *self)
     Py_DECREF(repr);
     printf("\n");
 #endif
-    if (self->object) {
-        JSValueUnprotect(self->context->context, self->object);
+    PyObject_GC_UnTrack(self);
+    PyJSObject_clear(self);
+    if (PyJSObject_freelist_stats.numfree < PyJSObject_freelist_stats.limit) {
+        self->object = (JSObjectRef)object_freelist;
+        object_freelist = self;
+        PyJSObject_freelist_stats.numfree++;
+    } else {
+        self->ob_type->tp_free((PyObject*)self);
     }
-    Py_XDECREF(self->thisObject);
-    Py_XDECREF(self->context);
-    self->ob_type->tp_free((PyObject*)self);
 }
 
 
+/* calls function with the given Python objects as arguments;
+   returns a new PyObject or NULL */
 static PyObject *
-PyJSObject_call(PyJSObject *self, PyObject *args, PyObject *kwargs)
+PyJSObject_callWithObjects(PyJSContext *context, JSObjectRef function,
+                           JSObjectRef thisObject, PyObject **items, Py_ssize_t count)
 {
-    PyObject *result = NULL;
+    /* arguments are kept on the stack where the JS collector scans for
+       them conservatively; only long argument lists need the heap */
+    JSValueRef stackbuf[JSARGS_STACK_SIZE];
+    JSValueRef *values = stackbuf;
     JSValueRef value = NULL;
     JSValueRef exception = NULL;
-    int i;
+    PyObject *result = NULL;
+    Py_ssize_t i;
+    
+    if (count > JSARGS_STACK_SIZE) {
+        values = (JSValueRef *)malloc(count * sizeof(JSValueRef));
+        if (values == NULL) {
+            return PyErr_NoMemory();
+        }
+    }
+    for (i = 0; i < count; i++) {
+        values[i] = PyObject_to_JSValue(items[i], context);
+        if (!values[i]) goto finally;
+    }
+    value = JSObjectCallAsFunction(context->context, function, thisObject,
+        count, values, &exception);
+    if (value) {
+        result = JSValue_to_PyJSObject(value, &context->dummy);
+    } else {
+        JSException_to_PyErr(context, exception);
+    }
+  finally:
+    if (values != stackbuf) {
+        free(values);
+    }
+    return result;
+}
 
-    if (kwargs) {
+static PyObject *
+PyJSObject_call(PyJSObject *self, PyObject *args, PyObject *kwargs)
+{
+    if (kwargs && PyDict_Size(kwargs)) {
         PyErr_SetString(PyExc_TypeError, "Keyword arguments are not supported");
         return NULL;
     }
-    if (!JSObjectIsFunction(self->context->context, self->object)) {
+    if (!self->object || !JSObjectIsFunction(self->context->context, self->object)) {
         PyErr_SetString(PyExc_TypeError, "JSObject not callable");
         return NULL;
     }
+    return PyJSObject_callWithObjects(self->context, self->object,
+        self->thisObject ? self->thisObject->object : NULL,
+        PySequence_Fast_ITEMS(args), PyTuple_GET_SIZE(args));
+}
 
-    Py_ssize_t argCount = PyTuple_Size(args);
-    JSValueRef *valueList = malloc(argCount * sizeof(JSValueRef));
-    for (i = 0; i < argCount; i++) {
-        PyObject *pyValue = PyTuple_GET_ITEM(args, i);
-        valueList[i] = PyObject_to_JSValue(pyValue, self->context);
-        if (!valueList[i]) goto argErr;
+/* calls the method with the given name, with the object as this; unlike
+   obj.method(...), does not create a bound wrapper for the function, and
+   the result does not retain the object */
+static PyObject *
+PyJSObject_callmethod(PyJSObject *self, PyObject *args)
+{
+    JSGlobalContextRef context;
+    JSValueRef value, exception = NULL;
+    JSObjectRef function;
+    JSStringRef jsstr;
+    
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "js_callmethod() needs a method name");
+        return NULL;
+    }
+    if (!self->object) {
+        PyErr_SetString(PyExc_TypeError, "null has no methods");
+        return NULL;
+    }
+    context = self->context->context;
+    if (!(jsstr = PyObject_to_JSString(PyTuple_GET_ITEM(args, 0)))) {
+        return NULL;
     }
+    value = JSObjectGetProperty(context, self->object, jsstr, &exception);
+    JSStringRelease(jsstr);
+    if (!value) {
+        return JSException_to_PyErr(self->context, exception);
+    }
+    if (!JSValueIsObject(context, value) ||
+        !(function = JSValueToObject(context, value, NULL)) ||
+        !JSObjectIsFunction(context, function)) {
+        PyObject *name = PyObject_Str(PyTuple_GET_ITEM(args, 0));
+        if (name) {
+            PyErr_Format(PyExc_TypeError, "JS property '%.400s' is not a function",
+                PyString_AS_STRING(name));
+            Py_DECREF(name);
+        }
+        return NULL;
+    }
+    return PyJSObject_callWithObjects(self->context, function, self->object,
+        PySequence_Fast_ITEMS(args) + 1, PyTuple_GET_SIZE(args) - 1);
+}
 
-    value = JSObjectCallAsFunction(self->context->context, self->object, 
-        self->thisObject ? self->thisObject->object : NULL,
-        argCount, valueList, &exception);
-    if (value) {
-        result = JSValue_to_PyJSObject(value, &self->context->dummy);
-        return result;
-    } else {
-        JSException_to_PyErr(self->context, exception);
+static PyObject *
+PyJSObject_iter(PyJSObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"batch", NULL};
+    Py_ssize_t batch = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:js_iter", kwlist, &batch))
+        return NULL;
+    if (batch < 0) {
+        PyErr_SetString(PyExc_ValueError, "batch must be positive");
+        return NULL;
     }
-    return result;
-  argErr:
-    free(valueList);
-    return NULL;
+    return PyJSIter_new(self, batch ? batch : self->context->iter_batch, 1);
+}
+
+static PyObject *
+PyJSObject_mapImpl(PyJSObject *self, PyObject *args, PyObject *kwds, int star)
+{
+    static char *kwlist[] = {"iterable", "chunk_size", "batch", NULL};
+    PyObject *iterable;
+    Py_ssize_t chunk_size = 64;
+    int batch = 0;
+    PyJSMapIter *iter;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            star ? "O|ni:js_starmap" : "O|ni:js_map", kwlist,
+            &iterable, &chunk_size, &batch))
+        return NULL;
+    if (!self->object || !JSObjectIsFunction(self->context->context, self->object)) {
+        PyErr_SetString(PyExc_TypeError, "JSObject not callable");
+        return NULL;
+    }
+    if (chunk_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+    if (!(iter = JSALLOC(PyJSMapIter)))
+        return NULL;
+    iter->iter = PyObject_GetIter(iterable);
+    iter->pending = PyList_New(0);
+    Py_INCREF(self);
+    iter->function = self;
+    iter->index = 0;
+    iter->chunk_size = chunk_size;
+    iter->star = star;
+    iter->batch = batch;
+    if (!iter->iter || !iter->pending) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    return (PyObject *)iter;
+}
+
+static PyObject *
+PyJSObject_map(PyJSObject *self, PyObject *args, PyObject *kwds)
+{
+    return PyJSObject_mapImpl(self, args, kwds, 0);
+}
+
+static PyObject *
+PyJSObject_starmap(PyJSObject *self, PyObject *args, PyObject *kwds)
+{
+    return PyJSObject_mapImpl(self, args, kwds, 1);
 }
 
 static PySequenceMethods PyJSObject_as_sequence = {
@@ -282,6 +688,37 @@ static PyMappingMethods PyJSObject_as_mapping = {
 	(objobjargproc)PyJSObject_setitem,      /* mp_ass_subscript */
 };
 
+static PyMethodDef PyJSObject_methods[] = {
+    {"js_callmethod", (PyCFunction)PyJSObject_callmethod, METH_VARARGS,
+     "js_callmethod(name, *args) -> call the named method of the object in one\n"
+     "step, without creating a bound method"},
+    {"js_equals", (PyCFunction)PyJSObject_js_equals, METH_O,
+     "js_equals(other) -> whether the object == other in JS (loose equality,\n"
+     "calling valueOf/toString as needed); == in Python compares identity"},
+    {"js_get_many", (PyCFunction)PyJSObject_get_many, METH_VARARGS | METH_KEYWORDS,
+     "js_get_many(keys, default=None) -> tuple of the values of the given\n"
+     "properties"},
+    {"js_to_buffer", (PyCFunction)PyJSObject_toBuffer, METH_VARARGS | METH_KEYWORDS,
+     "js_to_buffer(dtype=None, out=None) -> array.array (or out, any writable\n"
+     "buffer) of the numbers of an array or a typed array, copied in one pass;\n"
+     "dtype defaults to the element type of out, or 'd'; the 64-bit dtypes\n"
+     "'q' and 'Q' need out"},
+    {"js_update", (PyCFunction)PyJSObject_update, METH_VARARGS | METH_KEYWORDS,
+     "js_update([mapping], **kwargs) -> set the properties from a mapping"},
+    {"js_iter", (PyCFunction)PyJSObject_iter, METH_VARARGS | METH_KEYWORDS,
+     "js_iter(batch=Context.iter_batch) -> iterator over the values of a JS\n"
+     "iterable (Array, Map, Set, generator, ...), pulling batch values per\n"
+     "call into JS"},
+    {"js_map", (PyCFunction)PyJSObject_map, METH_VARARGS | METH_KEYWORDS,
+     "js_map(iterable, chunk_size=64, batch=False) -> iterator over the results\n"
+     "of calling the function on each item; with batch=True the function\n"
+     "is called once per chunk with an array and must return an array"},
+    {"js_starmap", (PyCFunction)PyJSObject_starmap, METH_VARARGS | METH_KEYWORDS,
+     "js_starmap(iterable, chunk_size=64, batch=False) -> like js_map(), but each\n"
+     "item is unpacked into the arguments (or an argument array in batches)"},
+    {NULL},
+};
+
 PyTypeObject jscore_PyJSObjectType = {
     PyObject_HEAD_INIT(NULL)
     0,                              /* ob_size */
@@ -297,21 +734,21 @@ PyTypeObject jscore_PyJSObjectType = {
     0,                              /* tp_as_number */
     &PyJSObject_as_sequence,        /* tp_as_sequence */
     &PyJSObject_as_mapping,         /* tp_as_mapping */
-    0,                              /* tp_hash */
+    (hashfunc)PyJSObject_hash,      /* tp_hash */
     (ternaryfunc)PyJSObject_call,   /* tp_call */
     0,                              /* tp_str */
     (getattrofunc)PyJSObject_getattro, /* tp_getattro */
     (setattrofunc)PyJSObject_setitem, /* tp_setattro */
     0,                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
     "A wrapper for a JavaScript object.", /* tp_doc */
-    0,                              /* tp_traverse */
-    0,                              /* tp_clear */
-    0,                              /* tp_richcompare */
+    (traverseproc)PyJSObject_traverse, /* tp_traverse */
+    (inquiry)PyJSObject_clear,      /* tp_clear */
+    PyJSObject_richcompare,         /* tp_richcompare */
     0,                              /* tp_weaklistoffset */
     (getiterfunc)PyJSObject_getiter,/* tp_iter */
     0,                              /* tp_iternext */
-    0,                              /* tp_methods */
+    PyJSObject_methods,             /* tp_methods */
     0,                              /* tp_members */
     0,                              /* tp_getset */
     0,                              /* tp_base */
@@ -349,7 +786,13 @@ PyJSObjectIter_dealloc(PyJSObjectIter *self)
 #ifdef TRACE_MALLOC
     printf("FREE  <JSObjectIter>\n");
 #endif
-    self->ob_type->tp_free((PyObject*)self);
+    if (PyJSObjectIter_freelist_stats.numfree < PyJSObjectIter_freelist_stats.limit) {
+        self->object = (PyJSObject *)iter_freelist;
+        iter_freelist = self;
+        PyJSObjectIter_freelist_stats.numfree++;
+    } else {
+        self->ob_type->tp_free((PyObject*)self);
+    }
 }
 
 
@@ -399,12 +842,287 @@ PyTypeObject jscore_PyJSObjectIterType = {
 /******************************************************************************/
 /******************************************************************************/
 
+/* converts an item of a js_starmap into an array of its elements */
+static JSValueRef
+PySequence_to_JSArray(PyObject *item, PyJSContext *context)
+{
+    JSValueRef exception = NULL;
+    JSObjectRef array;
+    PyObject *seq;
+    Py_ssize_t i, size;
+    
+    if (!(seq = PySequence_Fast(item, "js_starmap items must be sequences")))
+        return NULL;
+    size = PySequence_Fast_GET_SIZE(seq);
+    array = JSObjectMakeArray(context->context, 0, NULL, &exception);
+    if (!array) {
+        Py_DECREF(seq);
+        JSException_to_PyErr(context, exception);
+        return NULL;
+    }
+    JSValueProtect(context->context, array);
+    for (i = 0; i < size; i++) {
+        JSValueRef value = PyObject_to_JSValue(
+            PySequence_Fast_GET_ITEM(seq, i), context);
+        if (!value) goto err;
+        JSObjectSetPropertyAtIndex(context->context, array, i, value, &exception);
+        if (exception) {
+            JSException_to_PyErr(context, exception);
+            goto err;
+        }
+    }
+    Py_DECREF(seq);
+    JSValueUnprotect(context->context, array);
+    return array;
+  err:
+    Py_DECREF(seq);
+    JSValueUnprotect(context->context, array);
+    return NULL;
+}
+
+/* calls the function once for each of up to chunk_size items;
+   returns the number of items consumed, or -1 */
+static Py_ssize_t
+PyJSMapIter_fillEach(PyJSMapIter *self)
+{
+    PyJSObject *function = self->function;
+    JSObjectRef thisObject = function->thisObject ? function->thisObject->object : NULL;
+    PyObject *item, *result;
+    Py_ssize_t n;
+    
+    for (n = 0; n < self->chunk_size; n++) {
+        if (!(item = PyIter_Next(self->iter)))
+            break;
+        if (self->star) {
+            PyObject *seq = PySequence_Fast(item, "js_starmap items must be sequences");
+            result = seq ? PyJSObject_callWithObjects(function->context,
+                               function->object, thisObject,
+                               PySequence_Fast_ITEMS(seq),
+                               PySequence_Fast_GET_SIZE(seq)) : NULL;
+            Py_XDECREF(seq);
+        } else {
+            result = PyJSObject_callWithObjects(function->context,
+                function->object, thisObject, &item, 1);
+        }
+        Py_DECREF(item);
+        if (!result)
+            return -1;
+        if (PyList_Append(self->pending, result) < 0) {
+            Py_DECREF(result);
+            return -1;
+        }
+        Py_DECREF(result);
+    }
+    return PyErr_Occurred() ? -1 : n;
+}
+
+/* calls the function once with an array of up to chunk_size items;
+   returns the number of items consumed, or -1 */
+static Py_ssize_t
+PyJSMapIter_fillBatch(PyJSMapIter *self)
+{
+    PyJSObject *function = self->function;
+    PyJSContext *context = function->context;
+    JSObjectRef thisObject = function->thisObject ? function->thisObject->object : NULL;
+    JSValueRef exception = NULL;
+    JSValueRef value, arg;
+    JSObjectRef array, results;
+    PyObject *item;
+    Py_ssize_t n, rv = -1;
+    unsigned i, length;
+    
+    array = JSObjectMakeArray(context->context, 0, NULL, &exception);
+    if (!array) {
+        JSException_to_PyErr(context, exception);
+        return -1;
+    }
+    /* the chunk is built in a protected array, so converted items cannot be
+       collected while later ones are converted */
+    JSValueProtect(context->context, array);
+    for (n = 0; n < self->chunk_size; n++) {
+        if (!(item = PyIter_Next(self->iter)))
+            break;
+        value = self->star ? PySequence_to_JSArray(item, context)
+                           : PyObject_to_JSValue(item, context);
+        Py_DECREF(item);
+        if (!value)
+            goto finally;
+        JSObjectSetPropertyAtIndex(context->context, array, n, value, &exception);
+        if (exception) {
+            JSException_to_PyErr(context, exception);
+            goto finally;
+        }
+    }
+    if (PyErr_Occurred())
+        goto finally;
+    if (n == 0) {
+        rv = 0;
+        goto finally;
+    }
+    arg = array;
+    value = JSObjectCallAsFunction(context->context, function->object,
+        thisObject, 1, &arg, &exception);
+    if (!value) {
+        JSException_to_PyErr(context, exception);
+        goto finally;
+    }
+    if (!JSValueIsObject(context->context, value)) {
+        PyErr_SetString(PyExc_TypeError, "batch function must return an array");
+        goto finally;
+    }
+    results = JSValueToObject(context->context, value, NULL);
+    JSValueProtect(context->context, results);
+    value = JSObjectGetProperty(context->context, results, JSLengthString, &exception);
+    length = value ? (unsigned)JSValueToNumber(context->context, value, &exception) : 0;
+    if (!exception && length != (unsigned)n) {
+        PyErr_Format(PyExc_ValueError, "batch function returned %u results for %zd items",
+                     length, n);
+        JSValueUnprotect(context->context, results);
+        goto finally;
+    }
+    for (i = 0; !exception && i < length; i++) {
+        PyObject *result;
+        value = JSObjectGetPropertyAtIndex(context->context, results, i, &exception);
+        if (!value)
+            break;
+        if (!(result = JSValue_to_PyJSObject(value, &context->dummy)))
+            break;
+        rv = PyList_Append(self->pending, result);
+        Py_DECREF(result);
+        if (rv < 0)
+            break;
+    }
+    JSValueUnprotect(context->context, results);
+    if (exception) {
+        JSException_to_PyErr(context, exception);
+        rv = -1;
+    } else {
+        rv = PyErr_Occurred() ? -1 : n;
+    }
+  finally:
+    JSValueUnprotect(context->context, array);
+    return rv;
+}
+
+static PyObject *
+PyJSMapIter_next(PyJSMapIter *self)
+{
+    PyObject *result;
+    Py_ssize_t consumed;
+    
+    while (self->index >= PyList_GET_SIZE(self->pending)) {
+        if (!self->iter) {
+            return NULL;
+        }
+        if (PyList_SetSlice(self->pending, 0, PyList_GET_SIZE(self->pending), NULL) < 0)
+            return NULL;
+        self->index = 0;
+        consumed = self->batch ? PyJSMapIter_fillBatch(self)
+                               : PyJSMapIter_fillEach(self);
+        if (consumed < 0) {
+            /* the results of the chunk before the error are dropped, and
+               the iterator ends */
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            PyList_SetSlice(self->pending, 0, PyList_GET_SIZE(self->pending), NULL);
+            Py_CLEAR(self->iter);
+            PyErr_Restore(type, value, tb);
+            return NULL;
+        }
+        if (consumed < self->chunk_size) {
+            /* the iterable is exhausted */
+            Py_CLEAR(self->iter);
+        }
+    }
+    result = PyList_GET_ITEM(self->pending, self->index);
+    self->index++;
+    Py_INCREF(result);
+    return result;
+}
+
+static void
+PyJSMapIter_dealloc(PyJSMapIter *self)
+{
+    Py_XDECREF(self->function);
+    Py_XDECREF(self->iter);
+    Py_XDECREF(self->pending);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+PyTypeObject jscore_PyJSMapIterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.JSMapIterator",       /* tp_name */
+    sizeof(PyJSMapIter),            /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSMapIter_dealloc,/* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Iterator over the results of JSObject.js_map().", /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    PyObject_SelfIter,              /* tp_iter */
+    (iternextfunc)PyJSMapIter_next, /* tp_iternext */
+    0,                              /* tp_methods */
+    0,                              /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    0,                              /* tp_new */
+};
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
 static PyObject *
 PyJSContext_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
+    static char *kwlist[] = {"flags", "timers", NULL};
     PyJSContext *self;
-    self = PyObject_New(PyJSContext, type);
+    int flags = 0, timers = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii:Context", kwlist, &flags, &timers))
+        return NULL;
+    self = (PyJSContext *)type->tp_alloc(type, 0);
     if (self != NULL) {
+        self->flags = flags;
+        self->cloned_bytes = 0;
+        self->iter_batch = JSITER_DEFAULT_BATCH;
+        self->iter_open = NULL;
+        self->iter_pull = NULL;
+        self->iter_proto = NULL;
+        self->proxies = NULL;
+        self->nproxies = 0;
+        self->weak_wrappers = NULL;
+        self->nweak = 0;
+        self->loop = NULL;
+        self->profiling = 0;
+        self->profile = NULL;
+        self->restore = NULL;
+        self->modules = NULL;
+        self->policy = NULL;
+        self->admitted = NULL;
         self->context = JSGlobalContextCreate(NULL);
         if (self->context == NULL) {
             PyErr_SetString((PyObject *)&jscore_PyJSErrorType, "Context creation failed!");
@@ -413,6 +1131,11 @@ PyJSContext_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         self->dummy.object = NULL;
         self->dummy.thisObject = NULL;
         self->dummy.context = self;
+        self->dummy.weak_index = -1;
+        if (self->context && timers && PyJSEventLoop_install(self) < 0) {
+            Py_DECREF(self);
+            self = NULL;
+        }
     }
 #ifdef TRACE_MALLOC
     printf("ALLOC <Context>\n");
@@ -420,14 +1143,58 @@ PyJSContext_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     return (PyObject *)self;
 }
 
+/* each proxy holds its Python object and the context, so the collector
+   can tell when a context is only kept alive by the objects it proxies */
+static int
+PyJSContext_traverse(PyJSContext *self, visitproc visit, void *arg)
+{
+    JSPrivateData *data;
+    
+    for (data = self->proxies; data; data = data->next) {
+        Py_VISIT(data->obj);
+        Py_VISIT(data->export);
+        Py_VISIT(self);
+    }
+    if (self->loop) {
+        Py_VISIT(self->loop->hook);
+    }
+    Py_VISIT(self->modules);
+    Py_VISIT(self->policy);
+    Py_VISIT(self->admitted);
+    return PyJSProfile_traverse(self, visit, arg);
+}
+
+/* releases the JS heap, finalizing the proxies (and dropping their
+   references); the collector only clears a context that is garbage, along
+   with every wrapper of it */
+static int
+PyJSContext_clear(PyJSContext *self)
+{
+    JSGlobalContextRef context = self->context;
+    
+    if (context) {
+        PyJSIter_clearContext(self);
+        PyJSEventLoop_clearContext(self);
+        PyJSProfile_clearContext(self);
+        PyJSCheckpoint_clearContext(self);
+        Py_CLEAR(self->modules);
+        Py_CLEAR(self->policy);
+        Py_CLEAR(self->admitted);
+        self->context = NULL;
+        JSGlobalContextRelease(context);
+        JSGarbageCollect(context);
+    }
+    return 0;
+}
+
 static void
 PyJSContext_dealloc(PyJSContext *self)
 {
 #ifdef TRACE_MALLOC
     printf("FREE  <Context>\n");
 #endif
-    JSGlobalContextRelease(self->context);
-    JSGarbageCollect(self->context);
+    PyObject_GC_UnTrack(self);
+    PyJSContext_clear(self);
     self->ob_type->tp_free((PyObject*)self);
 }
 
@@ -438,26 +1205,101 @@ PyJSContext_getGlobalObject(PyJSContext *self)
         JSContextGetGlobalObject(self->context), NULL, self);
 }
 
+/* evaluates source, naming it url in stack traces (url may be NULL) */
+/* with lazy, a string result is returned as a JSString handle */
 static PyObject *
-PyJSContext_evaluate(PyJSContext *self, PyObject *arg)
+PyJSContext_evaluateSource(PyJSContext *self, JSStringRef source, JSStringRef url,
+                           int lazy)
 {
-    JSStringRef source;
     JSValueRef value;
-    JSValueRef exception;
+    JSValueRef exception = NULL;
     
-    source = PyString_to_JSString(arg);
-    if (!source) {
-        /* it could be a file.... */
-        return NULL;
-    }
-    value = JSEvaluateScript(self->context, source, NULL, NULL, 1, &exception);
+    value = JSEvaluateScript(self->context, source, NULL, url, 1, &exception);
     if (value) {
+        if (lazy && JSValueIsString(self->context, value)) {
+            return PyJSString_fromValue(self, value);
+        }
         return JSValue_to_PyJSObject(value, &self->dummy);
     } else {
         return JSException_to_PyErr(self, exception);
     }
 }
 
+static PyObject *
+PyJSContext_evaluate(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"source", "lazy_strings", NULL};
+    PyObject *arg;
+    int lazy = 0;
+    JSStringRef source;
+    PyObject *result;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:eval", kwlist, &arg, &lazy))
+        return NULL;
+    if (PyObject_TypeCheck(arg, &jscore_PyJSScriptType)) {
+        return PyJSContext_evaluateSource(self,
+            ((PyJSScript *)arg)->source, ((PyJSScript *)arg)->url, lazy);
+    }
+    if (PyJSString_Check(arg)) {
+        source = JSStringRetain(((PyJSString *)arg)->string);
+    } else if (!(source = PyString_to_JSString(arg))) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "eval() needs a string or a Script");
+        }
+        return NULL;
+    }
+    result = PyJSContext_evaluateSource(self, source, NULL, lazy);
+    JSStringRelease(source);
+    return result;
+}
+
+static PyObject *
+PyJSContext_evaluateFile(PyJSContext *self, PyObject *args)
+{
+    PyJSScript *script;
+    PyObject *result;
+    char *path = NULL;
+    
+    if (!PyArg_ParseTuple(args, "et:eval_file", Py_FileSystemDefaultEncoding, &path))
+        return NULL;
+    script = PyJSScript_load(path);
+    PyMem_Free(path);
+    if (!script)
+        return NULL;
+    result = PyJSContext_evaluateSource(self, script->source, script->url, 0);
+    Py_DECREF(script);
+    return result;
+}
+
+static PyObject *
+PyJSContext_cloneFrom(PyJSContext *self, PyObject *arg)
+{
+    PyJSObject *source = (PyJSObject *)arg;
+    JSValueRef value;
+    size_t bytes = 0;
+    
+    if (!PyObject_TypeCheck(arg, &jscore_PyJSObjectType)) {
+        PyErr_SetString(PyExc_TypeError, "clone_from() needs a JSObject");
+        return NULL;
+    }
+    if (!source->object) {
+        Py_INCREF(PyJSNull);
+        return (PyObject *)PyJSNull;
+    }
+    value = JSValue_clone(self, source->context, source->object, &bytes);
+    self->cloned_bytes = bytes;
+    if (!value) {
+        return NULL;
+    }
+    return JSValue_to_PyJSObject(value, &self->dummy);
+}
+
+static PyObject *
+PyJSContext_accessor(PyJSContext *self, PyObject *path)
+{
+    return PyJSAccessor_new(path);
+}
+
 static PyObject *
 PyJSContext_garbageCollect(PyJSContext *self)
 {
@@ -466,19 +1308,119 @@ PyJSContext_garbageCollect(PyJSContext *self)
 }
 
 static PyMethodDef PyJSContext_methods[] = {
-    {"eval", (PyCFunction)PyJSContext_evaluate, METH_O,
-     "Evaluate the specified string."},
+    {"eval", (PyCFunction)PyJSContext_evaluate, METH_VARARGS | METH_KEYWORDS,
+     "eval(source, lazy_strings=False): evaluate the specified string or\n"
+     "Script; with lazy_strings, a string result is returned as a JSString"},
+    {"eval_file", (PyCFunction)PyJSContext_evaluateFile, METH_VARARGS,
+     "Evaluate the script file at the specified path."},
+    {"clone_from", (PyCFunction)PyJSContext_cloneFrom, METH_O,
+     "Copy a JSObject of any context into this one, without converting it\n"
+     "to Python objects (see cloned_bytes)."},
+    {"accessor", (PyCFunction)PyJSContext_accessor, METH_O,
+     "accessor(path) -> a compiled accessor for a property path such as\n"
+     "'data.items[*].meta.id', which converts only the values at its end"},
+    {"array_from_buffer", (PyCFunction)PyJSContext_arrayFromBuffer, METH_VARARGS | METH_KEYWORDS,
+     "array_from_buffer(buf, dtype=None) -> a typed array holding the elements\n"
+     "of a buffer (array.array, bytearray, numpy array, ...), converted to\n"
+     "dtype if given"},
+    {"allow", (PyCFunction)PyJSContext_allow, METH_VARARGS | METH_KEYWORDS,
+     "allow(type, read=True, write=False, call=True, private=False): the access\n"
+     "of JS to instances of type (or a subclass) converted from now on, call and\n"
+     "write covering the methods and writable members of an exported type; in a\n"
+     "Context(STRICT_ACCESS) the types not allowed are opaque to JS"},
+    {"transform_stream", (PyCFunction)PyJSContext_transformStream, METH_VARARGS | METH_KEYWORDS,
+     "transform_stream(fn, infile, outfile, batch=256, vectorized=False) -> stats;\n"
+     "writes fn(record) as a JSON line for each JSON line of infile, unless\n"
+     "undefined. fn is a function of this context or its source; if vectorized\n"
+     "it maps an array of up to batch records to an array of results. The\n"
+     "records never become Python objects. stats holds the records read and\n"
+     "written, bytes_in, bytes_out, seconds, records_per_sec and bytes_per_sec"},
+    {"checkpoint", (PyCFunction)PyJSContext_checkpoint, METH_NOARGS,
+     "checkpoint() -> record the properties of the global object (such as\n"
+     "after running a prelude) for reset()"},
+    {"reset", (PyCFunction)PyJSContext_reset, METH_VARARGS | METH_KEYWORDS,
+     "reset(gc=False) -> number of globals restored; deletes the globals added\n"
+     "since checkpoint() and restores the ones changed, drops pending timers,\n"
+     "and with gc asks the VM to collect; objects reachable from the globals\n"
+     "are not rolled back. Top-level let, const and class declarations are\n"
+     "not properties of the global object and survive reset(), so running a\n"
+     "script declaring them again raises a SyntaxError; scripts meant to be\n"
+     "rerun should use var or function declarations"},
+    {"run_until_idle", (PyCFunction)PyJSContext_runUntilIdle, METH_VARARGS | METH_KEYWORDS,
+     "run_until_idle(deadline=None) -> True once no timers are pending, or\n"
+     "False at the deadline (a time.time() value); runs the timers of a\n"
+     "Context(timers=True), sleeping without the GIL in between"},
+    {"run_ready", (PyCFunction)PyJSContext_runReady, METH_NOARGS,
+     "run_ready() -> number of timers run; runs the timers that are due"},
+    {"next_deadline", (PyCFunction)PyJSContext_nextDeadline, METH_NOARGS,
+     "next_deadline() -> seconds until the next timer is due, or None"},
+    {"profile_stats", (PyCFunction)PyJSContext_profileStats, METH_VARARGS | METH_KEYWORDS,
+     "profile_stats(sort='total') -> list of (kind, name, target, calls, total,\n"
+     "convert) for the callbacks into Python recorded while profiling, most\n"
+     "expensive first; kind is 'call', 'get' or 'set', target the callable\n"
+     "(the function of a bound method; the type of a builtin method, with its\n"
+     "name) or the type whose attribute name was accessed, and times are in\n"
+     "seconds\n"
+     "(sort by 'total', 'calls' or 'convert')"},
+    {"profile_reset", (PyCFunction)PyJSContext_profileReset, METH_NOARGS,
+     "profile_reset() -> drop the recorded profile"},
     {"gc", (PyCFunction)PyJSContext_garbageCollect, METH_NOARGS,
      "garbage collect the context"},
+    {"collect", (PyCFunction)PyJSContext_collect, METH_NOARGS,
+     "collect() -> number of proxies released; collects the cycles between\n"
+     "Python objects and JS objects of this context that neither heap can\n"
+     "collect on its own (such as a JS callback stored in the Python object\n"
+     "it closes over); raises NotImplementedError if JavaScriptCore has no\n"
+     "WeakRef or no synchronous collection (see HAVE_SYNC_GC)"},
     {NULL},
 };
 
+static PyObject *
+PyJSContext_getIterBatch(PyJSContext *self)
+{
+    return PyInt_FromSsize_t(self->iter_batch);
+}
+
+static int
+PyJSContext_setIterBatch(PyJSContext *self, PyObject *value)
+{
+    Py_ssize_t batch;
+    
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete iter_batch");
+        return -1;
+    }
+    if ((batch = PyNumber_AsSsize_t(value, PyExc_OverflowError)) == -1 && PyErr_Occurred())
+        return -1;
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "iter_batch must be positive");
+        return -1;
+    }
+    self->iter_batch = batch;
+    return 0;
+}
+
 static PyGetSetDef PyJSContext_getsetters[] = {
     {"globalObject", (getter)PyJSContext_getGlobalObject},
+    {"iter_batch", (getter)PyJSContext_getIterBatch, (setter)PyJSContext_setIterBatch,
+     "values gathered per call when iterating across the boundary"},
+    {"timer_hook", (getter)PyJSContext_getTimerHook, (setter)PyJSContext_setTimerHook,
+     "called with the delay in seconds when JS schedules a timer that is due\n"
+     "before all the others, so an external event loop can call run_ready()"},
+    {"pending_timers", (getter)PyJSContext_getPendingTimers, NULL,
+     "number of timers waiting to run"},
+    {"profiling", (getter)PyJSContext_getProfiling, (setter)PyJSContext_setProfiling,
+     "whether the callbacks from JS into Python are profiled (see profile_stats())"},
     {NULL},
 };
 
 static PyMemberDef PyJSContext_members[] = {
+    {"flags", T_INT, offsetof(PyJSContext, flags), 0,
+     "conversion flags (INT_NUMBERS, LAZY_STRINGS, STRICT_ACCESS)"},
+    {"cloned_bytes", T_PYSSIZET, offsetof(PyJSContext, cloned_bytes), READONLY,
+     "bytes of strings, numbers and buffers copied by the last clone_from()"},
+    {"proxies", T_PYSSIZET, offsetof(PyJSContext, nproxies), READONLY,
+     "number of Python objects currently proxied in the JS heap"},
     {NULL},
 };
 
@@ -503,10 +1445,10 @@ PyTypeObject jscore_PyJSContextType = {
     0,                              /* tp_getattro */
     0,                              /* tp_setattro */
     0,                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
     "A context for JavaScript objects.", /* tp_doc */
-    0,                              /* tp_traverse */
-    0,                              /* tp_clear */
+    (traverseproc)PyJSContext_traverse, /* tp_traverse */
+    (inquiry)PyJSContext_clear,     /* tp_clear */
     0,                              /* tp_richcompare */
     0,                              /* tp_weaklistoffset */
     0,                              /* tp_iter */
@@ -542,17 +1484,34 @@ PyJSError_init(PyJSError *self, PyObject *args, PyObject *kwds)
     return 0;
 }
 
+static int
+PyJSError_traverse(PyJSError *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->context);
+    return jscore_PyJSErrorType.tp_base->tp_traverse((PyObject *)self, visit, arg);
+}
+
+static int
+PyJSError_clear(PyJSError *self)
+{
+    if (self->object && self->context->context) {
+        JSValueUnprotect(self->context->context, self->object);
+    }
+    self->object = NULL;
+    Py_CLEAR(self->context);
+    return jscore_PyJSErrorType.tp_base->tp_clear((PyObject *)self);
+}
+
 static void
 PyJSError_dealloc(PyJSError *self)
 {
 #ifdef TRACE_MALLOC
     printf("FREE  <error>\n");
 #endif
-    if (self->object) {
-        JSValueUnprotect(self->context->context, self->object);
-    }
-    Py_XDECREF(self->context);
-    self->exception.ob_type->tp_free((PyObject*)self);
+    /* the base exception's args and dict are released by its tp_clear */
+    PyObject_GC_UnTrack(self);
+    PyJSError_clear(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 PyTypeObject jscore_PyJSErrorType = {
@@ -576,10 +1535,10 @@ PyTypeObject jscore_PyJSErrorType = {
     0,                              /* tp_getattro */
     0,                              /* tp_setattro */
     0,                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
     "A wrapper for JavaScript errors.", /* tp_doc */
-    0,                              /* tp_traverse */
-    0,                              /* tp_clear */
+    (traverseproc)PyJSError_traverse, /* tp_traverse */
+    (inquiry)PyJSError_clear,       /* tp_clear */
     0,                              /* tp_richcompare */
     0,                              /* tp_weaklistoffset */
     0,                              /* tp_iter */
@@ -598,6 +1557,94 @@ PyTypeObject jscore_PyJSErrorType = {
 };
 
 
+static PyObject *
+jscore_clear_script_cache(PyObject *self)
+{
+    PyJSScript_clearCache();
+    Py_RETURN_NONE;
+}
+
+/* trims a freelist down to its limit */
+static void
+PyJSObject_trimFreelists(void)
+{
+    while (PyJSObject_freelist_stats.numfree > PyJSObject_freelist_stats.limit) {
+        PyJSObject *self = object_freelist;
+        object_freelist = (PyJSObject *)self->object;
+        PyJSObject_freelist_stats.numfree--;
+        jscore_PyJSObjectType.tp_free((PyObject *)self);
+    }
+    while (PyJSObjectIter_freelist_stats.numfree > PyJSObjectIter_freelist_stats.limit) {
+        PyJSObjectIter *self = iter_freelist;
+        iter_freelist = (PyJSObjectIter *)self->object;
+        PyJSObjectIter_freelist_stats.numfree--;
+        jscore_PyJSObjectIterType.tp_free((PyObject *)self);
+    }
+}
+
+static PyObject *
+jscore_set_alloc_limits(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"objects", "iterators", "slab_size", "spare_slabs", NULL};
+    int objects = -1, iterators = -1, slab_size = -1, spare_slabs = -1;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiii:set_alloc_limits", kwlist,
+                                     &objects, &iterators, &slab_size, &spare_slabs))
+        return NULL;
+    if (objects >= 0)
+        PyJSObject_freelist_stats.limit = objects;
+    if (iterators >= 0)
+        PyJSObjectIter_freelist_stats.limit = iterators;
+    if (slab_size > 0)
+        JSPrivateAlloc.slab_size = slab_size;
+    if (spare_slabs >= 0)
+        JSPrivateAlloc.spare_slabs = spare_slabs;
+    PyJSObject_trimFreelists();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+jscore_alloc_stats(PyObject *self)
+{
+    return Py_BuildValue("{s:{s:i,s:i,s:n,s:n},s:{s:i,s:i,s:n,s:n},"
+                         "s:{s:n,s:n,s:n,s:n,s:n,s:n}}",
+        "objects",
+            "limit", PyJSObject_freelist_stats.limit,
+            "free", PyJSObject_freelist_stats.numfree,
+            "allocs", (Py_ssize_t)PyJSObject_freelist_stats.allocs,
+            "reuses", (Py_ssize_t)PyJSObject_freelist_stats.reuses,
+        "iterators",
+            "limit", PyJSObjectIter_freelist_stats.limit,
+            "free", PyJSObjectIter_freelist_stats.numfree,
+            "allocs", (Py_ssize_t)PyJSObjectIter_freelist_stats.allocs,
+            "reuses", (Py_ssize_t)PyJSObjectIter_freelist_stats.reuses,
+        "private_data",
+            "slab_size", (Py_ssize_t)JSPrivateAlloc.slab_size,
+            "spare_slabs", (Py_ssize_t)JSPrivateAlloc.spare_slabs,
+            "allocs", (Py_ssize_t)JSPrivateAlloc.allocs,
+            "live", (Py_ssize_t)JSPrivateAlloc.live,
+            "slabs", (Py_ssize_t)JSPrivateAlloc.slabs,
+            "slab_allocs", (Py_ssize_t)JSPrivateAlloc.slab_allocs);
+}
+
+static PyMethodDef jscore_methods[] = {
+    {"set_alloc_limits", (PyCFunction)jscore_set_alloc_limits, METH_VARARGS | METH_KEYWORDS,
+     "set_alloc_limits(objects=, iterators=, slab_size=, spare_slabs=): tune the\n"
+     "JSObject and iterator freelists and the private data slab allocator"},
+    {"alloc_stats", (PyCFunction)jscore_alloc_stats, METH_NOARGS,
+     "Return the freelist and slab allocator counters."},
+    {"clear_script_cache", (PyCFunction)jscore_clear_script_cache, METH_NOARGS,
+     "Drop the sources of every cached Script; the cache is not bounded, so\n"
+     "long-running processes loading many files should call this."},
+    {"export", (PyCFunction)jscore_export, METH_VARARGS | METH_KEYWORDS,
+     "export(cls, methods=(), props=(), writable=()): give instances of cls a\n"
+     "JS class with the listed methods and properties as static members.\n"
+     "A type may instead declare them in __jsexport__, which is inherited.\n"
+     "Every writable name must also be in props. Exported types are kept\n"
+     "alive for the life of the process."},
+    {NULL},
+};
+
 PyMODINIT_FUNC
 initjscore(void)
 {
@@ -605,7 +1652,7 @@ initjscore(void)
     
     init_jsobj();
     
-    m = Py_InitModule3("jscore", NULL,
+    m = Py_InitModule3("jscore", jscore_methods,
         "PyJSCore embeds a JavaScript interpreter into Python, and allows "
         "objects to be passed between the two environments.");
     
@@ -618,10 +1665,36 @@ initjscore(void)
     if (PyType_Ready(&jscore_PyJSObjectIterType) < 0)
         return;
     
+    if (PyType_Ready(&jscore_PyJSMapIterType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_PyJSIterType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_PyJSAccessorType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_PyJSScriptType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_JSExportType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_PyJSExecutorType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_PyJSStringType) < 0)
+        return;
+    
+    if (PyType_Ready(&jscore_PyJSModuleGroupType) < 0)
+        return;
+    
     jscore_PyJSErrorType.tp_base = (PyTypeObject *)PyExc_Exception;
     if (PyType_Ready(&jscore_PyJSErrorType) < 0)
         return;
     
+    JSLengthString = JSStringCreateWithUTF8CString("length");
+    
     PyJSNull = (PyJSObject *)PyJSObject_new(NULL, NULL, NULL);
     if (PyJSNull == NULL)
         return;
@@ -630,6 +1703,18 @@ initjscore(void)
     Py_INCREF(&jscore_PyJSContextType);
     if (PyModule_AddObject(m, "Context", (PyObject *)&jscore_PyJSContextType) < 0)
         return;
+    Py_INCREF(&jscore_PyJSScriptType);
+    if (PyModule_AddObject(m, "Script", (PyObject *)&jscore_PyJSScriptType) < 0)
+        return;
+    Py_INCREF(&jscore_PyJSExecutorType);
+    if (PyModule_AddObject(m, "Executor", (PyObject *)&jscore_PyJSExecutorType) < 0)
+        return;
+    Py_INCREF(&jscore_PyJSStringType);
+    if (PyModule_AddObject(m, "JSString", (PyObject *)&jscore_PyJSStringType) < 0)
+        return;
+    Py_INCREF(&jscore_PyJSModuleGroupType);
+    if (PyModule_AddObject(m, "ModuleGroup", (PyObject *)&jscore_PyJSModuleGroupType) < 0)
+        return;
     Py_INCREF(&jscore_PyJSErrorType);
     if (PyModule_AddObject(m, "error", (PyObject *)&jscore_PyJSErrorType) < 0)
         return;
@@ -640,4 +1725,24 @@ initjscore(void)
         return;
     if (PyModule_AddObject(m, "ALLOW_MODIFY_ATTR", PyInt_FromLong(ALLOW_MODIFY_ATTR)) < 0)
         return;
+    if (PyModule_AddObject(m, "INT_NUMBERS", PyInt_FromLong(INT_NUMBERS)) < 0)
+        return;
+    if (PyModule_AddObject(m, "LAZY_STRINGS", PyInt_FromLong(LAZY_STRINGS)) < 0)
+        return;
+    if (PyModule_AddObject(m, "STRICT_ACCESS", PyInt_FromLong(STRICT_ACCESS)) < 0)
+        return;
+#ifdef HAVE_JSBIGINT
+    if (PyModule_AddObject(m, "HAVE_BIGINT", PyBool_FromLong(1)) < 0)
+        return;
+#else
+    if (PyModule_AddObject(m, "HAVE_BIGINT", PyBool_FromLong(0)) < 0)
+        return;
+#endif
+#ifdef HAVE_JSSYNCGC
+    if (PyModule_AddObject(m, "HAVE_SYNC_GC", PyBool_FromLong(1)) < 0)
+        return;
+#else
+    if (PyModule_AddObject(m, "HAVE_SYNC_GC", PyBool_FromLong(0)) < 0)
+        return;
+#endif
 }
@@ -10,19 +10,47 @@
 typedef struct PyJSContext PyJSContext;
 typedef struct PyJSObject PyJSObject;
 typedef struct PyJSObjectIter PyJSObjectIter;
+typedef struct PyJSMapIter PyJSMapIter;
 typedef struct PyJSError PyJSError;
+typedef struct JSPrivateData JSPrivateData;
+typedef struct JSEventLoop JSEventLoop;
+typedef struct JSProfile JSProfile;
 
 struct PyJSObject {
     PyObject_HEAD
     JSObjectRef         object;         /* retain */
     PyJSObject          *thisObject;    /* retain */
     PyJSContext         *context;       /* retain */
+    Py_ssize_t          weak_index;     /* in context->weak_wrappers while
+                                           collect() runs, otherwise -1 */
 };
 
+/* context flags */
+#define INT_NUMBERS         1   /* integral numbers are returned as ints */
+#define LAZY_STRINGS        2   /* strings are returned as JSString handles */
+#define STRICT_ACCESS       4   /* only the types allow()ed are accessible */
+
 struct PyJSContext {
     PyObject_HEAD
 	JSGlobalContextRef  context;
 	PyJSObject          dummy;
+	int                 flags;
+	Py_ssize_t          cloned_bytes;   /* copied by the last clone_from() */
+	Py_ssize_t          iter_batch;     /* values pulled per iteration call */
+	JSObjectRef         iter_open;      /* protect; NULL until first used */
+	JSObjectRef         iter_pull;      /* protect; NULL until first used */
+	JSObjectRef         iter_proto;     /* protect; of iterable Python proxies */
+	JSPrivateData       *proxies;       /* list of the Python proxies */
+	Py_ssize_t          nproxies;
+	PyJSObject          **weak_wrappers; /* unprotected while collect() runs */
+	Py_ssize_t          nweak;
+	JSEventLoop         *loop;          /* NULL unless created with timers */
+	int                 profiling;      /* record callbacks into profile */
+	JSProfile           *profile;       /* NULL until profiling is first on */
+	JSObjectRef         restore;        /* protect; NULL until checkpoint() */
+	PyObject            *modules;       /* retain; the ModuleGroup installed */
+	PyObject            *policy;        /* retain; {type: access} by allow() */
+	PyObject            *admitted;      /* retain; {type: access} via the MRO */
 	/* TODO: weak reference dictionary from JSObjectRef to live JSObjects */
 	/* TODO: dict from id(PyObject) to JSPyObjects 
 	        (which remove themselves from dict on finalization), in order
@@ -38,6 +66,17 @@ struct PyJSObjectIter {
     size_t                  index;
 };
 
+struct PyJSMapIter {
+    PyObject_HEAD
+    PyJSObject              *function;  /* retain */
+    PyObject                *iter;      /* retain; NULL once exhausted */
+    PyObject                *pending;   /* retain; results of the last chunk */
+    Py_ssize_t              index;      /* next result in pending */
+    Py_ssize_t              chunk_size;
+    int                     star;       /* unpack items into arguments */
+    int                     batch;      /* pass each chunk as one array */
+};
+
 struct PyJSError {
     PyBaseExceptionObject   exception;
     JSValueRef              object;         /* retain */
@@ -45,12 +84,26 @@ struct PyJSError {
 };
 
 extern PyJSObject *PyJSNull;
+extern JSStringRef JSLengthString;
 
+extern PyTypeObject jscore_PyJSContextType;
 extern PyTypeObject jscore_PyJSObjectType;
 extern PyTypeObject jscore_PyJSObjectIterType;
+extern PyTypeObject jscore_PyJSMapIterType;
 extern PyTypeObject jscore_PyJSErrorType;
 
 PyObject *PyJSObject_new(JSObjectRef object, PyJSObject *thisObject, PyJSContext *context);
 
+/* Freelist limits and counters for JSObject and JSObjectIterator */
+typedef struct PyJSFreelistStats {
+    int             limit;          /* free objects kept for reuse */
+    int             numfree;
+    size_t          allocs;         /* objects allocated from the heap */
+    size_t          reuses;         /* objects taken from the freelist */
+} PyJSFreelistStats;
+
+extern PyJSFreelistStats PyJSObject_freelist_stats;
+extern PyJSFreelistStats PyJSObjectIter_freelist_stats;
+
 #define JSALLOC(T) \
     ((T *)jscore_ ## T ## Type.tp_alloc(&jscore_ ## T ## Type, 0))
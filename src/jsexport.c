@@ -0,0 +1,508 @@
+#include "jscore.h"
+#include "jsobj.h"
+#include "jsexport.h"
+#include "conversions.h"
+#include "profiler.h"
+
+/* type -> JSExport, or None for a type whose __jsexport__ is invalid;
+   entries are never removed, so exported types live as long as the process */
+static PyObject *exports = NULL;
+static PyObject *jsexport_str = NULL;
+
+/* JSC passes a static function or value no hint of which member it is, so
+   every slot gets its own trampoline which passes on the slot index */
+#define JSEXPORT_SLOTS(X) \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+    X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) \
+    X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) \
+    X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) \
+    X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) \
+    X(48) X(49) X(50) X(51) X(52) X(53) X(54) X(55) \
+    X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63)
+
+/* returns the private data of an instance of an exported type, or NULL */
+static JSPrivateData *
+JSExport_receiver(JSContextRef ctx, JSObjectRef object)
+{
+    JSPrivateData *data;
+
+    if (!object || !JSValueIsObjectOfClass(ctx, object, JSPyClass)) {
+        return NULL;
+    }
+    data = JSObjectGetPrivate(object);
+    return data->export ? data : NULL;
+}
+
+static JSValueRef
+JSExport_call(int slot, JSContextRef ctx, JSObjectRef thisObject,
+              size_t argumentCount, const JSValueRef arguments[],
+              JSValueRef *exception)
+{
+    JSPrivateData *data = JSExport_receiver(ctx, thisObject);
+    JSExport *export;
+    PyObject *callable, *pyargs = NULL, *result = NULL;
+    JSValueRef jsresult = NULL;
+    uint64_t start, called = 0, returned = 0;
+    size_t i, first;
+
+    if (!data || slot >= data->export->nmethods) {
+        set_JSError(ctx, "method called on an incompatible object", exception);
+        return NULL;
+    }
+    if (!(data->access & ALLOW_CALL)) {
+        PyErr_Format(PyExc_TypeError, "methods of '%.200s' objects may not be called "
+                     "from this context", Py_TYPE(data->obj)->tp_name);
+        set_JSException(data->context, exception);
+        return NULL;
+    }
+    start = JSPROFILE_START(data->context);
+    export = data->export;
+    if ((callable = export->methods[slot])) {
+        /* the plain function, called with self as the first argument */
+        Py_INCREF(callable);
+        first = 1;
+    } else if (!(callable = PyObject_GetAttr(data->obj, export->method_names[slot]))) {
+        goto finally;
+    } else {
+        first = 0;
+    }
+    if (!(pyargs = PyTuple_New(argumentCount + first))) {
+        goto finally;
+    }
+    if (first) {
+        Py_INCREF(data->obj);
+        PyTuple_SET_ITEM(pyargs, 0, data->obj);
+    }
+    for (i = 0; i < argumentCount; i++) {
+        PyObject *arg = JSValue_to_PyJSObject(arguments[i], &data->context->dummy);
+        if (!arg) goto finally;
+        PyTuple_SET_ITEM(pyargs, i + first, arg);
+    }
+    if (start) called = JSProfile_now();
+    result = PyObject_Call(callable, pyargs, NULL);
+    if (start) returned = JSProfile_now();
+    if (result) {
+        jsresult = PyObject_to_JSValue(result, data->context);
+    }
+  finally:
+    Py_XDECREF(callable);
+    Py_XDECREF(pyargs);
+    Py_XDECREF(result);
+    if (!jsresult) {
+        set_JSException(data->context, exception);
+    }
+    if (returned) {
+        JSProfile_record(data->context, JSPROFILE_CALL, (PyObject *)Py_TYPE(data->obj),
+                         export->method_names[slot], start, called - start, returned);
+    }
+    return jsresult;
+}
+
+static JSValueRef
+JSExport_get(int slot, JSContextRef ctx, JSObjectRef object, JSValueRef *exception)
+{
+    JSPrivateData *data = JSExport_receiver(ctx, object);
+    JSExport *export;
+    PyObject *descr, *pyval;
+    JSValueRef result;
+    uint64_t start, fetched = 0;
+
+    if (!data || slot >= data->export->nprops) {
+        return NULL;
+    }
+    start = JSPROFILE_START(data->context);
+    export = data->export;
+    if ((descr = export->descrs[slot])) {
+        pyval = Py_TYPE(descr)->tp_descr_get(descr, data->obj, (PyObject *)Py_TYPE(data->obj));
+    } else {
+        pyval = PyObject_GetAttr(data->obj, export->prop_names[slot]);
+    }
+    if (pyval == NULL) {
+        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            PyErr_Clear();
+            return JSValueMakeUndefined(ctx);
+        }
+        set_JSException(data->context, exception);
+        return NULL;
+    }
+    if (start) fetched = JSProfile_now();
+    result = PyObject_to_JSValue(pyval, data->context);
+    Py_DECREF(pyval);
+    if (result == NULL) {
+        set_JSException(data->context, exception);
+    }
+    JSProfile_record(data->context, JSPROFILE_GET, (PyObject *)Py_TYPE(data->obj),
+                     export->prop_names[slot], start, 0, fetched);
+    return result;
+}
+
+static bool
+JSExport_set(int slot, JSContextRef ctx, JSObjectRef object, JSValueRef value,
+             JSValueRef *exception)
+{
+    JSPrivateData *data = JSExport_receiver(ctx, object);
+    JSExport *export;
+    PyObject *descr, *pyval;
+    uint64_t start, converted = 0;
+    int rv;
+
+    if (!data || slot >= data->export->nprops) {
+        return false;
+    }
+    /* ignored, like writes to the attributes of guarded proxies */
+    if (!(data->access & ALLOW_EXPORTED_SET)) {
+        return true;
+    }
+    start = JSPROFILE_START(data->context);
+    export = data->export;
+    if (!(pyval = JSValue_to_PyJSObject(value, &data->context->dummy))) {
+        set_JSException(data->context, exception);
+        return true;
+    }
+    if (start) converted = JSProfile_now();
+    if ((descr = export->descrs[slot])) {
+        rv = Py_TYPE(descr)->tp_descr_set(descr, data->obj, pyval);
+    } else {
+        rv = PyObject_SetAttr(data->obj, export->prop_names[slot], pyval);
+    }
+    Py_DECREF(pyval);
+    if (rv == -1) {
+        set_JSException(data->context, exception);
+    }
+    JSProfile_record(data->context, JSPROFILE_SET, (PyObject *)Py_TYPE(data->obj),
+                     export->prop_names[slot], start, converted - start, 0);
+    return true;
+}
+
+#define JSEXPORT_CALL(n) \
+    static JSValueRef JSExport_call ## n(JSContextRef ctx, JSObjectRef function, \
+        JSObjectRef thisObject, size_t argumentCount, const JSValueRef arguments[], \
+        JSValueRef *exception) \
+    { return JSExport_call(n, ctx, thisObject, argumentCount, arguments, exception); }
+#define JSEXPORT_GET(n) \
+    static JSValueRef JSExport_get ## n(JSContextRef ctx, JSObjectRef object, \
+        JSStringRef propertyName, JSValueRef *exception) \
+    { return JSExport_get(n, ctx, object, exception); }
+#define JSEXPORT_SET(n) \
+    static bool JSExport_set ## n(JSContextRef ctx, JSObjectRef object, \
+        JSStringRef propertyName, JSValueRef value, JSValueRef *exception) \
+    { return JSExport_set(n, ctx, object, value, exception); }
+
+JSEXPORT_SLOTS(JSEXPORT_CALL)
+JSEXPORT_SLOTS(JSEXPORT_GET)
+JSEXPORT_SLOTS(JSEXPORT_SET)
+
+#define JSEXPORT_ENTRY(prefix) JSEXPORT_ENTRY_ ## prefix
+#define JSEXPORT_ENTRY_call(n) JSExport_call ## n,
+#define JSEXPORT_ENTRY_get(n) JSExport_get ## n,
+#define JSEXPORT_ENTRY_set(n) JSExport_set ## n,
+
+static const JSObjectCallAsFunctionCallback JSExport_calls[] = {
+    JSEXPORT_SLOTS(JSEXPORT_ENTRY(call))
+};
+static const JSObjectGetPropertyCallback JSExport_getters[] = {
+    JSEXPORT_SLOTS(JSEXPORT_ENTRY(get))
+};
+static const JSObjectSetPropertyCallback JSExport_setters[] = {
+    JSEXPORT_SLOTS(JSEXPORT_ENTRY(set))
+};
+
+static void
+JSExport_dealloc(JSExport *self)
+{
+    Py_ssize_t i;
+
+    if (self->jsclass) {
+        JSClassRelease(self->jsclass);
+    }
+    for (i = 0; i < self->nmethods; i++) {
+        Py_XDECREF(self->method_names[i]);
+        Py_XDECREF(self->methods[i]);
+    }
+    for (i = 0; i < self->nprops; i++) {
+        Py_XDECREF(self->prop_names[i]);
+        Py_XDECREF(self->descrs[i]);
+    }
+    PyMem_Free(self->method_names);
+    PyMem_Free(self->methods);
+    PyMem_Free(self->prop_names);
+    PyMem_Free(self->descrs);
+    PyMem_Free(self->functions);
+    PyMem_Free(self->values);
+    Py_XDECREF(self->type);
+    PyObject_Del(self);
+}
+
+/* returns a new list of the names in seq, which must be strs */
+static PyObject *
+JSExport_names(PyObject *seq, const char *what)
+{
+    PyObject *names;
+    Py_ssize_t i;
+
+    if (!seq || seq == Py_None) {
+        return PyList_New(0);
+    }
+    if (!(names = PySequence_List(seq))) {
+        return NULL;
+    }
+    if (PyList_GET_SIZE(names) > JSEXPORT_MAX_SLOTS) {
+        PyErr_Format(PyExc_ValueError, "at most %d %s can be exported",
+            JSEXPORT_MAX_SLOTS, what);
+        Py_DECREF(names);
+        return NULL;
+    }
+    for (i = 0; i < PyList_GET_SIZE(names); i++) {
+        if (!PyString_Check(PyList_GET_ITEM(names, i))) {
+            PyErr_Format(PyExc_TypeError, "exported %s must be named by strs", what);
+            Py_DECREF(names);
+            return NULL;
+        }
+    }
+    return names;
+}
+
+/* builds the JS class exporting the given members of type */
+static JSExport *
+JSExport_create(PyTypeObject *type, PyObject *methods, PyObject *props,
+                PyObject *writable)
+{
+    JSExport *self = NULL;
+    PyObject *method_names = NULL, *prop_names = NULL, *writable_names = NULL;
+    Py_ssize_t i;
+
+    if (!(method_names = JSExport_names(methods, "methods")) ||
+        !(prop_names = JSExport_names(props, "properties")) ||
+        !(writable_names = JSExport_names(writable, "properties"))) {
+        goto err;
+    }
+    for (i = 0; i < PyList_GET_SIZE(writable_names); i++) {
+        PyObject *name = PyList_GET_ITEM(writable_names, i);
+        int rv = PySequence_Contains(prop_names, name);
+
+        if (rv < 0) {
+            goto err;
+        }
+        if (!rv) {
+            PyErr_Format(PyExc_ValueError,
+                "writable property '%.200s' is not among the exported properties",
+                PyString_AS_STRING(name));
+            goto err;
+        }
+    }
+    if (!(self = PyObject_New(JSExport, &jscore_JSExportType))) {
+        goto err;
+    }
+    Py_INCREF(type);
+    self->type = type;
+    self->jsclass = NULL;
+    self->nmethods = PyList_GET_SIZE(method_names);
+    self->nprops = PyList_GET_SIZE(prop_names);
+    self->method_names = PyMem_New(PyObject *, self->nmethods + 1);
+    self->methods = PyMem_New(PyObject *, self->nmethods + 1);
+    self->prop_names = PyMem_New(PyObject *, self->nprops + 1);
+    self->descrs = PyMem_New(PyObject *, self->nprops + 1);
+    self->functions = PyMem_New(JSStaticFunction, self->nmethods + 1);
+    self->values = PyMem_New(JSStaticValue, self->nprops + 1);
+    if (!self->method_names || !self->methods || !self->prop_names ||
+        !self->descrs || !self->functions || !self->values) {
+        self->nmethods = self->nprops = 0;
+        PyErr_NoMemory();
+        goto err;
+    }
+
+    for (i = 0; i < self->nmethods; i++) {
+        PyObject *name = PyList_GET_ITEM(method_names, i);
+        PyObject *attr = _PyType_Lookup(type, name);
+
+        Py_INCREF(name);
+        self->method_names[i] = name;
+        /* plain functions are called directly; anything else (static and
+           class methods, callable instance attributes) is bound per call */
+        self->methods[i] = attr && PyFunction_Check(attr) ? attr : NULL;
+        Py_XINCREF(self->methods[i]);
+        self->functions[i].name = PyString_AS_STRING(name);
+        self->functions[i].callAsFunction = JSExport_calls[i];
+        self->functions[i].attributes = kJSPropertyAttributeReadOnly |
+            kJSPropertyAttributeDontDelete;
+    }
+    self->functions[i].name = NULL;
+    self->functions[i].callAsFunction = NULL;
+    self->functions[i].attributes = 0;
+
+    for (i = 0; i < self->nprops; i++) {
+        PyObject *name = PyList_GET_ITEM(prop_names, i);
+        PyObject *descr = _PyType_Lookup(type, name);
+        int rv = PySequence_Contains(writable_names, name);
+
+        if (rv < 0) {
+            self->nprops = i;
+            goto err;
+        }
+        Py_INCREF(name);
+        self->prop_names[i] = name;
+        /* data descriptors (properties, slots) are called directly */
+        if (descr && Py_TYPE(descr)->tp_descr_get && Py_TYPE(descr)->tp_descr_set) {
+            Py_INCREF(descr);
+            self->descrs[i] = descr;
+        } else {
+            self->descrs[i] = NULL;
+        }
+        self->values[i].name = PyString_AS_STRING(name);
+        self->values[i].getProperty = JSExport_getters[i];
+        self->values[i].setProperty = rv ? JSExport_setters[i] : NULL;
+        self->values[i].attributes = kJSPropertyAttributeDontDelete |
+            (rv ? 0 : kJSPropertyAttributeReadOnly);
+    }
+    self->values[i].name = NULL;
+    self->values[i].getProperty = NULL;
+    self->values[i].setProperty = NULL;
+    self->values[i].attributes = 0;
+
+    {
+        JSClassDefinition classDef = kJSClassDefinitionEmpty;
+        /* without a shared prototype the static members are own properties,
+           found before the dynamic lookup of the parent class */
+        classDef.attributes = kJSClassAttributeNoAutomaticPrototype;
+        classDef.className = type->tp_name;
+        classDef.parentClass = JSPyGuardedClass;
+        classDef.staticValues = self->values;
+        classDef.staticFunctions = self->functions;
+        self->jsclass = JSClassCreate(&classDef);
+    }
+    goto finally;
+  err:
+    Py_CLEAR(self);
+  finally:
+    Py_XDECREF(method_names);
+    Py_XDECREF(prop_names);
+    Py_XDECREF(writable_names);
+    return self;
+}
+
+/* builds the export declared by a __jsexport__ attribute: either a dict with
+   "methods", "props" and "writable" entries, or a sequence of names, where
+   methods are told from properties by the class attributes they name */
+static JSExport *
+JSExport_fromDeclaration(PyTypeObject *type, PyObject *decl)
+{
+    JSExport *self = NULL;
+    PyObject *names = NULL, *methods = NULL, *props = NULL;
+    Py_ssize_t i;
+
+    if (PyDict_Check(decl)) {
+        return JSExport_create(type,
+            PyDict_GetItemString(decl, "methods"),
+            PyDict_GetItemString(decl, "props"),
+            PyDict_GetItemString(decl, "writable"));
+    }
+    if (!(names = PySequence_Fast(decl, "__jsexport__ must be a dict or a sequence of names")) ||
+        !(methods = PyList_New(0)) ||
+        !(props = PyList_New(0))) {
+        goto finally;
+    }
+    for (i = 0; i < PySequence_Fast_GET_SIZE(names); i++) {
+        PyObject *name = PySequence_Fast_GET_ITEM(names, i);
+        PyObject *attr = PyString_Check(name) ? _PyType_Lookup(type, name) : NULL;
+        int is_method = attr && PyCallable_Check(attr) &&
+            !Py_TYPE(attr)->tp_descr_set;
+        if (PyList_Append(is_method ? methods : props, name) < 0) {
+            goto finally;
+        }
+    }
+    self = JSExport_create(type, methods, props, NULL);
+  finally:
+    Py_XDECREF(names);
+    Py_XDECREF(methods);
+    Py_XDECREF(props);
+    return self;
+}
+
+static int
+JSExport_register(PyTypeObject *type, PyObject *export)
+{
+    if (!exports && !(exports = PyDict_New())) {
+        return -1;
+    }
+    return PyDict_SetItem(exports, (PyObject *)type, export);
+}
+
+int
+JSExport_lookup(PyObject *obj, JSExport **export)
+{
+    PyTypeObject *type = Py_TYPE(obj);
+    PyObject *entry, *decl;
+
+    *export = NULL;
+    if (exports && (entry = PyDict_GetItem(exports, (PyObject *)type))) {
+        if (entry != Py_None) {
+            *export = (JSExport *)entry;
+        }
+        return 0;
+    }
+    if (!jsexport_str && !(jsexport_str = PyString_InternFromString("__jsexport__"))) {
+        return -1;
+    }
+    if (!(decl = _PyType_Lookup(type, jsexport_str))) {
+        return 0;
+    }
+    if (!(entry = (PyObject *)JSExport_fromDeclaration(type, decl))) {
+        /* the error is reported once; after that, the type falls back to
+           dynamic lookup */
+        JSExport_register(type, Py_None);
+        return -1;
+    }
+    if (JSExport_register(type, entry) < 0) {
+        Py_DECREF(entry);
+        return -1;
+    }
+    *export = (JSExport *)entry;
+    Py_DECREF(entry);
+    return 0;
+}
+
+PyObject *
+jscore_export(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"cls", "methods", "props", "writable", NULL};
+    PyObject *type, *methods = NULL, *props = NULL, *writable = NULL;
+    JSExport *export;
+    int rv;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|OOO:export", kwlist,
+                                     &PyType_Type, &type, &methods, &props, &writable))
+        return NULL;
+    if (!(export = JSExport_create((PyTypeObject *)type, methods, props, writable)))
+        return NULL;
+    rv = JSExport_register((PyTypeObject *)type, (PyObject *)export);
+    Py_DECREF(export);
+    if (rv < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyTypeObject jscore_JSExportType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.Export",              /* tp_name */
+    sizeof(JSExport),               /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)JSExport_dealloc,   /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "The JS class of an exported type.", /* tp_doc */
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+#include "jsobj.h"
+
+/* methods and properties per exported type */
+#define JSEXPORT_MAX_SLOTS  64
+
+/* The JS class of an exported Python type: the exported members are static
+   functions and values of the class, dispatched by slot index; every other
+   member is still reached through the dynamic callbacks of JSPyGuardedClass */
+struct JSExport {
+    PyObject_HEAD
+    PyTypeObject        *type;          /* retain */
+    JSClassRef          jsclass;        /* retain */
+    Py_ssize_t          nmethods;
+    PyObject            **method_names; /* retain */
+    PyObject            **methods;      /* retain; NULL to call a bound method */
+    Py_ssize_t          nprops;
+    PyObject            **prop_names;   /* retain */
+    PyObject            **descrs;       /* retain; NULL to use getattr/setattr */
+    JSStaticFunction    *functions;
+    JSStaticValue       *values;
+};
+
+extern PyTypeObject jscore_JSExportType;
+
+/* sets *export to the export of the type of obj (borrowed), or NULL if the
+   type is neither exported nor declares __jsexport__;
+   if an error occurs, sets a Python exception and returns -1 */
+int JSExport_lookup(PyObject *obj, JSExport **export);
+
+/* jscore.export(cls, methods=(), props=(), writable=()) */
+PyObject *jscore_export(PyObject *self, PyObject *args, PyObject *kwds);
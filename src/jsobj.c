@@ -1,70 +1,253 @@
 #include "jscore.h"
 #include "jsobj.h"
 #include "conversions.h"
+#include "jsexport.h"
+#include "iterator.h"
+#include "profiler.h"
+#include "policy.h"
+
+typedef struct JSPrivateSlab JSPrivateSlab;
+
+typedef struct JSPrivateBlock {
+    JSPrivateSlab               *slab;
+    union {
+        JSPrivateData           data;
+        JSPyErrPrivateData      errdata;
+        struct JSPrivateBlock   *next;      /* while free */
+    } u;
+} JSPrivateBlock;
+
+struct JSPrivateSlab {
+    JSPrivateSlab       *prev;      /* in the list of slabs with free blocks */
+    JSPrivateSlab       *next;
+    JSPrivateBlock      *free;
+    size_t              used;
+    size_t              capacity;
+    JSPrivateBlock      blocks[1];
+};
+
+JSPrivateAllocator JSPrivateAlloc = {
+    256,    /* slab_size */
+    1,      /* spare_slabs */
+};
+
+/* slabs with at least one free block; allocation takes from the head */
+static JSPrivateSlab *partial_slabs = NULL;
+static size_t empty_slabs = 0;
+
+static void
+JSPrivateSlab_unlink(JSPrivateSlab *slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else partial_slabs = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+static void
+JSPrivateSlab_link(JSPrivateSlab *slab)
+{
+    slab->prev = NULL;
+    slab->next = partial_slabs;
+    if (partial_slabs) partial_slabs->prev = slab;
+    partial_slabs = slab;
+}
+
+/* returns a block large enough for any private data struct, or NULL */
+static void *
+JSPrivate_alloc(void)
+{
+    JSPrivateSlab *slab = partial_slabs;
+    JSPrivateBlock *block;
+    
+    if (!slab) {
+        size_t i, capacity = JSPrivateAlloc.slab_size ? JSPrivateAlloc.slab_size : 1;
+        slab = malloc(sizeof(JSPrivateSlab) + (capacity - 1) * sizeof(JSPrivateBlock));
+        if (!slab) return NULL;
+        slab->capacity = capacity;
+        slab->used = 0;
+        slab->free = NULL;
+        for (i = capacity; i > 0; i--) {
+            slab->blocks[i - 1].slab = slab;
+            slab->blocks[i - 1].u.next = slab->free;
+            slab->free = &slab->blocks[i - 1];
+        }
+        JSPrivateSlab_link(slab);
+        JSPrivateAlloc.slabs++;
+        JSPrivateAlloc.slab_allocs++;
+        empty_slabs++;
+    }
+    block = slab->free;
+    slab->free = block->u.next;
+    if (slab->used++ == 0) {
+        empty_slabs--;
+    }
+    if (!slab->free) {
+        JSPrivateSlab_unlink(slab);
+    }
+    JSPrivateAlloc.allocs++;
+    JSPrivateAlloc.live++;
+    return &block->u;
+}
+
+static void
+JSPrivate_free(void *ptr)
+{
+    JSPrivateBlock *block = (JSPrivateBlock *)((char *)ptr - offsetof(JSPrivateBlock, u));
+    JSPrivateSlab *slab = block->slab;
+    
+    if (!slab->free) {
+        JSPrivateSlab_link(slab);
+    }
+    block->u.next = slab->free;
+    slab->free = block;
+    JSPrivateAlloc.live--;
+    if (--slab->used == 0) {
+        if (empty_slabs >= JSPrivateAlloc.spare_slabs) {
+            JSPrivateSlab_unlink(slab);
+            free(slab);
+            JSPrivateAlloc.slabs--;
+        } else {
+            empty_slabs++;
+        }
+    }
+}
+
+/* lists the proxy in its context */
+static void
+JSPrivateData_link(JSPrivateData *data, JSObjectRef object)
+{
+    PyJSContext *context = data->context;
+    
+    data->object = object;
+    data->prev = NULL;
+    data->next = context->proxies;
+    if (context->proxies) context->proxies->prev = data;
+    context->proxies = data;
+    context->nproxies++;
+}
+
+static void
+JSPrivateData_unlink(JSPrivateData *data)
+{
+    PyJSContext *context = data->context;
+    
+    if (data->prev) data->prev->next = data->next;
+    else context->proxies = data->next;
+    if (data->next) data->next->prev = data->prev;
+    context->nproxies--;
+}
 
 JSObjectRef
 PyJS_new(PyJSContext *context, PyObject *pyobj)
 {
-    JSPrivateData *data = malloc(sizeof(JSPrivateData));
+    JSPrivateData *data;
+    JSExport *export;
+    JSObjectRef object;
+    JSClassRef jsclass;
+    int access;
+    
+    if (JSExport_lookup(pyobj, &export) < 0) {
+        return NULL;
+    }
+    /* the policy is applied once, by picking the class of the proxy; the
+       members of an exported type are reachable unless it may not be read */
+    access = PyJSPolicy_access(context, pyobj);
+    if (export && (access & ALLOW_READ_ATTR)) {
+        jsclass = export->jsclass;
+    } else {
+        jsclass = (access & ALLOW_ALL) == ALLOW_ALL ? JSPyObjectClass : JSPyGuardedClass;
+    }
+    if (!(data = JSPrivate_alloc())) {
+        PyErr_NoMemory();
+        return NULL;
+    }
     Py_INCREF(pyobj);
     data->obj = pyobj;
     Py_INCREF(context);
     data->context = context;
-    return JSObjectMake(context->context, JSPyClass, data);
+    Py_XINCREF(export);
+    data->export = export;
+    data->access = access;
+    object = JSObjectMake(context->context, jsclass, data);
+    JSPrivateData_link(data, object);
+    /* on failure the object is left to the collector, whose finalizer
+       releases the data */
+    if ((access & ALLOW_READ_ATTR) && PyJSIterable_setPrototype(context, object, pyobj) < 0) {
+        return NULL;
+    }
+    return object;
 }
 
 static void
 PyJS_finalize(JSObjectRef object)
 {
     JSPrivateData *data = JSObjectGetPrivate(object);
+    JSPrivateData_unlink(data);
     Py_DECREF(data->obj);
     Py_DECREF(data->context);
-    free(data);
+    Py_XDECREF(data->export);
+    JSPrivate_free(data);
 }
 
 JSObjectRef
 PyJSPyErr_new(PyJSContext *context, PyObject *val, PyObject *type, PyObject *tb)
 {
-    JSPyErrPrivateData *data = malloc(sizeof(JSPyErrPrivateData));
-    data->context = context;
-    data->exc_value = val;
+    JSPyErrPrivateData *data = JSPrivate_alloc();
+    JSObjectRef object;
+    
+    if (!data) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    data->base.context = context;
+    data->base.obj = val;
+    data->base.export = NULL;
+    data->base.access = PyJSPolicy_access(context, val);
     data->exc_type = type;
     data->exc_tb = tb;
-    Py_INCREF(data->context);
-    Py_INCREF(data->exc_value);
+    Py_INCREF(data->base.context);
+    Py_INCREF(data->base.obj);
     Py_INCREF(data->exc_type);
-    Py_INCREF(data->exc_tb);
-    return JSObjectMake(context->context, JSPyErrClass, data);
+    Py_XINCREF(data->exc_tb);
+    object = JSObjectMake(context->context, JSPyErrClass, data);
+    JSPrivateData_link(&data->base, object);
+    return object;
 }
 
 static void
 PyJSPyErr_finalize(JSObjectRef object)
 {
     JSPyErrPrivateData *data = JSObjectGetPrivate(object);
-    /* data->exc_value is freed by superclass finalizer (as .obj) */
+    /* data->base is freed by the superclass finalizer */
     Py_DECREF(data->exc_type);
-    Py_DECREF(data->exc_tb);
+    Py_XDECREF(data->exc_tb);
 }
 
-static long
-PyJS_GetFlags(PyObject *object)
+/* converts the arguments of a call into a new tuple;
+   if an error occurs, sets a JS exception and returns NULL */
+static PyObject *
+JSArguments_to_PyTuple(PyJSContext *context, size_t argumentCount,
+                       const JSValueRef arguments[], JSValueRef *exception)
 {
-    PyObject *flagsobj = NULL;
-    long flags;
+    PyObject *pyargs = NULL;
+    size_t i;
     
-    if (!(flagsobj = PyObject_GetAttrString(object, "__jsflags__"))) {
-        goto err;
+    pyargs = PyTuple_New(argumentCount);
+    if (!pyargs) {
+        set_JSException(context, exception);
+        return NULL;
     }
-    if ((flags = PyInt_AsLong(flagsobj)) == -1) {
-        goto err;
+    for (i = 0; i < argumentCount; i++) {
+        PyObject *arg = JSValue_to_PyJSObject(arguments[i], &context->dummy);
+        if (arg == NULL) {
+            Py_DECREF(pyargs);
+            set_JSException(context, exception);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pyargs, i, arg);
     }
-    goto finally;
-  err:
-    PyErr_Clear();
-    flags = 0;
-  finally:
-    Py_XDECREF(flagsobj);
-    return flags;
+    return pyargs;
 }
 
 static JSValueRef
@@ -74,31 +257,102 @@ CallAsFunction(JSContextRef ctx, JSObjectRef object, JSObjectRef thisObject,
 {
     JSPrivateData *data = JSObjectGetPrivate(object);
     PyObject *pyargs = NULL, *result = NULL;
-    JSValueRef jsresult;
-    int i;
+    JSValueRef jsresult = NULL;
+    uint64_t start = JSPROFILE_START(data->context), called = 0, returned = 0;
     
-    pyargs = PyTuple_New(argumentCount);
+    pyargs = JSArguments_to_PyTuple(data->context, argumentCount, arguments, exception);
     if (!pyargs) return NULL;
-    for (i = 0; i < argumentCount; i++) {
-        PyObject *arg = JSValue_to_PyJSObject(arguments[i], &data->context->dummy);
-        if (arg == NULL) {
-            Py_DECREF(pyargs);
+    if (start) called = JSProfile_now();
+    result = PyObject_CallObject(data->obj, pyargs);
+    if (start) returned = JSProfile_now();
+    Py_DECREF(pyargs);
+    if (result == NULL) {
+        set_JSException(data->context, exception);
+    } else {
+        jsresult = PyObject_to_JSValue(result, data->context);
+        Py_DECREF(result);
+        if (jsresult == NULL) {
             set_JSException(data->context, exception);
-            return NULL;
         }
-        PyTuple_SetItem(pyargs, i, arg);
     }
+    JSProfile_record(data->context, JSPROFILE_CALL, data->obj, NULL,
+                     start, called - start, returned);
+    return jsresult;
+}
+
+/* `new` on a proxied type (or factory) calls it, and wraps the result once */
+static JSObjectRef
+CallAsConstructor(JSContextRef ctx, JSObjectRef constructor,
+                  size_t argumentCount, const JSValueRef arguments[],
+                  JSValueRef *exception)
+{
+    JSPrivateData *data = JSObjectGetPrivate(constructor);
+    PyObject *pyargs = NULL, *result = NULL;
+    JSObjectRef jsresult;
+    
+    if (!PyCallable_Check(data->obj)) {
+        PyErr_Format(PyExc_TypeError, "'%.200s' object is not a constructor",
+            Py_TYPE(data->obj)->tp_name);
+        set_JSException(data->context, exception);
+        return NULL;
+    }
+    pyargs = JSArguments_to_PyTuple(data->context, argumentCount, arguments, exception);
+    if (!pyargs) return NULL;
     result = PyObject_CallObject(data->obj, pyargs);
     Py_DECREF(pyargs);
     if (result == NULL) {
         set_JSException(data->context, exception);
         return NULL;
     }
-    jsresult = PyObject_to_JSValue(result, data->context);
+    if (PyObject_TypeCheck(result, &jscore_PyJSObjectType) &&
+        ((PyJSObject *)result)->object &&
+        ((PyJSObject *)result)->context == data->context) {
+        /* a factory returning a JS object */
+        jsresult = ((PyJSObject *)result)->object;
+    } else if (!(jsresult = PyJS_new(data->context, result))) {
+        set_JSException(data->context, exception);
+    }
     Py_DECREF(result);
     return jsresult;
 }
 
+/* `instanceof` on a proxied type tests the proxied Python object */
+static bool
+HasInstance(JSContextRef ctx, JSObjectRef constructor,
+            JSValueRef possibleInstance, JSValueRef *exception)
+{
+    JSPrivateData *data = JSObjectGetPrivate(constructor);
+    JSPrivateData *instance;
+    int rv;
+    
+    if (!JSValueIsObjectOfClass(ctx, possibleInstance, JSPyClass)) {
+        return false;
+    }
+    instance = JSObjectGetPrivate(JSValueToObject(ctx, possibleInstance, NULL));
+    rv = PyObject_IsInstance(instance->obj, data->obj);
+    if (rv < 0) {
+        set_JSException(data->context, exception);
+        return false;
+    }
+    return rv;
+}
+
+/* whether the property name starts with an underscore */
+static int
+JSString_IsPrivate(JSStringRef propertyName)
+{
+    return JSStringGetLength(propertyName) > 0 &&
+        JSStringGetCharactersPtr(propertyName)[0] == '_';
+}
+
+/* whether key names an attribute of the type (such as a method) of a dict,
+   which is reachable alongside the items; does not raise */
+static int
+PyDict_HasTypeAttr(PyObject *dict, PyObject *key)
+{
+    return PyString_Check(key) && _PyType_Lookup(Py_TYPE(dict), key) != NULL;
+}
+
 static bool
 HasProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName)
 {
@@ -106,16 +360,23 @@ HasProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName)
     PyObject *pyprop = NULL;
     int result;
     
-    if (JSStringGetCharactersPtr(propertyName)[0] == '_' &&
-        !(PyJS_GetFlags(data->obj) & ALLOW_PRIVATE_ATTR)) {
-        return NULL;
-    }
-    pyprop = JSString_to_PyString(propertyName);
+    pyprop = JSString_to_PyKey(propertyName);
     if (pyprop == NULL) {
         PyErr_PrintEx(1);
-        return 0;
+        return false;
+    }
+    if (PyDict_Check(data->obj)) {
+        result = PyDict_CheckExact(data->obj) ? PyDict_Contains(data->obj, pyprop) :
+            PySequence_Contains(data->obj, pyprop);
+        if (result == 0) {
+            result = PyDict_HasTypeAttr(data->obj, pyprop);
+        } else if (result < 0) {
+            PyErr_Clear();
+            result = 0;
+        }
+    } else {
+        result = PyObject_HasAttr(data->obj, pyprop);
     }
-    result = PyObject_HasAttr(data->obj, pyprop);
     Py_DECREF(pyprop);
     return result;
 }
@@ -126,29 +387,62 @@ GetProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName, JSVa
     JSPrivateData *data = JSObjectGetPrivate(object);
     PyObject *pyprop = NULL, *pyval = NULL;
     JSValueRef result;
+    uint64_t start = JSPROFILE_START(data->context), fetched = 0;
     
-    if (JSStringGetCharactersPtr(propertyName)[0] == '_' &&
-        !(PyJS_GetFlags(data->obj) & ALLOW_PRIVATE_ATTR)) {
-        return NULL;
-    }
-    pyprop = JSString_to_PyString(propertyName);
+
+    pyprop = JSString_to_PyKey(propertyName);
     if (pyprop == NULL) {
         set_JSException(data->context, exception);
         return NULL;
     }
+    if (PyDict_CheckExact(data->obj)) {
+        /* items first, without raising for missing keys */
+        if ((pyval = PyDict_GetItem(data->obj, pyprop))) {
+            Py_INCREF(pyval);
+            goto convert;
+        }
+        if (!PyDict_HasTypeAttr(data->obj, pyprop)) {
+            result = JSValueMakeUndefined(ctx);
+            goto finally;
+        }
+    } else if (PyDict_Check(data->obj)) {
+        /* subclasses may define __getitem__ or __missing__ */
+        if ((pyval = PyObject_GetItem(data->obj, pyprop))) {
+            goto convert;
+        }
+        if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+            set_JSException(data->context, exception);
+            result = NULL;
+            goto finally;
+        }
+        PyErr_Clear();
+        if (!PyDict_HasTypeAttr(data->obj, pyprop)) {
+            result = JSValueMakeUndefined(ctx);
+            goto finally;
+        }
+    }
     pyval = PyObject_GetAttr(data->obj, pyprop);
-    Py_DECREF(pyprop);
     if (pyval == NULL) {
         if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
             PyErr_Clear();
-            return JSValueMakeUndefined(ctx);
+            result = JSValueMakeUndefined(ctx);
         } else {
             set_JSException(data->context, exception);
-            return NULL;
+            result = NULL;
         }
+        goto finally;
     }
+  convert:
+    if (start) fetched = JSProfile_now();
     result = PyObject_to_JSValue(pyval, data->context);
     Py_DECREF(pyval);
+    if (result == NULL) {
+        set_JSException(data->context, exception);
+    }
+  finally:
+    JSProfile_record(data->context, JSPROFILE_GET, JSPROFILE_TARGET(data->obj), pyprop,
+                     start, 0, fetched);
+    Py_DECREF(pyprop);
     return result;
 }
 
@@ -158,29 +452,29 @@ SetProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName, JSVa
 {
     JSPrivateData *data = JSObjectGetPrivate(object);
     PyObject *pyprop = NULL, *pyval = NULL;
-    long flags = PyJS_GetFlags(data->obj);
+    uint64_t start, converted = 0;
     int rv;
     
-    if (!(flags & ALLOW_MODIFY_ATTR)) {
-        return true;
-    }
-    if (JSStringGetCharactersPtr(propertyName)[0] == '_' &&
-        !(flags & ALLOW_PRIVATE_ATTR)) {
-        return true;
-    }
-    pyprop = JSString_to_PyString(propertyName);
+    pyprop = JSString_to_PyKey(propertyName);
     if (pyprop == NULL) {
         set_JSException(data->context, exception);
         return true;
     }
+    start = JSPROFILE_START(data->context);
     pyval = JSValue_to_PyJSObject(value, &data->context->dummy);
     if (pyval == NULL) {
         Py_DECREF(pyprop);
         set_JSException(data->context, exception);
         return true;
     }
-    rv = PyObject_SetAttr(data->obj, pyprop, pyval);
-    Py_DECREF(pyprop);
+    if (start) converted = JSProfile_now();
+    if (PyDict_CheckExact(data->obj)) {
+        rv = PyDict_SetItem(data->obj, pyprop, pyval);
+    } else if (PyDict_Check(data->obj)) {
+        rv = PyObject_SetItem(data->obj, pyprop, pyval);
+    } else {
+        rv = PyObject_SetAttr(data->obj, pyprop, pyval);
+    }
     Py_DECREF(pyval);
     if (rv == -1) {
         if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
@@ -189,6 +483,9 @@ SetProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName, JSVa
             set_JSException(data->context, exception);
         }
     }
+    JSProfile_record(data->context, JSPROFILE_SET, JSPROFILE_TARGET(data->obj), pyprop,
+                     start, converted - start, 0);
+    Py_DECREF(pyprop);
     return true;
 }
 
@@ -198,25 +495,24 @@ DeleteProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName, J
 {
     JSPrivateData *data = JSObjectGetPrivate(object);
     PyObject *pyprop = NULL;
-    long flags = PyJS_GetFlags(data->obj);
     int rv;
     
-    if (!(flags & ALLOW_MODIFY_ATTR)) {
-        return true;
-    }
-    if (JSStringGetCharactersPtr(propertyName)[0] == '_' &&
-        !(flags & ALLOW_PRIVATE_ATTR)) {
-        return true;
-    }
-    pyprop = JSString_to_PyString(propertyName);
+    pyprop = JSString_to_PyKey(propertyName);
     if (pyprop == NULL) {
         set_JSException(data->context, exception);
         return true;
     }
-    rv = PyObject_DelAttr(data->obj, pyprop);
+    if (PyDict_CheckExact(data->obj)) {
+        rv = PyDict_DelItem(data->obj, pyprop);
+    } else if (PyDict_Check(data->obj)) {
+        rv = PyObject_DelItem(data->obj, pyprop);
+    } else {
+        rv = PyObject_DelAttr(data->obj, pyprop);
+    }
     Py_DECREF(pyprop);
     if (rv == -1) {
-        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        if (PyErr_ExceptionMatches(PyExc_AttributeError) ||
+            PyErr_ExceptionMatches(PyExc_KeyError)) {
             PyErr_Clear();
         } else {
             set_JSException(data->context, exception);
@@ -226,6 +522,91 @@ DeleteProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName, J
 }
 
 
+
+/* JSPyGuardedClass: the callbacks of JSPyObjectClass behind the access the
+   proxy was admitted with */
+
+static int
+JSAccess_allows(JSPrivateData *data, JSStringRef propertyName, int access)
+{
+    return (data->access & access) == access &&
+        ((data->access & ALLOW_PRIVATE_ATTR) || !JSString_IsPrivate(propertyName));
+}
+
+/* sets a TypeError as a JS exception for a proxy which may not be called */
+static void
+JSAccess_denyCall(JSPrivateData *data, JSValueRef *exception)
+{
+    PyErr_Format(PyExc_TypeError, "'%.200s' objects may not be called from this context",
+                 Py_TYPE(data->obj)->tp_name);
+    set_JSException(data->context, exception);
+}
+
+static bool
+GuardedHasProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName)
+{
+    return JSAccess_allows(JSObjectGetPrivate(object), propertyName, ALLOW_READ_ATTR) &&
+        HasProperty(ctx, object, propertyName);
+}
+
+static JSValueRef
+GuardedGetProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName,
+                   JSValueRef *exception)
+{
+    if (!JSAccess_allows(JSObjectGetPrivate(object), propertyName, ALLOW_READ_ATTR)) {
+        return NULL;
+    }
+    return GetProperty(ctx, object, propertyName, exception);
+}
+
+static bool
+GuardedSetProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName,
+                   JSValueRef value, JSValueRef *exception)
+{
+    if (!JSAccess_allows(JSObjectGetPrivate(object), propertyName, ALLOW_MODIFY_ATTR)) {
+        return true;
+    }
+    return SetProperty(ctx, object, propertyName, value, exception);
+}
+
+static bool
+GuardedDeleteProperty(JSContextRef ctx, JSObjectRef object, JSStringRef propertyName,
+                      JSValueRef *exception)
+{
+    if (!JSAccess_allows(JSObjectGetPrivate(object), propertyName, ALLOW_MODIFY_ATTR)) {
+        return true;
+    }
+    return DeleteProperty(ctx, object, propertyName, exception);
+}
+
+static JSValueRef
+GuardedCallAsFunction(JSContextRef ctx, JSObjectRef object, JSObjectRef thisObject,
+                      size_t argumentCount, const JSValueRef arguments[],
+                      JSValueRef *exception)
+{
+    JSPrivateData *data = JSObjectGetPrivate(object);
+    
+    if (!(data->access & ALLOW_CALL)) {
+        JSAccess_denyCall(data, exception);
+        return NULL;
+    }
+    return CallAsFunction(ctx, object, thisObject, argumentCount, arguments, exception);
+}
+
+static JSObjectRef
+GuardedCallAsConstructor(JSContextRef ctx, JSObjectRef constructor,
+                         size_t argumentCount, const JSValueRef arguments[],
+                         JSValueRef *exception)
+{
+    JSPrivateData *data = JSObjectGetPrivate(constructor);
+    
+    if (!(data->access & ALLOW_CALL)) {
+        JSAccess_denyCall(data, exception);
+        return NULL;
+    }
+    return CallAsConstructor(ctx, constructor, argumentCount, arguments, exception);
+}
+
 void
 init_jsobj(void)
 {
@@ -238,24 +619,68 @@ init_jsobj(void)
         NULL,                           /* staticFunctions */
         NULL, /* TODO implement*/       /* initialize */
         PyJS_finalize,                  /* finalize */
+        NULL,                           /* hasProperty */
+        NULL,                           /* getProperty */
+        NULL,                           /* setProperty */
+        NULL,                           /* deleteProperty */
+        NULL, /* TODO implement*/       /* getPropertyNames */
+        NULL,                           /* callAsFunction */
+        NULL,                           /* callAsConstructor */
+        HasInstance,                    /* hasInstance */
+        NULL, /* TODO implement*/       /* convertToType */
+    };
+
+    JSPyClass = JSClassCreate(&JSPyClassDef);
+    
+    JSClassDefinition JSPyObjectClassDef = {
+        0,                              /* version */
+        kJSClassAttributeNone,          /* attributes */
+        "PythonObject",                 /* className */
+        JSPyClass,                      /* parentClass */
+        NULL,                           /* staticValues */
+        NULL,                           /* staticFunctions */
+        NULL,                           /* initialize */
+        NULL,                           /* finalize */
         HasProperty,                    /* hasProperty */
         GetProperty,                    /* getProperty */
         SetProperty,                    /* setProperty */
         DeleteProperty,                 /* deleteProperty */
-        NULL, /* TODO implement*/       /* getPropertyNames */
+        NULL,                           /* getPropertyNames */
         CallAsFunction,                 /* callAsFunction */
+        CallAsConstructor,              /* callAsConstructor */
         NULL,                           /* hasInstance */
-        NULL, /* TODO implement*/       /* callAsConstructor */
-        NULL, /* TODO implement*/       /* convertToType */
+        NULL,                           /* convertToType */
     };
-
-    JSPyClass = JSClassCreate(&JSPyClassDef);
+    
+    JSPyObjectClass = JSClassCreate(&JSPyObjectClassDef);
+    
+    JSClassDefinition JSPyGuardedClassDef = {
+        0,                              /* version */
+        kJSClassAttributeNone,          /* attributes */
+        "PythonObject",                 /* className */
+        JSPyClass,                      /* parentClass */
+        NULL,                           /* staticValues */
+        NULL,                           /* staticFunctions */
+        NULL,                           /* initialize */
+        NULL,                           /* finalize */
+        GuardedHasProperty,             /* hasProperty */
+        GuardedGetProperty,             /* getProperty */
+        GuardedSetProperty,             /* setProperty */
+        GuardedDeleteProperty,          /* deleteProperty */
+        NULL,                           /* getPropertyNames */
+        GuardedCallAsFunction,          /* callAsFunction */
+        GuardedCallAsConstructor,       /* callAsConstructor */
+        NULL,                           /* hasInstance */
+        NULL,                           /* convertToType */
+    };
+    
+    JSPyGuardedClass = JSClassCreate(&JSPyGuardedClassDef);
     
     JSClassDefinition JSPyErrClassDef = {
         0,                              /* version */
         kJSClassAttributeNone,          /* attributes */
         "PythonException",              /* className */
-        JSPyClass,                      /* parentClass */
+        JSPyGuardedClass,               /* parentClass */
         NULL,                           /* staticValues */
         NULL,                           /* staticFunctions */
         NULL,                           /* initialize */
@@ -275,5 +700,6 @@ init_jsobj(void)
 }
 
 JSClassRef JSPyClass = NULL;
+JSClassRef JSPyObjectClass = NULL;
+JSClassRef JSPyGuardedClass = NULL;
 JSClassRef JSPyErrClass = NULL;
-
@@ -7,24 +7,58 @@
 #include <JavaScriptCore/JavaScript.h>
 #endif
 
+/* access of a proxy (see policy.h) */
 #define ALLOW_PRIVATE_ATTR  1
 #define ALLOW_MODIFY_ATTR   2
+#define ALLOW_READ_ATTR     4
+#define ALLOW_CALL          8
+#define ALLOW_ALL           15
+/* the members jscore.export() declared writable; granted unless allow()
+   denies writes */
+#define ALLOW_EXPORTED_SET  16
 
+/* every proxy is of JSPyClass: of JSPyObjectClass with full access, whose
+   callbacks do no checks, or else of JSPyGuardedClass (or a subclass),
+   whose callbacks check the access of the proxy */
 extern JSClassRef JSPyClass;
+extern JSClassRef JSPyObjectClass;
+extern JSClassRef JSPyGuardedClass;
 extern JSClassRef JSPyErrClass;
 
-typedef struct JSPrivateData {
+typedef struct JSExport JSExport;
+
+/* Every proxy is listed in its context, so the context can report the
+   Python objects held by the JS heap to the cycle collector */
+struct JSPrivateData {
     PyJSContext     *context;
     PyObject        *obj;
-} JSPrivateData;
+    JSExport        *export;    /* retain; NULL unless the type is exported */
+    int             access;     /* ALLOW_* bits, fixed when the proxy is made */
+    JSObjectRef     object;     /* the proxy itself (not protected) */
+    JSPrivateData   *prev;      /* in context->proxies */
+    JSPrivateData   *next;
+};
 
+/* the exception value is base.obj */
 typedef struct JSPyErrPrivateData {
-    PyJSContext     *context;
-    PyObject        *exc_value;
+    JSPrivateData   base;
     PyObject        *exc_type;
     PyObject        *exc_tb;
 } JSPyErrPrivateData;
 
+/* Private data blocks are carved out of slabs and recycled, instead of
+   being malloc'd and freed for every object crossing into JS */
+typedef struct JSPrivateAllocator {
+    size_t          slab_size;      /* blocks per slab */
+    size_t          spare_slabs;    /* empty slabs kept for reuse */
+    size_t          allocs;         /* blocks handed out */
+    size_t          live;           /* blocks in use */
+    size_t          slabs;          /* slabs currently allocated */
+    size_t          slab_allocs;    /* slabs ever allocated */
+} JSPrivateAllocator;
+
+extern JSPrivateAllocator JSPrivateAlloc;
+
 void init_jsobj(void);
 JSObjectRef PyJS_new(PyJSContext *context, PyObject *pyobj);
 JSObjectRef PyJSPyErr_new(PyJSContext *context, PyObject *val, PyObject *type, PyObject *tb);
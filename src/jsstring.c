@@ -0,0 +1,254 @@
+#include "jscore.h"
+#include "conversions.h"
+#include "jsstring.h"
+
+PyObject *
+PyJSString_new(JSStringRef string)
+{
+    PyJSString *self = PyObject_New(PyJSString, &jscore_PyJSStringType);
+    if (self) {
+        self->string = JSStringRetain(string);
+        self->unicode = NULL;
+        self->hash = -1;
+    }
+    return (PyObject *)self;
+}
+
+PyObject *
+PyJSString_fromValue(PyJSContext *context, JSValueRef value)
+{
+    JSValueRef exception = NULL;
+    JSStringRef string = JSValueToStringCopy(context->context, value, &exception);
+    PyObject *result;
+
+    if (!string) {
+        return JSException_to_PyErr(context, exception);
+    }
+    result = PyJSString_new(string);
+    JSStringRelease(string);
+    return result;
+}
+
+/* returns a new unicode object for UTF-16 units */
+static PyObject *
+JSChars_to_PyUnicode(const JSChar *chars, size_t length)
+{
+#if Py_UNICODE_SIZE == 2
+    return PyUnicode_FromUnicode((const Py_UNICODE *)chars, length);
+#else
+#ifdef WORDS_BIGENDIAN
+    int byteorder = 1;
+#else
+    int byteorder = -1;
+#endif
+    return PyUnicode_DecodeUTF16((const char *)chars, length * sizeof(JSChar),
+                                 "replace", &byteorder);
+#endif
+}
+
+/* returns a borrowed reference to the characters as unicode, or NULL */
+static PyObject *
+PyJSString_unicode(PyJSString *self)
+{
+    if (!self->unicode) {
+        self->unicode = JSChars_to_PyUnicode(JSStringGetCharactersPtr(self->string),
+                                             JSStringGetLength(self->string));
+    }
+    return self->unicode;
+}
+
+static PyObject *
+PyJSString_new_type(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *obj, *result;
+    JSStringRef string;
+
+    if (!PyArg_ParseTuple(args, "O:JSString", &obj))
+        return NULL;
+    if (PyJSString_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    if (!(string = PyString_to_JSString(obj))) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "JSString() needs a str or unicode");
+        }
+        return NULL;
+    }
+    result = PyJSString_new(string);
+    JSStringRelease(string);
+    return result;
+}
+
+static void
+PyJSString_dealloc(PyJSString *self)
+{
+    JSStringRelease(self->string);
+    Py_XDECREF(self->unicode);
+    PyObject_Del(self);
+}
+
+static PyObject *
+PyJSString_repr(PyJSString *self)
+{
+    return PyString_FromFormat("<JSString of length %lu>",
+        (unsigned long)JSStringGetLength(self->string));
+}
+
+static PyObject *
+PyJSString_str(PyJSString *self)
+{
+    PyObject *unicode = PyJSString_unicode(self);
+    return unicode ? PyObject_Str(unicode) : NULL;
+}
+
+static PyObject *
+PyJSString_toUnicode(PyJSString *self)
+{
+    PyObject *unicode = PyJSString_unicode(self);
+    Py_XINCREF(unicode);
+    return unicode;
+}
+
+static long
+PyJSString_hash(PyJSString *self)
+{
+    PyObject *unicode;
+
+    /* equal to the hash of the equal unicode object, so handles can be
+       used interchangeably as keys */
+    if (self->hash == -1 && (unicode = PyJSString_unicode(self))) {
+        self->hash = PyObject_Hash(unicode);
+    }
+    return self->hash;
+}
+
+static PyObject *
+PyJSString_richcompare(PyJSString *self, PyObject *other, int op)
+{
+    PyObject *unicode;
+
+    if (PyJSString_Check(other) && (op == Py_EQ || op == Py_NE)) {
+        int equal = JSStringIsEqual(self->string, ((PyJSString *)other)->string);
+        if (equal == (op == Py_EQ)) Py_RETURN_TRUE;
+        Py_RETURN_FALSE;
+    }
+    if (PyJSString_Check(other)) {
+        other = PyJSString_unicode((PyJSString *)other);
+        if (!other) return NULL;
+    } else if (!PyString_Check(other) && !PyUnicode_Check(other)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if (!(unicode = PyJSString_unicode(self))) {
+        return NULL;
+    }
+    return PyObject_RichCompare(unicode, other, op);
+}
+
+static Py_ssize_t
+PyJSString_length(PyJSString *self)
+{
+    return JSStringGetLength(self->string);
+}
+
+/* slices with a step of 1 copy just the sliced characters into a new
+   handle; anything else is served by the unicode conversion */
+static PyObject *
+PyJSString_subscript(PyJSString *self, PyObject *key)
+{
+    Py_ssize_t start, stop, step, length;
+    PyObject *unicode, *result;
+    JSStringRef string;
+
+    if (PySlice_Check(key)) {
+        if (PySlice_GetIndicesEx((PySliceObject *)key, JSStringGetLength(self->string),
+                                 &start, &stop, &step, &length) < 0) {
+            return NULL;
+        }
+        if (step == 1) {
+            string = JSStringCreateWithCharacters(
+                JSStringGetCharactersPtr(self->string) + start, length);
+            result = PyJSString_new(string);
+            JSStringRelease(string);
+            return result;
+        }
+    } else if (PyIndex_Check(key)) {
+        Py_ssize_t i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        length = JSStringGetLength(self->string);
+        if (i == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (i < 0) {
+            i += length;
+        }
+        if (i < 0 || i >= length) {
+            PyErr_SetString(PyExc_IndexError, "JSString index out of range");
+            return NULL;
+        }
+        return JSChars_to_PyUnicode(JSStringGetCharactersPtr(self->string) + i, 1);
+    }
+    if (!(unicode = PyJSString_unicode(self))) {
+        return NULL;
+    }
+    return PyObject_GetItem(unicode, key);
+}
+
+static PyMappingMethods PyJSString_as_mapping = {
+    (lenfunc)PyJSString_length,         /* mp_length */
+    (binaryfunc)PyJSString_subscript,   /* mp_subscript */
+    0,                                  /* mp_ass_subscript */
+};
+
+static PySequenceMethods PyJSString_as_sequence = {
+    (lenfunc)PyJSString_length,         /* sq_length */
+};
+
+static PyMethodDef PyJSString_methods[] = {
+    {"__unicode__", (PyCFunction)PyJSString_toUnicode, METH_NOARGS,
+     "Convert the characters to unicode (once; the result is kept)."},
+    {NULL},
+};
+
+PyTypeObject jscore_PyJSStringType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.JSString",            /* tp_name */
+    sizeof(PyJSString),             /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSString_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    (reprfunc)PyJSString_repr,      /* tp_repr */
+    0,                              /* tp_as_number */
+    &PyJSString_as_sequence,        /* tp_as_sequence */
+    &PyJSString_as_mapping,         /* tp_as_mapping */
+    (hashfunc)PyJSString_hash,      /* tp_hash */
+    0,                              /* tp_call */
+    (reprfunc)PyJSString_str,       /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "JSString(s): a JS string handle, converted to unicode on demand.\n"
+    "Lengths and indices count UTF-16 code units.", /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    (richcmpfunc)PyJSString_richcompare, /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    PyJSString_methods,             /* tp_methods */
+    0,                              /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    PyJSString_new_type,            /* tp_new */
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+typedef struct PyJSString PyJSString;
+
+/* A JS string passed to Python without transcoding it: it is converted to
+   unicode only when its characters are needed, and goes back into JS as
+   the same JSStringRef */
+struct PyJSString {
+    PyObject_HEAD
+    JSStringRef         string;     /* retain */
+    PyObject            *unicode;   /* retain; NULL until converted */
+    long                hash;       /* -1 until computed */
+};
+
+extern PyTypeObject jscore_PyJSStringType;
+
+#define PyJSString_Check(op) PyObject_TypeCheck(op, &jscore_PyJSStringType)
+
+/* returns a new JSString handle for the string (which is retained) */
+PyObject *PyJSString_new(JSStringRef string);
+
+/* returns a new handle for a JS string value;
+   if an error occurs, sets a Python exception and returns NULL */
+PyObject *PyJSString_fromValue(PyJSContext *context, JSValueRef value);
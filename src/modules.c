@@ -0,0 +1,428 @@
+#include <Python.h>
+#include <structmember.h>
+
+#include "jscore.h"
+#include "conversions.h"
+#include "script.h"
+#include "modules.h"
+
+static JSClassRef JSModuleHostClass = NULL;
+
+/* installs require() on the global object; the context's module instances
+   are kept in cache, by id. A module that throws is dropped from the cache,
+   and a cycle sees the exports of the module still loading, as in Node */
+static const char *JSModules_installSource =
+    "(function (global, host, resolve, load) {"
+    "    var cache = Object.create(null);"
+    "    function makeRequire(referrer) {"
+    "        function require(specifier) {"
+    "            var id = resolve(host, String(specifier), referrer), module = cache[id];"
+    "            if (module) return module.exports;"
+    "            module = cache[id] = {id: id, exports: {}, loaded: false};"
+    "            try {"
+    "                load(host, id).call(module.exports, module.exports, makeRequire(id),"
+    "                                    module, id);"
+    "            } catch (e) {"
+    "                delete cache[id];"
+    "                throw e;"
+    "            }"
+    "            module.loaded = true;"
+    "            return module.exports;"
+    "        }"
+    "        require.cache = cache;"
+    "        return require;"
+    "    }"
+    "    global.require = makeRequire(null);"
+    "})";
+
+/* the source of a module is evaluated as the body of this function */
+static const char JSModule_prefix[] = "(function (exports, require, module, __filename) {";
+static const char JSModule_suffix[] = "\n})";
+
+/* returns the id or name as a str (UTF-8), or NULL with an exception set */
+static PyObject *
+PyJSModule_key(PyObject *name)
+{
+    if (PyUnicode_Check(name)) {
+        return PyUnicode_AsUTF8String(name);
+    }
+    if (PyString_Check(name)) {
+        Py_INCREF(name);
+        return name;
+    }
+    PyErr_Format(PyExc_TypeError, "module ids must be strings, not '%.200s'",
+                 Py_TYPE(name)->tp_name);
+    return NULL;
+}
+
+/* returns a new Script of the module source wrapped into a function, named
+   by id in stack traces */
+static PyObject *
+PyJSModule_wrap(PyObject *id, PyObject *source)
+{
+    JSStringRef body, wrapped;
+    JSChar *chars;
+    PyJSScript *script;
+    size_t i, n, prefix = sizeof(JSModule_prefix) - 1, suffix = sizeof(JSModule_suffix) - 1;
+
+    if (PyObject_TypeCheck(source, &jscore_PyJSScriptType)) {
+        body = JSStringRetain(((PyJSScript *)source)->source);
+    } else if (PyString_Check(source) || PyUnicode_Check(source)) {
+        if (!(body = PyObject_to_JSString(source)))
+            return NULL;
+    } else {
+        PyErr_Format(PyExc_TypeError, "module source must be a string or a Script, not '%.200s'",
+                     Py_TYPE(source)->tp_name);
+        return NULL;
+    }
+    n = JSStringGetLength(body);
+    if (!(chars = PyMem_New(JSChar, prefix + n + suffix))) {
+        JSStringRelease(body);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < prefix; i++)
+        chars[i] = JSModule_prefix[i];
+    memcpy(chars + prefix, JSStringGetCharactersPtr(body), n * sizeof(JSChar));
+    for (i = 0; i < suffix; i++)
+        chars[prefix + n + i] = JSModule_suffix[i];
+    wrapped = JSStringCreateWithCharacters(chars, prefix + n + suffix);
+    PyMem_Free(chars);
+    JSStringRelease(body);
+
+    if (!(script = JSALLOC(PyJSScript))) {
+        JSStringRelease(wrapped);
+        return NULL;
+    }
+    Py_INCREF(id);
+    script->path = id;
+    script->source = wrapped;
+    script->url = JSStringCreateWithUTF8CString(PyString_AS_STRING(id));
+    script->dev = 0;
+    script->ino = 0;
+    script->mtime = 0;
+    script->mtime_nsec = 0;
+    script->size = 0;
+    return (PyObject *)script;
+}
+
+/* returns a new reference to the id of the module specifier required from
+   referrer (None at the top level), calling the resolver on first use in
+   the group; if an error occurs, sets a Python exception and returns NULL */
+static PyObject *
+PyJSModuleGroup_resolve(PyJSModuleGroup *self, PyObject *specifier, PyObject *referrer)
+{
+    PyObject *key, *result = NULL, *id = NULL, *source, *script;
+
+    if (!(key = PyTuple_Pack(2, referrer, specifier)))
+        return NULL;
+    if ((id = PyDict_GetItem(self->resolved, key))) {
+        Py_INCREF(id);
+        goto finally;
+    }
+    if (!(result = PyObject_CallFunctionObjArgs(self->resolver, specifier, referrer, NULL)))
+        goto finally;
+    if (result == Py_None) {
+        PyErr_Format(PyExc_ImportError, "cannot find module '%.400s'",
+                     PyString_AS_STRING(specifier));
+        goto finally;
+    }
+    if (!PyTuple_Check(result) || PyTuple_GET_SIZE(result) != 2) {
+        PyErr_SetString(PyExc_TypeError, "the resolver must return (id, source) or None");
+        goto finally;
+    }
+    if (!(id = PyJSModule_key(PyTuple_GET_ITEM(result, 0))))
+        goto finally;
+    /* several specifiers may resolve to one module, which is read once */
+    if (!PyDict_GetItem(self->sources, id)) {
+        source = PyTuple_GET_ITEM(result, 1);
+        if (!(script = PyJSModule_wrap(id, source)) ||
+            PyDict_SetItem(self->sources, id, script) < 0) {
+            Py_XDECREF(script);
+            Py_CLEAR(id);
+            goto finally;
+        }
+        Py_DECREF(script);
+    }
+    if (PyDict_SetItem(self->resolved, key, id) < 0) {
+        Py_CLEAR(id);
+    }
+  finally:
+    Py_XDECREF(result);
+    Py_DECREF(key);
+    return id;
+}
+
+/* returns the context of the host argument, or NULL with a JS exception */
+static PyJSContext *
+JSModules_host(JSContextRef ctx, size_t argumentCount, const JSValueRef arguments[],
+               JSValueRef *exception)
+{
+    PyJSContext *context;
+
+    if (argumentCount < 2 || !JSValueIsObjectOfClass(ctx, arguments[0], JSModuleHostClass)) {
+        set_JSError(ctx, "expected the module host", exception);
+        return NULL;
+    }
+    context = JSObjectGetPrivate(JSValueToObject(ctx, arguments[0], NULL));
+    if (!context->modules) {
+        set_JSError(ctx, "the context has no module group", exception);
+        return NULL;
+    }
+    return context;
+}
+
+/* returns the value (a string) as a str key, or NULL with an exception set */
+static PyObject *
+JSValue_to_PyModuleKey(PyJSContext *context, JSValueRef value)
+{
+    PyObject *name = JSValue_to_PyString(context, value), *key;
+
+    if (!name)
+        return NULL;
+    key = PyJSModule_key(name);
+    Py_DECREF(name);
+    return key;
+}
+
+/* resolve(host, specifier, referrer): returns the id of the module */
+static JSValueRef
+JSModules_resolve(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                  size_t argumentCount, const JSValueRef arguments[],
+                  JSValueRef *exception)
+{
+    PyJSContext *context = JSModules_host(ctx, argumentCount, arguments, exception);
+    PyObject *specifier = NULL, *referrer = NULL, *id = NULL;
+    JSStringRef jsid;
+    JSValueRef result = NULL;
+
+    if (!context)
+        return NULL;
+    if (!(specifier = JSValue_to_PyModuleKey(context, arguments[1])))
+        goto finally;
+    if (argumentCount < 3 || JSValueIsNull(ctx, arguments[2])) {
+        Py_INCREF(Py_None);
+        referrer = Py_None;
+    } else if (!(referrer = JSValue_to_PyModuleKey(context, arguments[2]))) {
+        goto finally;
+    }
+    if (!(id = PyJSModuleGroup_resolve((PyJSModuleGroup *)context->modules, specifier, referrer)))
+        goto finally;
+    if ((jsid = PyObject_to_JSString(id))) {
+        result = JSValueMakeString(ctx, jsid);
+        JSStringRelease(jsid);
+    }
+  finally:
+    Py_XDECREF(specifier);
+    Py_XDECREF(referrer);
+    Py_XDECREF(id);
+    if (!result) {
+        set_JSException(context, exception);
+    }
+    return result;
+}
+
+/* load(host, id): returns the wrapped module function, compiled in the
+   context from the source cached by the group */
+static JSValueRef
+JSModules_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+               size_t argumentCount, const JSValueRef arguments[],
+               JSValueRef *exception)
+{
+    PyJSContext *context = JSModules_host(ctx, argumentCount, arguments, exception);
+    PyJSModuleGroup *group;
+    PyJSScript *script;
+    PyObject *id;
+
+    if (!context)
+        return NULL;
+    group = (PyJSModuleGroup *)context->modules;
+    if (!(id = JSValue_to_PyModuleKey(context, arguments[1]))) {
+        set_JSException(context, exception);
+        return NULL;
+    }
+    script = (PyJSScript *)PyDict_GetItem(group->sources, id);
+    Py_DECREF(id);
+    if (!script) {
+        set_JSError(ctx, "module was not resolved", exception);
+        return NULL;
+    }
+    return JSEvaluateScript(ctx, script->source, NULL, script->url, 1, exception);
+}
+
+static PyObject *
+PyJSModuleGroup_install(PyJSModuleGroup *self, PyObject *arg)
+{
+    PyJSContext *context = (PyJSContext *)arg;
+    JSGlobalContextRef ctx;
+    JSValueRef args[4], value, exception = NULL;
+    JSObjectRef installer;
+    JSStringRef jsstr;
+
+    if (!PyObject_TypeCheck(arg, &jscore_PyJSContextType)) {
+        PyErr_SetString(PyExc_TypeError, "install() needs a Context");
+        return NULL;
+    }
+    if (context->modules) {
+        PyErr_SetString(PyExc_ValueError, "the context already has a module group");
+        return NULL;
+    }
+    if (!JSModuleHostClass) {
+        JSClassDefinition definition = kJSClassDefinitionEmpty;
+        definition.className = "ModuleHost";
+        JSModuleHostClass = JSClassCreate(&definition);
+    }
+    ctx = context->context;
+    jsstr = JSStringCreateWithUTF8CString(JSModules_installSource);
+    value = JSEvaluateScript(ctx, jsstr, NULL, NULL, 1, &exception);
+    JSStringRelease(jsstr);
+    if (!value || !(installer = JSValueToObject(ctx, value, &exception))) {
+        return JSException_to_PyErr(context, exception);
+    }
+    args[0] = JSContextGetGlobalObject(ctx);
+    args[1] = JSObjectMake(ctx, JSModuleHostClass, context);
+    jsstr = JSStringCreateWithUTF8CString("resolve");
+    args[2] = JSObjectMakeFunctionWithCallback(ctx, jsstr, JSModules_resolve);
+    JSStringRelease(jsstr);
+    jsstr = JSStringCreateWithUTF8CString("load");
+    args[3] = JSObjectMakeFunctionWithCallback(ctx, jsstr, JSModules_load);
+    JSStringRelease(jsstr);
+    if (!JSObjectCallAsFunction(ctx, installer, NULL, 4, args, &exception)) {
+        return JSException_to_PyErr(context, exception);
+    }
+    Py_INCREF(self);
+    context->modules = (PyObject *)self;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+PyJSModuleGroup_clearCaches(PyJSModuleGroup *self)
+{
+    PyDict_Clear(self->resolved);
+    PyDict_Clear(self->sources);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+PyJSModuleGroup_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"resolver", NULL};
+    PyJSModuleGroup *self;
+    PyObject *resolver;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:ModuleGroup", kwlist, &resolver))
+        return NULL;
+    if (!PyCallable_Check(resolver)) {
+        PyErr_SetString(PyExc_TypeError, "the resolver must be callable");
+        return NULL;
+    }
+    if (!(self = (PyJSModuleGroup *)type->tp_alloc(type, 0)))
+        return NULL;
+    Py_INCREF(resolver);
+    self->resolver = resolver;
+    if (!(self->resolved = PyDict_New()) || !(self->sources = PyDict_New())) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static int
+PyJSModuleGroup_traverse(PyJSModuleGroup *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->resolver);
+    Py_VISIT(self->resolved);
+    Py_VISIT(self->sources);
+    return 0;
+}
+
+static int
+PyJSModuleGroup_clear(PyJSModuleGroup *self)
+{
+    Py_CLEAR(self->resolver);
+    Py_CLEAR(self->resolved);
+    Py_CLEAR(self->sources);
+    return 0;
+}
+
+static void
+PyJSModuleGroup_dealloc(PyJSModuleGroup *self)
+{
+    PyObject_GC_UnTrack(self);
+    PyJSModuleGroup_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+PyJSModuleGroup_getModules(PyJSModuleGroup *self)
+{
+    return PyInt_FromSsize_t(self->sources ? PyDict_Size(self->sources) : 0);
+}
+
+static PyMethodDef PyJSModuleGroup_methods[] = {
+    {"install", (PyCFunction)PyJSModuleGroup_install, METH_O,
+     "install(context) -> install require() on the global object of the\n"
+     "context, loading modules of this group"},
+    {"clear", (PyCFunction)PyJSModuleGroup_clearCaches, METH_NOARGS,
+     "clear() -> forget the resolved specifiers and module sources, so later\n"
+     "first requires in each context ask the resolver again"},
+    {NULL},
+};
+
+static PyMemberDef PyJSModuleGroup_members[] = {
+    {"resolver", T_OBJECT, offsetof(PyJSModuleGroup, resolver), READONLY,
+     "resolver(specifier, referrer) -> (id, source) or None"},
+    {NULL},
+};
+
+static PyGetSetDef PyJSModuleGroup_getsetters[] = {
+    {"modules", (getter)PyJSModuleGroup_getModules, NULL,
+     "number of module sources cached"},
+    {NULL},
+};
+
+PyTypeObject jscore_PyJSModuleGroupType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.ModuleGroup",         /* tp_name */
+    sizeof(PyJSModuleGroup),        /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSModuleGroup_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    "ModuleGroup(resolver): CommonJS modules for the contexts it is\n"
+    "installed in. resolver(specifier, referrer) returns (id, source) for\n"
+    "the module required as specifier from the module referrer (None at\n"
+    "the top level), or None if there is none; source is a string or a\n"
+    "Script. Resolutions and sources are cached for the group, and each\n"
+    "context evaluates a module on its first require().", /* tp_doc */
+    (traverseproc)PyJSModuleGroup_traverse, /* tp_traverse */
+    (inquiry)PyJSModuleGroup_clear, /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    PyJSModuleGroup_methods,        /* tp_methods */
+    PyJSModuleGroup_members,        /* tp_members */
+    PyJSModuleGroup_getsetters,     /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    PyJSModuleGroup_new,            /* tp_new */
+};
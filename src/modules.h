@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+typedef struct PyJSModuleGroup PyJSModuleGroup;
+
+/* CommonJS modules shared by a group of contexts: the resolver maps
+   (specifier, referrer id) to (id, source), and both its answers and the
+   wrapped sources are cached for the group, so each module is resolved
+   and read once however many contexts require it. Every context keeps
+   its own module instances */
+struct PyJSModuleGroup {
+    PyObject_HEAD
+    PyObject            *resolver;  /* retain */
+    PyObject            *resolved;  /* retain; {(referrer, specifier): id} */
+    PyObject            *sources;   /* retain; {id: Script of the wrapped source} */
+};
+
+extern PyTypeObject jscore_PyJSModuleGroupType;
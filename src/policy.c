@@ -0,0 +1,113 @@
+#include <Python.h>
+
+#include "jscore.h"
+#include "jsobj.h"
+#include "policy.h"
+
+/* returns the __jsflags__ of object, or 0 if it has none; plain attributes
+   are found without raising for the many objects without flags */
+static long
+PyJS_GetFlags(PyObject *object)
+{
+    static PyObject *name = NULL;
+    PyObject **dictptr, *flagsobj = NULL;
+    long flags;
+    
+    if (!name && !(name = PyString_InternFromString("__jsflags__"))) {
+        PyErr_Clear();
+        return 0;
+    }
+    if (!PyInstance_Check(object)) {
+        if ((dictptr = _PyObject_GetDictPtr(object)) && *dictptr) {
+            flagsobj = PyDict_GetItem(*dictptr, name);
+        }
+        if (!flagsobj && PyType_Check(object)) {
+            flagsobj = _PyType_Lookup((PyTypeObject *)object, name);
+        }
+        if (!flagsobj && !(flagsobj = _PyType_Lookup(Py_TYPE(object), name))) {
+            return 0;
+        }
+        if (PyInt_Check(flagsobj)) {
+            return PyInt_AS_LONG(flagsobj);
+        }
+    }
+    /* old-style instances and descriptors */
+    if (!(flagsobj = PyObject_GetAttr(object, name))) {
+        PyErr_Clear();
+        return 0;
+    }
+    if ((flags = PyInt_AsLong(flagsobj)) == -1) {
+        PyErr_Clear();
+        flags = 0;
+    }
+    Py_DECREF(flagsobj);
+    return flags;
+}
+
+PyObject *
+PyJSContext_allow(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"type", "read", "write", "call", "private", NULL};
+    PyObject *type, *access;
+    int read = 1, write = 0, call = 1, private = 0, rv;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iiii:allow", kwlist,
+                                     &type, &read, &write, &call, &private))
+        return NULL;
+    if (!PyType_Check(type)) {
+        PyErr_SetString(PyExc_TypeError, "allow() needs a type");
+        return NULL;
+    }
+    if (!self->policy && !(self->policy = PyDict_New()))
+        return NULL;
+    access = PyInt_FromLong((read ? ALLOW_READ_ATTR : 0) |
+                            (write ? ALLOW_MODIFY_ATTR | ALLOW_EXPORTED_SET : 0) |
+                            (call ? ALLOW_CALL : 0) | (private ? ALLOW_PRIVATE_ATTR : 0));
+    if (!access)
+        return NULL;
+    rv = PyDict_SetItem(self->policy, type, access);
+    Py_DECREF(access);
+    if (rv < 0)
+        return NULL;
+    /* the types resolved through their MRO may resolve differently now */
+    Py_CLEAR(self->admitted);
+    Py_RETURN_NONE;
+}
+
+/* returns the access allowed for type, or -1 if the policy has no entry
+   for it or its bases */
+static int
+PyJSPolicy_lookup(PyJSContext *context, PyTypeObject *type)
+{
+    PyObject *mro = type->tp_mro, *access = NULL;
+    Py_ssize_t i;
+
+    if (!context->policy)
+        return -1;
+    if (context->admitted && (access = PyDict_GetItem(context->admitted, (PyObject *)type)))
+        return PyInt_AS_LONG(access);
+    for (i = 0; mro && i < PyTuple_GET_SIZE(mro) && !access; i++) {
+        access = PyDict_GetItem(context->policy, PyTuple_GET_ITEM(mro, i));
+    }
+    if (!access)
+        return -1;
+    /* resolved once per type; a failure to cache is not an error */
+    if ((context->admitted || (context->admitted = PyDict_New())) &&
+        PyDict_SetItem(context->admitted, (PyObject *)type, access) < 0) {
+        PyErr_Clear();
+    }
+    return PyInt_AS_LONG(access);
+}
+
+int
+PyJSPolicy_access(PyJSContext *context, PyObject *obj)
+{
+    int access = PyJSPolicy_lookup(context, Py_TYPE(obj));
+
+    if (access >= 0)
+        return access;
+    if (context->flags & STRICT_ACCESS)
+        return 0;
+    return ALLOW_READ_ATTR | ALLOW_CALL | ALLOW_EXPORTED_SET |
+        (PyJS_GetFlags(obj) & (ALLOW_PRIVATE_ATTR | ALLOW_MODIFY_ATTR));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+/* Context.allow(type, read=True, write=False, call=True, private=False):
+   admits the instances of type (and its subclasses) converted from then
+   on with that access; proxies already in JS keep the access they were
+   admitted with. returns None, or NULL with an exception set */
+PyObject *PyJSContext_allow(PyJSContext *self, PyObject *args, PyObject *kwds);
+
+/* returns the access (ALLOW_* bits) of a proxy of obj in the context: the
+   allow() of the nearest type in its MRO, else none for a STRICT_ACCESS
+   context, else read and call (and the exported setters) plus the
+   __jsflags__ of obj.
+   does not raise */
+int PyJSPolicy_access(PyJSContext *context, PyObject *obj);
@@ -0,0 +1,311 @@
+#include <Python.h>
+
+#include "jscore.h"
+#include "profiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define JSPROFILE_MIN_CAPACITY  64
+
+uint64_t
+JSProfile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static long
+JSProfile_hash(int kind, PyObject *target, PyObject *name)
+{
+    long hash = _Py_HashPointer(target) ^ kind;
+
+    if (name) {
+        long h = PyObject_Hash(name);
+        if (h == -1) {
+            PyErr_Clear();
+            h = 0;
+        }
+        hash = hash * 1000003 ^ h;
+    }
+    return hash;
+}
+
+/* returns the slot of the key, or the free slot where it belongs */
+static JSProfileEntry *
+JSProfile_lookup(JSProfile *profile, int kind, PyObject *target, PyObject *name, long hash)
+{
+    size_t mask = profile->capacity - 1, i = (size_t)hash & mask;
+
+    for (;; i = (i + 1) & mask) {
+        JSProfileEntry *entry = &profile->entries[i];
+        if (!entry->target) {
+            return entry;
+        }
+        if (entry->hash != hash || entry->kind != kind || entry->target != target) {
+            continue;
+        }
+        /* property names usually come from the key cache, and match by
+           identity */
+        if (entry->name == name) {
+            return entry;
+        }
+        if (entry->name && name) {
+            int equal = PyObject_RichCompareBool(entry->name, name, Py_EQ);
+            if (equal > 0) {
+                return entry;
+            } else if (equal < 0) {
+                PyErr_Clear();
+            }
+        }
+    }
+}
+
+/* doubles the table; returns -1 if memory is exhausted */
+static int
+JSProfile_grow(JSProfile *profile)
+{
+    JSProfileEntry *old = profile->entries, *entries;
+    size_t i, capacity = profile->capacity ? profile->capacity * 2 : JSPROFILE_MIN_CAPACITY;
+
+    if (!(entries = PyMem_New(JSProfileEntry, capacity))) {
+        return -1;
+    }
+    memset(entries, 0, capacity * sizeof(JSProfileEntry));
+    profile->entries = entries;
+    profile->capacity = capacity;
+    for (i = 0; old && i < capacity / 2; i++) {
+        if (old[i].target) {
+            *JSProfile_lookup(profile, old[i].kind, old[i].target, old[i].name,
+                              old[i].hash) = old[i];
+        }
+    }
+    PyMem_Free(old);
+    return 0;
+}
+
+/* bound methods are created afresh for each call from JS, so they are
+   keyed by their function, or by the type of self and the method's name */
+static PyObject *
+JSProfile_callTarget(PyObject *target, PyObject **name)
+{
+    PyObject *self;
+
+    if (PyMethod_Check(target) && PyMethod_GET_SELF(target)) {
+        return PyMethod_GET_FUNCTION(target);
+    }
+    if (PyCFunction_Check(target) && (self = PyCFunction_GET_SELF(target)) &&
+        !PyModule_Check(self)) {
+        if (!(*name = PyString_InternFromString(((PyCFunctionObject *)target)->m_ml->ml_name))) {
+            PyErr_Clear();
+            return NULL;
+        }
+        return (PyObject *)Py_TYPE(self);
+    }
+    return target;
+}
+
+void
+JSProfile_record(PyJSContext *context, int kind, PyObject *target, PyObject *name,
+                 uint64_t start, uint64_t convert, uint64_t convert_from)
+{
+    JSProfile *profile = context->profile;
+    JSProfileEntry *entry;
+    PyObject *method_name = NULL;
+    uint64_t end;
+    long hash;
+
+    /* profiling may have been switched on or off during the callback */
+    if (!start || !context->profiling || !profile) {
+        return;
+    }
+    end = JSProfile_now();
+    if (convert_from) {
+        convert += end - convert_from;
+    }
+    if (profile->used * 2 >= profile->capacity && JSProfile_grow(profile) < 0) {
+        return;
+    }
+    if (kind == JSPROFILE_CALL && !name) {
+        if (!(target = JSProfile_callTarget(target, &method_name))) {
+            return;
+        }
+        name = method_name;
+    }
+    hash = JSProfile_hash(kind, target, name);
+    entry = JSProfile_lookup(profile, kind, target, name, hash);
+    if (!entry->target) {
+        entry->kind = kind;
+        Py_INCREF(target);
+        entry->target = target;
+        Py_XINCREF(name);
+        entry->name = name;
+        entry->hash = hash;
+        profile->used++;
+    }
+    entry->calls++;
+    entry->total_ns += end - start;
+    entry->convert_ns += convert;
+    Py_XDECREF(method_name);
+}
+
+int
+PyJSProfile_traverse(PyJSContext *context, visitproc visit, void *arg)
+{
+    JSProfile *profile = context->profile;
+    size_t i;
+
+    for (i = 0; profile && i < profile->capacity; i++) {
+        Py_VISIT(profile->entries[i].target);
+        Py_VISIT(profile->entries[i].name);
+    }
+    return 0;
+}
+
+/* drops the entries, keeping the (emptied) table */
+static void
+JSProfile_reset(JSProfile *profile)
+{
+    size_t i;
+
+    for (i = 0; i < profile->capacity; i++) {
+        Py_CLEAR(profile->entries[i].target);
+        Py_CLEAR(profile->entries[i].name);
+    }
+    profile->used = 0;
+}
+
+void
+PyJSProfile_clearContext(PyJSContext *context)
+{
+    JSProfile *profile = context->profile;
+
+    context->profiling = 0;
+    if (profile) {
+        context->profile = NULL;
+        JSProfile_reset(profile);
+        PyMem_Free(profile->entries);
+        PyMem_Free(profile);
+    }
+}
+
+PyObject *
+PyJSContext_getProfiling(PyJSContext *self)
+{
+    return PyBool_FromLong(self->profiling);
+}
+
+int
+PyJSContext_setProfiling(PyJSContext *self, PyObject *value)
+{
+    int profiling;
+
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete profiling");
+        return -1;
+    }
+    if ((profiling = PyObject_IsTrue(value)) < 0) {
+        return -1;
+    }
+    if (profiling && !self->profile) {
+        if (!(self->profile = PyMem_New(JSProfile, 1))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->profile->entries = NULL;
+        self->profile->used = self->profile->capacity = 0;
+        if (JSProfile_grow(self->profile) < 0) {
+            PyMem_Free(self->profile);
+            self->profile = NULL;
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    self->profiling = profiling;
+    return 0;
+}
+
+static const char *JSProfile_kinds[] = {"call", "get", "set"};
+
+/* most expensive first */
+static int
+JSProfile_byCalls(const void *a, const void *b)
+{
+    unsigned long x = (*(JSProfileEntry **)a)->calls, y = (*(JSProfileEntry **)b)->calls;
+    return (x < y) - (x > y);
+}
+
+static int
+JSProfile_byTotal(const void *a, const void *b)
+{
+    uint64_t x = (*(JSProfileEntry **)a)->total_ns, y = (*(JSProfileEntry **)b)->total_ns;
+    return (x < y) - (x > y);
+}
+
+static int
+JSProfile_byConvert(const void *a, const void *b)
+{
+    uint64_t x = (*(JSProfileEntry **)a)->convert_ns, y = (*(JSProfileEntry **)b)->convert_ns;
+    return (x < y) - (x > y);
+}
+
+PyObject *
+PyJSContext_profileStats(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"sort", NULL};
+    const char *sort = "total";
+    int (*compare)(const void *, const void *);
+    JSProfile *profile = self->profile;
+    JSProfileEntry **sorted;
+    PyObject *rows;
+    size_t i, n = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s:profile_stats", kwlist, &sort))
+        return NULL;
+    if (!strcmp(sort, "total")) {
+        compare = JSProfile_byTotal;
+    } else if (!strcmp(sort, "calls")) {
+        compare = JSProfile_byCalls;
+    } else if (!strcmp(sort, "convert")) {
+        compare = JSProfile_byConvert;
+    } else {
+        PyErr_Format(PyExc_ValueError, "sort must be 'total', 'calls' or 'convert', not '%.20s'",
+                     sort);
+        return NULL;
+    }
+    if (!profile || !profile->used)
+        return PyList_New(0);
+    if (!(sorted = PyMem_New(JSProfileEntry *, profile->used)))
+        return PyErr_NoMemory();
+    for (i = 0; i < profile->capacity; i++) {
+        if (profile->entries[i].target)
+            sorted[n++] = &profile->entries[i];
+    }
+    qsort(sorted, n, sizeof(JSProfileEntry *), compare);
+    if ((rows = PyList_New(n))) {
+        for (i = 0; i < n; i++) {
+            PyObject *row = Py_BuildValue("(sOOkdd)", JSProfile_kinds[sorted[i]->kind],
+                sorted[i]->name ? sorted[i]->name : Py_None, sorted[i]->target,
+                sorted[i]->calls, sorted[i]->total_ns / 1e9, sorted[i]->convert_ns / 1e9);
+            if (!row) {
+                Py_CLEAR(rows);
+                break;
+            }
+            PyList_SET_ITEM(rows, i, row);
+        }
+    }
+    PyMem_Free(sorted);
+    return rows;
+}
+
+PyObject *
+PyJSContext_profileReset(PyJSContext *self)
+{
+    if (self->profile) {
+        JSProfile_reset(self->profile);
+    }
+    Py_RETURN_NONE;
+}
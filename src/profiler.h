@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include <stdint.h>
+
+#include "jscore.h"
+
+typedef struct JSProfileEntry JSProfileEntry;
+
+/* kinds of profiled callbacks */
+#define JSPROFILE_CALL      0   /* a Python callable (or exported method) */
+#define JSPROFILE_GET       1   /* a property read from a Python object */
+#define JSPROFILE_SET       2   /* a property written to a Python object */
+
+/* The callbacks into Python reached from JS, keyed by kind, target (the
+   callable, or the type whose attribute is accessed) and property name;
+   a bound method is recorded as its function, a method of a builtin type
+   as the type and the method's name */
+struct JSProfileEntry {
+    int                 kind;
+    PyObject            *target;    /* retain; NULL if the slot is free */
+    PyObject            *name;      /* retain; NULL for plain calls */
+    long                hash;
+    unsigned long       calls;
+    uint64_t            total_ns;   /* including nested callbacks */
+    uint64_t            convert_ns; /* converting arguments and results */
+};
+
+/* an open addressing table of entries; capacity is a power of two */
+struct JSProfile {
+    JSProfileEntry      *entries;   /* PyMem */
+    size_t              used;
+    size_t              capacity;
+};
+
+/* returns the monotonic time in ns */
+uint64_t JSProfile_now(void);
+
+/* the start time of a callback, or 0 if the context is not profiling */
+#define JSPROFILE_START(context) ((context)->profiling ? JSProfile_now() : 0)
+
+/* adds a callback which started at start (if not 0) and ends now; its
+   conversions took convert ns, plus the time since convert_from (if not 0);
+   does not raise */
+void JSProfile_record(PyJSContext *context, int kind, PyObject *target, PyObject *name,
+                      uint64_t start, uint64_t convert, uint64_t convert_from);
+
+/* the target of an access to an attribute of obj: its type, unless obj
+   is a module or a type itself */
+#define JSPROFILE_TARGET(obj) \
+    (PyModule_Check(obj) || PyType_Check(obj) ? (obj) : (PyObject *)Py_TYPE(obj))
+
+int PyJSProfile_traverse(PyJSContext *context, visitproc visit, void *arg);
+
+/* releases the profile of the context */
+void PyJSProfile_clearContext(PyJSContext *context);
+
+/* Context methods and attributes */
+PyObject *PyJSContext_getProfiling(PyJSContext *self);
+int PyJSContext_setProfiling(PyJSContext *self, PyObject *value);
+PyObject *PyJSContext_profileStats(PyJSContext *self, PyObject *args, PyObject *kwds);
+PyObject *PyJSContext_profileReset(PyJSContext *self);
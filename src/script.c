@@ -0,0 +1,265 @@
+#include "jscore.h"
+#include "conversions.h"
+#include "script.h"
+
+#include <structmember.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* dict from real path to PyJSScript; it only shrinks when a file changes
+   or clear_script_cache() is called */
+static PyObject *script_cache = NULL;
+
+static long
+stat_mtime_nsec(const struct stat *st)
+{
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+/* whether the cached script was read from the file as it is now; the
+   nanoseconds catch a same-size rewrite within a second, and the inode
+   a file replaced by rename */
+static int
+PyJSScript_isCurrent(PyJSScript *self, const struct stat *st)
+{
+    return st->st_dev == self->dev && st->st_ino == self->ino &&
+        st->st_mtime == self->mtime && stat_mtime_nsec(st) == self->mtime_nsec &&
+        st->st_size == self->size;
+}
+
+/* maps the file into memory and decodes it straight into a JSString;
+   called without the GIL. returns 0, or an errno value */
+static int
+read_source(const char *path, JSStringRef *source, struct stat *st)
+{
+    void *buffer = NULL;
+    int fd;
+    
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno;
+    }
+    if (fstat(fd, st) < 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if (st->st_size > 0) {
+        buffer = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buffer == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            return err;
+        }
+    }
+    close(fd);
+    *source = UTF8_to_JSString((const char *)buffer, st->st_size);
+    if (buffer) {
+        munmap(buffer, st->st_size);
+    }
+    return *source ? 0 : ENOMEM;
+}
+
+/* returns a new script for path with the source of script, which was
+   cached for another path to the same file, so that its sourceURL and
+   path are the ones given */
+static PyJSScript *
+PyJSScript_alias(PyJSScript *script, const char *path)
+{
+    PyJSScript *self;
+
+    if (!(self = JSALLOC(PyJSScript))) {
+        return NULL;
+    }
+    self->source = JSStringRetain(script->source);
+    self->url = JSStringCreateWithUTF8CString(path);
+    self->dev = script->dev;
+    self->ino = script->ino;
+    self->mtime = script->mtime;
+    self->mtime_nsec = script->mtime_nsec;
+    self->size = script->size;
+    if (!(self->path = PyString_FromString(path))) {
+        Py_CLEAR(self);
+    }
+    return self;
+}
+
+PyJSScript *
+PyJSScript_load(const char *path)
+{
+    PyJSScript *self = NULL;
+    PyObject *key = NULL;
+    JSStringRef source = NULL;
+    struct stat st;
+    char *real;
+    int err = 0;
+    
+    if (!script_cache && !(script_cache = PyDict_New())) {
+        return NULL;
+    }
+    /* keyed by the real path, so a relative path or a symlink cannot find
+       the script of another file after a chdir */
+    if (!(real = realpath(path, NULL))) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+        return NULL;
+    }
+    key = PyString_FromString(real);
+    free(real);
+    if (!key) {
+        return NULL;
+    }
+    self = (PyJSScript *)PyDict_GetItem(script_cache, key);
+    if (self) {
+        if (stat(PyString_AS_STRING(key), &st) == 0 && PyJSScript_isCurrent(self, &st)) {
+            Py_DECREF(key);
+            if (strcmp(PyString_AS_STRING(self->path), path) != 0) {
+                return PyJSScript_alias(self, path);
+            }
+            Py_INCREF(self);
+            return self;
+        }
+        self = NULL;
+        if (PyDict_DelItem(script_cache, key) < 0) {
+            goto finally;
+        }
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    err = read_source(PyString_AS_STRING(key), &source, &st);
+    Py_END_ALLOW_THREADS
+    if (err) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+        goto finally;
+    }
+    
+    if (!(self = JSALLOC(PyJSScript))) {
+        JSStringRelease(source);
+        goto finally;
+    }
+    self->source = source;
+    self->url = JSStringCreateWithUTF8CString(path);
+    self->dev = st.st_dev;
+    self->ino = st.st_ino;
+    self->mtime = st.st_mtime;
+    self->mtime_nsec = stat_mtime_nsec(&st);
+    self->size = st.st_size;
+    if (!(self->path = PyString_FromString(path)) ||
+        PyDict_SetItem(script_cache, key, (PyObject *)self) < 0) {
+        Py_CLEAR(self);
+    }
+  finally:
+    Py_DECREF(key);
+    return self;
+}
+
+void
+PyJSScript_clearCache(void)
+{
+    if (script_cache) {
+        PyDict_Clear(script_cache);
+    }
+}
+
+static PyObject *
+PyJSScript_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", NULL};
+    char *path = NULL;
+    PyObject *self;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "et:Script", kwlist,
+                                     Py_FileSystemDefaultEncoding, &path))
+        return NULL;
+    self = (PyObject *)PyJSScript_load(path);
+    PyMem_Free(path);
+    return self;
+}
+
+static PyObject *
+PyJSScript_repr(PyJSScript *self)
+{
+    return PyString_FromFormat("<Script %s>", PyString_AsString(self->path));
+}
+
+static Py_ssize_t
+PyJSScript_length(PyJSScript *self)
+{
+    return JSStringGetLength(self->source);
+}
+
+static void
+PyJSScript_dealloc(PyJSScript *self)
+{
+    if (self->source) {
+        JSStringRelease(self->source);
+    }
+    if (self->url) {
+        JSStringRelease(self->url);
+    }
+    Py_XDECREF(self->path);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PySequenceMethods PyJSScript_as_sequence = {
+	(lenfunc)PyJSScript_length,             /* sq_length */
+};
+
+static PyMemberDef PyJSScript_members[] = {
+    {"path", T_OBJECT, offsetof(PyJSScript, path), READONLY,
+     "the path the script was loaded from"},
+    {NULL},
+};
+
+PyTypeObject jscore_PyJSScriptType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                              /* ob_size */
+    "pyjscore.Script",              /* tp_name */
+    sizeof(PyJSScript),             /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)PyJSScript_dealloc, /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_compare */
+    (reprfunc)PyJSScript_repr,      /* tp_repr */
+    0,                              /* tp_as_number */
+    &PyJSScript_as_sequence,        /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    0,                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    "Script(path): the source of a script file, read via mmap and cached\n"
+    "by real path, file identity, modification time (in ns) and size. A\n"
+    "script loaded through another path to a cached file shares its source,\n"
+    "but has the path given. Cached sources stay in memory until their file\n"
+    "changes or jscore.clear_script_cache() is called.", /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    0,                              /* tp_methods */
+    PyJSScript_members,             /* tp_members */
+    0,                              /* tp_getset */
+    0,                              /* tp_base */
+    0,                              /* tp_dict */
+    0,                              /* tp_descr_get */
+    0,                              /* tp_descr_set */
+    0,                              /* tp_dictoffset */
+    0,                              /* tp_init */
+    0,                              /* tp_alloc */
+    PyJSScript_new,                 /* tp_new */
+};
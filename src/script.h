@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct PyJSScript PyJSScript;
+
+/* The source of a script file, shared by every context that evaluates it */
+struct PyJSScript {
+    PyObject_HEAD
+    PyObject            *path;      /* retain */
+    JSStringRef         source;     /* retain */
+    JSStringRef         url;        /* retain; the path as sourceURL */
+    /* the file as read; a change of any of these reloads the script */
+    dev_t               dev;
+    ino_t               ino;
+    time_t              mtime;
+    long                mtime_nsec;
+    off_t               size;
+};
+
+extern PyTypeObject jscore_PyJSScriptType;
+
+/* returns a new reference to the script for path, reading the file only if
+   it is not cached (by real path) or changed on disk since it was cached;
+   the script of another path to a cached file shares its source, with path
+   as its url. The cache is not bounded (see PyJSScript_clearCache).
+   if an error occurs, sets a Python exception and returns NULL */
+PyJSScript *PyJSScript_load(const char *path);
+
+/* drops every cached script */
+void PyJSScript_clearCache(void);
@@ -0,0 +1,331 @@
+#include <Python.h>
+
+#include "jscore.h"
+#include "conversions.h"
+#include "profiler.h"
+#include "stream.h"
+
+/* calls fn on a batch of records, per record unless vectorized; returns the
+   array of results */
+static const char *JSStream_applySource =
+    "(function (fn, records, vectorized) {"
+    "    var results, i;"
+    "    if (vectorized) {"
+    "        results = fn(records);"
+    "        if (!Array.isArray(results))"
+    "            throw new TypeError('a vectorized transform must return an array');"
+    "        return results;"
+    "    }"
+    "    results = new Array(records.length);"
+    "    for (i = 0; i < records.length; i++)"
+    "        results[i] = fn(records[i]);"
+    "    return results;"
+    "})";
+
+typedef struct JSStreamBuffer {
+    char        *data;      /* PyMem */
+    size_t      len;
+    size_t      capacity;
+} JSStreamBuffer;
+
+typedef struct JSStream {
+    PyJSContext     *context;
+    JSObjectRef     apply;      /* protect */
+    JSObjectRef     fn;         /* protect */
+    JSObjectRef     records;    /* protect; the batch being filled */
+    JSValueRef      vectorized;
+    size_t          batched;
+    PyObject        *write;     /* retain; outfile.write */
+    JSStreamBuffer  out;
+    Py_ssize_t      line;       /* of the input, for errors */
+    Py_ssize_t      nrecords;
+    Py_ssize_t      nwritten;
+    Py_ssize_t      bytes_in;
+    Py_ssize_t      bytes_out;
+} JSStream;
+
+/* makes room for n more bytes; returns -1 with an exception set on failure */
+static int
+JSStreamBuffer_reserve(JSStreamBuffer *buf, size_t n)
+{
+    size_t capacity = buf->capacity ? buf->capacity : JSSTREAM_CHUNK;
+    char *data;
+
+    if (buf->len + n <= buf->capacity)
+        return 0;
+    while (capacity < buf->len + n)
+        capacity *= 2;
+    if (!(data = PyMem_Realloc(buf->data, capacity))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+/* writes the output buffered; returns -1 with an exception set on failure */
+static int
+JSStream_flush(JSStream *stream)
+{
+    PyObject *chunk, *result;
+
+    if (!stream->out.len)
+        return 0;
+    if (!(chunk = PyString_FromStringAndSize(stream->out.data, stream->out.len)))
+        return -1;
+    result = PyObject_CallFunctionObjArgs(stream->write, chunk, NULL);
+    Py_DECREF(chunk);
+    if (!result)
+        return -1;
+    Py_DECREF(result);
+    stream->bytes_out += stream->out.len;
+    stream->out.len = 0;
+    return 0;
+}
+
+/* starts an empty batch; returns -1 with an exception set on failure */
+static int
+JSStream_newBatch(JSStream *stream)
+{
+    JSGlobalContextRef ctx = stream->context->context;
+    JSValueRef exception = NULL;
+
+    if (stream->records) {
+        JSValueUnprotect(ctx, stream->records);
+    }
+    if (!(stream->records = JSObjectMakeArray(ctx, 0, NULL, &exception))) {
+        JSException_to_PyErr(stream->context, exception);
+        return -1;
+    }
+    JSValueProtect(ctx, stream->records);
+    stream->batched = 0;
+    return 0;
+}
+
+/* transforms the batch, serializing the results into the output buffer;
+   returns -1 with an exception set on failure */
+static int
+JSStream_runBatch(JSStream *stream)
+{
+    JSGlobalContextRef ctx = stream->context->context;
+    JSValueRef args[3], value, exception = NULL;
+    JSObjectRef results;
+    JSStringRef json;
+    size_t i, n, size;
+
+    if (!stream->batched)
+        return 0;
+    args[0] = stream->fn;
+    args[1] = stream->records;
+    args[2] = stream->vectorized;
+    if (!(value = JSObjectCallAsFunction(ctx, stream->apply, NULL, 3, args, &exception)) ||
+        !(results = JSValueToObject(ctx, value, &exception)) ||
+        !(value = JSObjectGetProperty(ctx, results, JSLengthString, &exception))) {
+        goto error;
+    }
+    n = (size_t)JSValueToNumber(ctx, value, NULL);
+    for (i = 0; i < n; i++) {
+        if (!(value = JSObjectGetPropertyAtIndex(ctx, results, (unsigned)i, &exception)))
+            goto error;
+        if (JSValueIsUndefined(ctx, value))
+            continue;
+        /* NULL without an exception for values JSON cannot represent */
+        if (!(json = JSValueCreateJSONString(ctx, value, 0, &exception))) {
+            if (exception)
+                goto error;
+            continue;
+        }
+        size = JSStringGetMaximumUTF8CStringSize(json);
+        if (JSStreamBuffer_reserve(&stream->out, size + 1) < 0) {
+            JSStringRelease(json);
+            return -1;
+        }
+        /* the size written includes the NUL, replaced by the newline */
+        stream->out.len += JSStringGetUTF8CString(json, stream->out.data + stream->out.len, size) - 1;
+        stream->out.data[stream->out.len++] = '\n';
+        JSStringRelease(json);
+        stream->nwritten++;
+    }
+    if (stream->out.len >= JSSTREAM_CHUNK && JSStream_flush(stream) < 0)
+        return -1;
+    return JSStream_newBatch(stream);
+  error:
+    JSException_to_PyErr(stream->context, exception);
+    return -1;
+}
+
+/* adds the record of a line of len bytes (without its newline) to the
+   batch, running it when full; returns -1 with an exception set on failure */
+static int
+JSStream_addLine(JSStream *stream, const char *line, size_t len, size_t batch)
+{
+    JSGlobalContextRef ctx = stream->context->context;
+    JSStringRef jsstr;
+    JSValueRef record, exception = NULL;
+    const char *p, *end = line + len;
+
+    stream->line++;
+    for (p = line; p < end && (*p == ' ' || *p == '\t' || *p == '\r'); p++)
+        ;
+    if (p == end)
+        return 0;
+    /* with its length, so an embedded NUL is not a silent end of the line but
+       invalid JSON */
+    if (!(jsstr = UTF8_to_JSString(line, len))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    record = JSValueMakeFromJSONString(ctx, jsstr);
+    JSStringRelease(jsstr);
+    if (!record) {
+        PyErr_Format(PyExc_ValueError, "invalid JSON on line %zd", stream->line);
+        return -1;
+    }
+    JSObjectSetPropertyAtIndex(ctx, stream->records, (unsigned)stream->batched, record, &exception);
+    if (exception) {
+        JSException_to_PyErr(stream->context, exception);
+        return -1;
+    }
+    stream->nrecords++;
+    if (++stream->batched >= batch)
+        return JSStream_runBatch(stream);
+    return 0;
+}
+
+/* returns the function to transform with, protected, or NULL with an
+   exception set */
+static JSObjectRef
+JSStream_function(PyJSContext *self, PyObject *fn)
+{
+    JSGlobalContextRef ctx = self->context;
+    JSValueRef value, exception = NULL;
+    JSObjectRef function = NULL;
+    JSStringRef source;
+
+    if (PyObject_TypeCheck(fn, &jscore_PyJSObjectType) && ((PyJSObject *)fn)->object) {
+        if (((PyJSObject *)fn)->context != self) {
+            PyErr_SetString(PyExc_ValueError, "the transform is a function of another context");
+            return NULL;
+        }
+        function = ((PyJSObject *)fn)->object;
+    } else if ((source = PyString_to_JSString(fn))) {
+        value = JSEvaluateScript(ctx, source, NULL, NULL, 1, &exception);
+        JSStringRelease(source);
+        if (!value || !(function = JSValueToObject(ctx, value, &exception))) {
+            JSException_to_PyErr(self, exception);
+            return NULL;
+        }
+    } else if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_TypeError, "the transform must be a JS function or its source");
+    }
+    if (!function)
+        return NULL;
+    if (!JSObjectIsFunction(ctx, function)) {
+        PyErr_SetString(PyExc_TypeError, "the transform is not a function");
+        return NULL;
+    }
+    JSValueProtect(ctx, function);
+    return function;
+}
+
+PyObject *
+PyJSContext_transformStream(PyJSContext *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"fn", "infile", "outfile", "batch", "vectorized", NULL};
+    JSGlobalContextRef ctx = self->context;
+    PyObject *fn, *infile, *outfile, *read = NULL, *chunk = NULL, *result = NULL;
+    Py_ssize_t batch = 256;
+    int vectorized = 0;
+    JSStream stream;
+    JSStreamBuffer pending = {NULL, 0, 0};
+    JSValueRef value, exception = NULL;
+    JSStringRef source;
+    uint64_t start = JSProfile_now();
+    double seconds;
+    char *line, *scan, *end;
+    size_t size, scanned = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|ni:transform_stream", kwlist,
+                                     &fn, &infile, &outfile, &batch, &vectorized))
+        return NULL;
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch must be at least 1");
+        return NULL;
+    }
+    memset(&stream, 0, sizeof(stream));
+    stream.context = self;
+    stream.vectorized = JSValueMakeBoolean(ctx, vectorized);
+    if (!(read = PyObject_GetAttrString(infile, "read")) ||
+        !(stream.write = PyObject_GetAttrString(outfile, "write")) ||
+        !(stream.fn = JSStream_function(self, fn))) {
+        goto finally;
+    }
+    source = JSStringCreateWithUTF8CString(JSStream_applySource);
+    value = JSEvaluateScript(ctx, source, NULL, NULL, 1, &exception);
+    JSStringRelease(source);
+    if (!value || !(stream.apply = JSValueToObject(ctx, value, &exception))) {
+        JSException_to_PyErr(self, exception);
+        goto finally;
+    }
+    JSValueProtect(ctx, stream.apply);
+    if (JSStream_newBatch(&stream) < 0)
+        goto finally;
+
+    for (;;) {
+        if (!(chunk = PyObject_CallFunction(read, "i", JSSTREAM_CHUNK)))
+            goto finally;
+        if (!PyString_Check(chunk)) {
+            PyErr_SetString(PyExc_TypeError, "infile.read() must return bytes");
+            goto finally;
+        }
+        size = PyString_GET_SIZE(chunk);
+        stream.bytes_in += size;
+        if (JSStreamBuffer_reserve(&pending, size) < 0)
+            goto finally;
+        memcpy(pending.data + pending.len, PyString_AS_STRING(chunk), size);
+        pending.len += size;
+        Py_CLEAR(chunk);
+        /* the first scanned bytes, of a partial line, hold no newline; not
+           scanning them again keeps a line longer than a chunk linear */
+        line = pending.data;
+        scan = pending.data + scanned;
+        while ((end = memchr(scan, '\n', pending.data + pending.len - scan))) {
+            if (JSStream_addLine(&stream, line, end - line, batch) < 0)
+                goto finally;
+            line = scan = end + 1;
+        }
+        if (!size) {
+            /* the last line may lack its newline */
+            if (line < pending.data + pending.len &&
+                JSStream_addLine(&stream, line, pending.data + pending.len - line, batch) < 0)
+                goto finally;
+            break;
+        }
+        if (line > pending.data) {
+            pending.len -= line - pending.data;
+            memmove(pending.data, line, pending.len);
+        }
+        scanned = pending.len;
+    }
+    if (JSStream_runBatch(&stream) < 0 || JSStream_flush(&stream) < 0)
+        goto finally;
+
+    seconds = (JSProfile_now() - start) / 1e9;
+    result = Py_BuildValue("{s:n,s:n,s:n,s:n,s:d,s:d,s:d}",
+        "records", stream.nrecords, "written", stream.nwritten,
+        "bytes_in", stream.bytes_in, "bytes_out", stream.bytes_out,
+        "seconds", seconds,
+        "records_per_sec", seconds > 0 ? stream.nrecords / seconds : 0.0,
+        "bytes_per_sec", seconds > 0 ? stream.bytes_in / seconds : 0.0);
+  finally:
+    Py_XDECREF(read);
+    Py_XDECREF(chunk);
+    Py_XDECREF(stream.write);
+    if (stream.fn) JSValueUnprotect(ctx, stream.fn);
+    if (stream.apply) JSValueUnprotect(ctx, stream.apply);
+    if (stream.records) JSValueUnprotect(ctx, stream.records);
+    PyMem_Free(pending.data);
+    PyMem_Free(stream.out.data);
+    return result;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+#include "jscore.h"
+
+/* bytes read from the input, and written to the output, at a time */
+#define JSSTREAM_CHUNK  65536
+
+/* Context.transform_stream(fn, infile, outfile, batch=256, vectorized=False):
+   parses each line of infile as JSON, calls fn (a function of the context,
+   or source evaluating to one) on the records and writes the results which
+   are not undefined to outfile as JSON lines; the records stay JS values.
+   fn is called per record, or with an array of up to batch records if
+   vectorized, returning an array of results. returns a dict of statistics,
+   or NULL with an exception set */
+PyObject *PyJSContext_transformStream(PyJSContext *self, PyObject *args, PyObject *kwds);
@@ -0,0 +1,510 @@
+#include "jscore.h"
+#include "jsobj.h"
+#include "conversions.h"
+#include "transfer.h"
+#include "jsstring.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Each value is a tag byte followed by its payload; lengths and counts are
+   native uint32s, numbers native doubles, strings UTF-16 code units */
+#define TAG_UNDEFINED   'u'
+#define TAG_NULL        'n'
+#define TAG_FALSE       'f'
+#define TAG_TRUE        't'
+#define TAG_NUMBER      'd'
+#define TAG_STRING      's'     /* length, units */
+#define TAG_ARRAY       'a'     /* count, values */
+#define TAG_OBJECT      'o'     /* count, (length, units, value) pairs */
+
+void
+JSTransferBuffer_release(JSTransferBuffer *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = buf->capacity = 0;
+}
+
+/* returns 0, or -1 if memory is exhausted */
+static int
+JSTransferBuffer_append(JSTransferBuffer *buf, const void *bytes, size_t size)
+{
+    if (buf->size + size > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 64;
+        char *data;
+        while (capacity < buf->size + size) {
+            capacity *= 2;
+        }
+        if (!(data = realloc(buf->data, capacity))) {
+            return -1;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, bytes, size);
+    buf->size += size;
+    return 0;
+}
+
+static int
+JSTransferBuffer_appendTag(JSTransferBuffer *buf, char tag)
+{
+    return JSTransferBuffer_append(buf, &tag, 1);
+}
+
+static int
+JSTransferBuffer_appendCount(JSTransferBuffer *buf, char tag, size_t count)
+{
+    uint32_t n = (uint32_t)count;
+    if (tag && JSTransferBuffer_appendTag(buf, tag) < 0) {
+        return -1;
+    }
+    return JSTransferBuffer_append(buf, &n, sizeof(n));
+}
+
+/* appends the length and units of a string, without a tag */
+static int
+JSTransferBuffer_appendString(JSTransferBuffer *buf, JSStringRef jsstr)
+{
+    size_t length = JSStringGetLength(jsstr);
+    if (JSTransferBuffer_appendCount(buf, 0, length) < 0) {
+        return -1;
+    }
+    return JSTransferBuffer_append(buf, JSStringGetCharactersPtr(jsstr),
+                                   length * sizeof(JSChar));
+}
+
+static int
+JSTransfer_read(const char **pos, const char *end, void *out, size_t size)
+{
+    if ((size_t)(end - *pos) < size) {
+        return -1;
+    }
+    memcpy(out, *pos, size);
+    *pos += size;
+    return 0;
+}
+
+/* reads the length and units of a string into a new JSStringRef;
+   returns NULL if the buffer is truncated */
+static JSStringRef
+JSTransfer_readString(const char **pos, const char *end)
+{
+    uint32_t length;
+    JSStringRef jsstr;
+    JSChar stackbuf[128];
+    JSChar *chars = stackbuf;
+
+    if (JSTransfer_read(pos, end, &length, sizeof(length)) < 0 ||
+        (size_t)(end - *pos) < length * sizeof(JSChar)) {
+        return NULL;
+    }
+    /* the units may not be aligned */
+    if (length > sizeof(stackbuf) / sizeof(JSChar) &&
+        !(chars = malloc(length * sizeof(JSChar)))) {
+        return NULL;
+    }
+    JSTransfer_read(pos, end, chars, length * sizeof(JSChar));
+    jsstr = JSStringCreateWithCharacters(chars, length);
+    if (chars != stackbuf) {
+        free(chars);
+    }
+    return jsstr;
+}
+
+/* Python side */
+
+static int
+JSTransfer_fromPyString(JSTransferBuffer *buf, PyObject *obj)
+{
+    JSStringRef jsstr = PyString_to_JSString(obj);
+    int rv;
+
+    if (!jsstr) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "cannot transfer the string");
+        }
+        return -1;
+    }
+    rv = JSTransferBuffer_appendString(buf, jsstr);
+    JSStringRelease(jsstr);
+    if (rv < 0) {
+        PyErr_NoMemory();
+    }
+    return rv;
+}
+
+static int
+JSTransfer_fromPyObjectAt(JSTransferBuffer *buf, PyObject *obj, int depth)
+{
+    double number;
+    Py_ssize_t i;
+
+    if (depth > JSTRANSFER_MAX_DEPTH) {
+        PyErr_SetString(PyExc_ValueError, "value is nested too deeply to transfer");
+        return -1;
+    }
+    if (obj == Py_None) {
+        if (JSTransferBuffer_appendTag(buf, TAG_UNDEFINED) < 0)
+            goto nomem;
+        return 0;
+    }
+    if (PyBool_Check(obj)) {
+        if (JSTransferBuffer_appendTag(buf, obj == Py_True ? TAG_TRUE : TAG_FALSE) < 0)
+            goto nomem;
+        return 0;
+    }
+    if (PyInt_Check(obj) || PyLong_Check(obj) || PyFloat_Check(obj)) {
+        if ((number = PyFloat_AsDouble(obj)) == -1.0 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (JSTransferBuffer_appendTag(buf, TAG_NUMBER) < 0 ||
+            JSTransferBuffer_append(buf, &number, sizeof(number)) < 0)
+            goto nomem;
+        return 0;
+    }
+    if (PyString_Check(obj) || PyUnicode_Check(obj)) {
+        if (JSTransferBuffer_appendTag(buf, TAG_STRING) < 0)
+            goto nomem;
+        return JSTransfer_fromPyString(buf, obj);
+    }
+    if (PyJSString_Check(obj)) {
+        if (JSTransferBuffer_appendTag(buf, TAG_STRING) < 0 ||
+            JSTransferBuffer_appendString(buf, ((PyJSString *)obj)->string) < 0)
+            goto nomem;
+        return 0;
+    }
+    if (PyList_Check(obj) || PyTuple_Check(obj)) {
+        Py_ssize_t size = PySequence_Fast_GET_SIZE(obj);
+        if (JSTransferBuffer_appendCount(buf, TAG_ARRAY, size) < 0)
+            goto nomem;
+        for (i = 0; i < size; i++) {
+            if (JSTransfer_fromPyObjectAt(buf, PySequence_Fast_GET_ITEM(obj, i), depth + 1) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    if (PyDict_Check(obj)) {
+        PyObject *key, *value;
+        i = 0;
+        if (JSTransferBuffer_appendCount(buf, TAG_OBJECT, PyDict_Size(obj)) < 0)
+            goto nomem;
+        while (PyDict_Next(obj, &i, &key, &value)) {
+            if (!PyString_Check(key) && !PyUnicode_Check(key)) {
+                PyErr_SetString(PyExc_TypeError, "only dicts with string keys can be transferred");
+                return -1;
+            }
+            if (JSTransfer_fromPyString(buf, key) < 0 ||
+                JSTransfer_fromPyObjectAt(buf, value, depth + 1) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    if (PyObject_TypeCheck(obj, &jscore_PyJSObjectType)) {
+        PyJSObject *jsobj = (PyJSObject *)obj;
+        JSValueRef exception = NULL;
+        if (!jsobj->object) {
+            if (JSTransferBuffer_appendTag(buf, TAG_NULL) < 0)
+                goto nomem;
+            return 0;
+        }
+        /* a value of a local context is serialized from JS directly */
+        if (JSTransfer_fromJSValue(buf, jsobj->context->context, jsobj->object, &exception) < 0) {
+            JSException_to_PyErr(jsobj->context, exception);
+            return -1;
+        }
+        return 0;
+    }
+    PyErr_Format(PyExc_TypeError, "cannot transfer '%.200s' objects",
+        Py_TYPE(obj)->tp_name);
+    return -1;
+  nomem:
+    PyErr_NoMemory();
+    return -1;
+}
+
+int
+JSTransfer_fromPyObject(JSTransferBuffer *buf, PyObject *obj)
+{
+    return JSTransfer_fromPyObjectAt(buf, obj, 0);
+}
+
+static PyObject *
+JSTransfer_readPyString(const char **pos, const char *end)
+{
+    JSStringRef jsstr = JSTransfer_readString(pos, end);
+    PyObject *result;
+
+    if (!jsstr) {
+        PyErr_SetString(PyExc_ValueError, "truncated transfer buffer");
+        return NULL;
+    }
+    result = JSString_to_PyString(jsstr);
+    JSStringRelease(jsstr);
+    return result;
+}
+
+PyObject *
+JSTransfer_toPyObject(const char **pos, const char *end, int flags)
+{
+    PyObject *result = NULL, *key, *value;
+    uint32_t i, count;
+    double number;
+    char tag;
+
+    if (JSTransfer_read(pos, end, &tag, 1) < 0) {
+        goto truncated;
+    }
+    switch (tag) {
+        case TAG_UNDEFINED:
+            Py_RETURN_NONE;
+        case TAG_NULL:
+            Py_INCREF(PyJSNull);
+            return (PyObject *)PyJSNull;
+        case TAG_FALSE:
+            Py_RETURN_FALSE;
+        case TAG_TRUE:
+            Py_RETURN_TRUE;
+        case TAG_NUMBER:
+            if (JSTransfer_read(pos, end, &number, sizeof(number)) < 0)
+                goto truncated;
+            return JSNumber_to_PyNumber(flags, number);
+        case TAG_STRING:
+            return JSTransfer_readPyString(pos, end);
+        case TAG_ARRAY:
+            if (JSTransfer_read(pos, end, &count, sizeof(count)) < 0)
+                goto truncated;
+            if (!(result = PyList_New(count)))
+                return NULL;
+            for (i = 0; i < count; i++) {
+                if (!(value = JSTransfer_toPyObject(pos, end, flags))) {
+                    Py_DECREF(result);
+                    return NULL;
+                }
+                PyList_SET_ITEM(result, i, value);
+            }
+            return result;
+        case TAG_OBJECT:
+            if (JSTransfer_read(pos, end, &count, sizeof(count)) < 0)
+                goto truncated;
+            if (!(result = PyDict_New()))
+                return NULL;
+            for (i = 0; i < count; i++) {
+                if (!(key = JSTransfer_readPyString(pos, end))) {
+                    Py_DECREF(result);
+                    return NULL;
+                }
+                value = JSTransfer_toPyObject(pos, end, flags);
+                if (!value || PyDict_SetItem(result, key, value) < 0) {
+                    Py_DECREF(key);
+                    Py_XDECREF(value);
+                    Py_DECREF(result);
+                    return NULL;
+                }
+                Py_DECREF(key);
+                Py_DECREF(value);
+            }
+            return result;
+    }
+  truncated:
+    PyErr_SetString(PyExc_ValueError, "truncated transfer buffer");
+    return NULL;
+}
+
+/* JS side */
+
+static int
+JSTransfer_fromJSValueAt(JSTransferBuffer *buf, JSContextRef ctx, JSValueRef value,
+                         int depth, JSValueRef *exception)
+{
+    JSObjectRef object;
+    JSStringRef jsstr;
+    double number;
+    size_t i, count;
+    int rv;
+
+    if (depth > JSTRANSFER_MAX_DEPTH) {
+        set_JSError(ctx, "value is nested too deeply (or cyclic) to transfer", exception);
+        return -1;
+    }
+    switch (JSValueGetType(ctx, value)) {
+        case kJSTypeUndefined:
+            rv = JSTransferBuffer_appendTag(buf, TAG_UNDEFINED);
+            break;
+        case kJSTypeNull:
+            rv = JSTransferBuffer_appendTag(buf, TAG_NULL);
+            break;
+        case kJSTypeBoolean:
+            rv = JSTransferBuffer_appendTag(buf,
+                JSValueToBoolean(ctx, value) ? TAG_TRUE : TAG_FALSE);
+            break;
+        case kJSTypeNumber:
+            number = JSValueToNumber(ctx, value, NULL);
+            rv = JSTransferBuffer_appendTag(buf, TAG_NUMBER);
+            if (rv == 0) rv = JSTransferBuffer_append(buf, &number, sizeof(number));
+            break;
+        case kJSTypeString:
+            if (!(jsstr = JSValueToStringCopy(ctx, value, exception))) {
+                return -1;
+            }
+            rv = JSTransferBuffer_appendTag(buf, TAG_STRING);
+            if (rv == 0) rv = JSTransferBuffer_appendString(buf, jsstr);
+            JSStringRelease(jsstr);
+            break;
+        case kJSTypeObject:
+            object = JSValueToObject(ctx, value, exception);
+            if (!object) {
+                return -1;
+            }
+            if (JSObjectIsFunction(ctx, object) ||
+                JSValueIsObjectOfClass(ctx, object, JSPyClass)) {
+                /* Python objects cannot be touched without the GIL */
+                set_JSError(ctx, "cannot transfer functions or Python objects", exception);
+                return -1;
+            }
+            if (JSValueIsArray(ctx, object)) {
+                JSValueRef length = JSObjectGetProperty(ctx, object, JSLengthString, exception);
+                if (!length) {
+                    return -1;
+                }
+                count = (size_t)JSValueToNumber(ctx, length, NULL);
+                if (JSTransferBuffer_appendCount(buf, TAG_ARRAY, count) < 0)
+                    goto nomem;
+                for (i = 0; i < count; i++) {
+                    JSValueRef item = JSObjectGetPropertyAtIndex(ctx, object, (unsigned)i, exception);
+                    if (!item || JSTransfer_fromJSValueAt(buf, ctx, item, depth + 1, exception) < 0)
+                        return -1;
+                }
+            } else {
+                JSPropertyNameArrayRef names = JSObjectCopyPropertyNames(ctx, object);
+                count = JSPropertyNameArrayGetCount(names);
+                rv = JSTransferBuffer_appendCount(buf, TAG_OBJECT, count);
+                for (i = 0; rv == 0 && i < count; i++) {
+                    JSStringRef name = JSPropertyNameArrayGetNameAtIndex(names, i);
+                    JSValueRef item = JSObjectGetProperty(ctx, object, name, exception);
+                    if (!item) {
+                        rv = -2;
+                    } else if ((rv = JSTransferBuffer_appendString(buf, name)) == 0 &&
+                               JSTransfer_fromJSValueAt(buf, ctx, item, depth + 1, exception) < 0) {
+                        rv = -2;
+                    }
+                }
+                JSPropertyNameArrayRelease(names);
+                if (rv == -2) {
+                    return -1;
+                }
+            }
+            rv = 0;
+            break;
+        default:
+            set_JSError(ctx, "cannot transfer symbols or BigInts", exception);
+            return -1;
+    }
+    if (rv < 0) {
+        goto nomem;
+    }
+    return 0;
+  nomem:
+    set_JSError(ctx, "out of memory", exception);
+    return -1;
+}
+
+int
+JSTransfer_fromJSValue(JSTransferBuffer *buf, JSContextRef ctx, JSValueRef value,
+                       JSValueRef *exception)
+{
+    return JSTransfer_fromJSValueAt(buf, ctx, value, 0, exception);
+}
+
+JSValueRef
+JSTransfer_toJSValue(JSContextRef ctx, const char **pos, const char *end,
+                     JSValueRef *exception)
+{
+    JSObjectRef object;
+    JSValueRef value, error = NULL;
+    JSStringRef jsstr;
+    uint32_t i, count;
+    double number;
+    char tag;
+
+    if (JSTransfer_read(pos, end, &tag, 1) < 0) {
+        goto truncated;
+    }
+    switch (tag) {
+        case TAG_UNDEFINED:
+            return JSValueMakeUndefined(ctx);
+        case TAG_NULL:
+            return JSValueMakeNull(ctx);
+        case TAG_FALSE:
+            return JSValueMakeBoolean(ctx, false);
+        case TAG_TRUE:
+            return JSValueMakeBoolean(ctx, true);
+        case TAG_NUMBER:
+            if (JSTransfer_read(pos, end, &number, sizeof(number)) < 0)
+                goto truncated;
+            return JSValueMakeNumber(ctx, number);
+        case TAG_STRING:
+            if (!(jsstr = JSTransfer_readString(pos, end)))
+                goto truncated;
+            value = JSValueMakeString(ctx, jsstr);
+            JSStringRelease(jsstr);
+            return value;
+        case TAG_ARRAY:
+            if (JSTransfer_read(pos, end, &count, sizeof(count)) < 0)
+                goto truncated;
+            /* the items are kept alive by the array, which is on the stack */
+            if (!(object = JSObjectMakeArray(ctx, 0, NULL, exception)))
+                return NULL;
+            for (i = 0; i < count; i++) {
+                if (!(value = JSTransfer_toJSValue(ctx, pos, end, exception)))
+                    return NULL;
+                JSObjectSetPropertyAtIndex(ctx, object, i, value, &error);
+                if (error) {
+                    *exception = error;
+                    return NULL;
+                }
+            }
+            return object;
+        case TAG_OBJECT:
+            if (JSTransfer_read(pos, end, &count, sizeof(count)) < 0)
+                goto truncated;
+            object = JSObjectMake(ctx, NULL, NULL);
+            for (i = 0; i < count; i++) {
+                if (!(jsstr = JSTransfer_readString(pos, end)))
+                    goto truncated;
+                if (!(value = JSTransfer_toJSValue(ctx, pos, end, exception))) {
+                    JSStringRelease(jsstr);
+                    return NULL;
+                }
+                JSObjectSetProperty(ctx, object, jsstr, value, kJSPropertyAttributeNone, &error);
+                JSStringRelease(jsstr);
+                if (error) {
+                    *exception = error;
+                    return NULL;
+                }
+            }
+            return object;
+    }
+  truncated:
+    set_JSError(ctx, "truncated transfer buffer", exception);
+    return NULL;
+}
+
+char *
+JSException_to_UTF8(JSContextRef ctx, JSValueRef exception)
+{
+    JSStringRef jsstr = JSValueToStringCopy(ctx, exception, NULL);
+    size_t size;
+    char *message;
+
+    if (!jsstr) {
+        return strdup("unknown JavaScript error");
+    }
+    size = JSStringGetMaximumUTF8CStringSize(jsstr);
+    if ((message = malloc(size))) {
+        JSStringGetUTF8CString(jsstr, message, size);
+    }
+    JSStringRelease(jsstr);
+    return message;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Python.h>
+#ifdef __APPLE__
+#include <JavaScriptCore/JavaScriptCore.h>
+#else
+#include <JavaScriptCore/JavaScript.h>
+#endif
+
+/* A context-independent serialization of a value: undefined/None, null,
+   booleans, numbers, strings, arrays/lists and objects/dicts of them.
+   Values are moved between Python and contexts on other threads in this
+   form; the JS side of the conversion does not use the Python API, so it
+   may run without the GIL */
+typedef struct JSTransferBuffer {
+    char            *data;      /* malloc'd */
+    size_t          size;
+    size_t          capacity;
+} JSTransferBuffer;
+
+/* deeper values (or cycles) are rejected */
+#define JSTRANSFER_MAX_DEPTH    64
+
+#define JSTransferBuffer_INIT   {NULL, 0, 0}
+
+void JSTransferBuffer_release(JSTransferBuffer *);
+
+/* appends the serialization of obj;
+   if an error occurs, sets a Python exception and returns -1 */
+int JSTransfer_fromPyObject(JSTransferBuffer *, PyObject *obj);
+
+/* reads the value at *pos, advancing it; in INT_NUMBERS mode (flags)
+   integral numbers become ints;
+   if an error occurs, sets a Python exception and returns NULL */
+PyObject *JSTransfer_toPyObject(const char **pos, const char *end, int flags);
+
+/* appends the serialization of value; does not need the GIL;
+   if an error occurs, sets *exception and returns -1 */
+int JSTransfer_fromJSValue(JSTransferBuffer *, JSContextRef, JSValueRef value,
+                           JSValueRef *exception);
+
+/* reads the value at *pos, advancing it; does not need the GIL;
+   if an error occurs, sets *exception and returns NULL */
+JSValueRef JSTransfer_toJSValue(JSContextRef, const char **pos, const char *end,
+                                JSValueRef *exception);
+
+/* returns a malloc'd UTF-8 rendering of a JS exception, or NULL if memory
+   is exhausted; does not need the GIL */
+char *JSException_to_UTF8(JSContextRef, JSValueRef exception);
@@ -1,5 +1,17 @@
+import array
+import gc
 import jscore
+import os
+import StringIO
+import tempfile
+import time
 import unittest
+import weakref
+
+try:
+    import concurrent.futures
+except ImportError:
+    concurrent = None
 
 class TestBasic(unittest.TestCase):
     def testContextCreate(self):
@@ -41,6 +53,123 @@ class TestBasic(unittest.TestCase):
         self.assertEqual(g.eval(u"'\u263a'"), u'\u263a')
         self.assertEqual(g.eval("'\\u263a'"), u'\u263a')
 
+class TestLazyStrings(unittest.TestCase):
+    def testHandles(self):
+        c = jscore.Context()
+        s = c.eval('"<p>" + "\u263a".repeat(3) + "</p>"', lazy_strings=True)
+        self.assert_(isinstance(s, jscore.JSString))
+        self.assertEqual(len(s), 10)
+        self.assert_(isinstance(s[3:6], jscore.JSString))
+        self.assertEqual(s[3:6], u'\u263a' * 3)
+        self.assertEqual(s[0], u'<')
+        self.assertEqual(unicode(s), u'<p>' + u'\u263a' * 3 + u'</p>')
+        self.assertEqual({s: 1}[unicode(s)], 1)
+        self.assertEqual(c.eval('"abc"'), u'abc')
+
+    def testPassThrough(self):
+        c = jscore.Context(flags=jscore.LAZY_STRINGS)
+        g = c.globalObject
+        g.eval('function render() { return "<b>x</b>"; }'
+               'function strip(s) { return s.replace(/<[^>]*>/g, ""); }')
+        html = g.render()
+        self.assert_(isinstance(html, jscore.JSString))
+        self.assertEqual(g.strip(html), 'x')
+        self.assertEqual(jscore.JSString(u'abc'), jscore.JSString('abc'))
+
+class TestNumbers(unittest.TestCase):
+    def testIntNumbers(self):
+        g = jscore.Context(flags=jscore.INT_NUMBERS).globalObject
+        self.assertEqual(type(g.eval('1')), int)
+        self.assertEqual(type(g.eval('1.5')), float)
+        self.assertEqual(type(g.eval('-0')), float)
+        self.assertEqual(type(g.eval('NaN')), float)
+        self.assertEqual(g.eval('Math.pow(2, 53) - 1'), 2**53 - 1)
+        self.assertEqual(type(g.eval('Math.pow(2, 53)')), float)
+
+    def testIntArguments(self):
+        g = jscore.Context().globalObject
+        g.val = 2**31
+        self.assert_(g.eval('val === 2147483648'))
+        g.val = long(2**53 - 1)
+        self.assert_(g.eval('val === 9007199254740991'))
+
+    def testBigInt(self):
+        if not jscore.HAVE_BIGINT:
+            self.skipTest('built without JSBigInt')
+        g = jscore.Context().globalObject
+        g.val = 10**30
+        self.assertEqual(g.eval('typeof val'), 'bigint')
+        self.assertEqual(g.val, 10**30)
+        self.assertEqual(g.eval('-(2n ** 70n)'), -2**70)
+        for n in (2**60, -(2**60)):
+            g.val = n
+            self.assertEqual(g.eval('typeof val'), 'bigint')
+            self.assertEqual(g.val, n)
+
+class TestScripts(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp(suffix='.js')
+        os.write(fd, 'var loaded = "\xe2\x98\xba"; 6 * 7;')
+        os.close(fd)
+
+    def tearDown(self):
+        os.unlink(self.path)
+
+    def testEvalFile(self):
+        c = jscore.Context()
+        self.assertEqual(c.eval_file(self.path), 42)
+        self.assertEqual(c.globalObject.loaded, u'\u263a')
+        self.assertRaises(IOError, c.eval_file, self.path + '.missing')
+
+    def testScriptCache(self):
+        script = jscore.Script(self.path)
+        self.assert_(jscore.Script(self.path) is script)
+        self.assertEqual(script.path, self.path)
+        self.assertEqual(jscore.Context().eval(script), 42)
+        f = open(self.path, 'w')
+        f.write('1 + 1;')
+        f.close()
+        self.assert_(jscore.Script(self.path) is not script)
+        self.assertEqual(jscore.Context().eval_file(self.path), 2)
+        # a same-size rewrite; the mtime is set, as the clock may be coarse
+        script = jscore.Script(self.path)
+        mtime = os.stat(self.path).st_mtime
+        f = open(self.path, 'w')
+        f.write('2 + 2;')
+        f.close()
+        os.utime(self.path, (mtime + 1, mtime + 1))
+        self.assertEqual(jscore.Context().eval(jscore.Script(self.path)), 4)
+
+    def testScriptCacheRealPath(self):
+        cwd, other = os.getcwd(), tempfile.mkdtemp()
+        name = os.path.basename(self.path)
+        f = open(os.path.join(other, name), 'w')
+        f.write('"other";')
+        f.close()
+        script = jscore.Script(self.path)
+        try:
+            os.chdir(os.path.dirname(self.path))
+            alias = jscore.Script(name)
+            self.assertEqual(alias.path, name)
+            c = jscore.Context()
+            self.assertEqual(c.eval(alias), 42)
+            c.eval_file(name)
+            self.assertEqual(script.path, self.path)
+            os.chdir(other)
+            self.assertEqual(jscore.Context().eval(jscore.Script(name)), 'other')
+        finally:
+            os.chdir(cwd)
+            os.unlink(os.path.join(other, name))
+            os.rmdir(other)
+
+    def testSourceURL(self):
+        f = open(self.path, 'w')
+        f.write('function f() { throw new Error("x"); }')
+        f.close()
+        c = jscore.Context()
+        c.eval_file(self.path)
+        self.assertEqual(c.eval('try { f() } catch (e) { e.sourceURL }'), self.path)
+
 class TestJSProxyObjects(unittest.TestCase):
     def testProperties(self):
         g = jscore.Context().globalObject
@@ -65,6 +194,16 @@ class TestJSProxyObjects(unittest.TestCase):
         g.eval('foo = { bar: function() { return this.baz }, baz: 42};')
         self.assertEqual(g.foo.bar(), 42)
 
+    def testCallMethod(self):
+        g = jscore.Context().globalObject
+        g.eval('foo = {baz: 40, bar: function (x) { return this.baz + x; },'
+               '       make: function () { return function () { return this === foo; }; }};')
+        self.assertEqual(g.foo.js_callmethod('bar', 2), 42)
+        # results are unbound: calling them does not pass foo as this
+        self.assertEqual(g.foo.js_callmethod('make')(), False)
+        self.assertRaises(TypeError, g.foo.js_callmethod, 'baz')
+        self.assertRaises(TypeError, g.foo.js_callmethod, 'missing')
+
     def testIteration(self):
         g = jscore.Context().globalObject
         g.eval('foo = {a:1, b:2, c:3}; bar = ["a", "b", "c"]; baz = Object()')
@@ -72,6 +211,26 @@ class TestJSProxyObjects(unittest.TestCase):
         self.assertEqual(set(g.bar), set(['0', '1', '2']))
         self.assert_(not set(g.baz))
 
+    def testIterables(self):
+        c = jscore.Context()
+        g = c.globalObject
+        g.eval('function* gen(n) { for (var i = 0; i < n; i++) yield i; }'
+               'm = new Map([["a", 1], ["b", 2]]); s = new Set([3, 4]);')
+        self.assertEqual(list(g.gen(10)), range(10))
+        self.assertEqual(list(g.gen(10).js_iter(batch=3)), range(10))
+        self.assertEqual([p.js_get_many([0, 1]) for p in g.m], [('a', 1), ('b', 2)])
+        self.assertEqual(list(g.s), [3, 4])
+        self.assertEqual(list(g.eval('[5, 6]').js_iter()), [5, 6])
+        self.assertRaises(TypeError, g.eval('({})').js_iter)
+        self.assertEqual(g.eval('({iter: 1})').iter, 1)
+        g.eval('function* bad() { yield 1; throw new Error("x"); }')
+        it = g.bad().js_iter(batch=3)
+        self.assertRaises(jscore.error, next, it)
+        self.assertRaises(StopIteration, next, it)
+        c.iter_batch = 2
+        self.assertEqual(list(g.gen(5)), range(5))
+        self.assertRaises(ValueError, setattr, c, 'iter_batch', 0)
+
     def testMapping(self):
         g = jscore.Context().globalObject
         g.eval('a=1')
@@ -85,6 +244,121 @@ class TestJSProxyObjects(unittest.TestCase):
         self.assert_(not 'a' in g)
         self.assertEqual(g['a'], None)
 
+    def testGetMany(self):
+        g = jscore.Context().globalObject
+        g.eval('a = {b: 1, c: "x", d: undefined}; l = [4, 5]')
+        self.assertEqual(g.a.js_get_many(['b', 'c', 'd', 'e']), (1, 'x', None, None))
+        self.assertEqual(g.a.js_get_many(('e',), default=0), (0,))
+        self.assertEqual(g.l.js_get_many([1, 0, 2, 'length'], -1), (5, 4, -1, 2))
+
+    def testUpdate(self):
+        g = jscore.Context().globalObject
+        g.eval('a = {b: 1}')
+        g.a.js_update({'b': 2, 'c': 3}, d=4)
+        self.assertEqual(g.eval('a.b + a.c + a.d'), 9)
+        g.a.js_update([('e', 'x')])
+        self.assertEqual(g.eval('a.e'), 'x')
+        # JS properties named like Python methods stay reachable
+        g.eval('h = {n: 0, update: function (x) { this.n += x; return this; }}')
+        self.assertEqual(g.h.update(2).n, 2)
+        g.h.get_many = 5
+        self.assertEqual(g.h.get_many, 5)
+
+    def testMap(self):
+        g = jscore.Context().globalObject
+        g.eval('function sq(x) { return x * x; }; function add(a, b) { return a + b; }')
+        self.assertEqual(list(g.sq.js_map(range(5))), [0, 1, 4, 9, 16])
+        self.assertEqual(list(g.sq.js_map(xrange(100), chunk_size=7)),
+                         [x * x for x in xrange(100)])
+        self.assertEqual(list(g.add.js_starmap([(1, 2), (3, 4)])), [3, 7])
+        self.assertEqual(list(g.sq.js_map([])), [])
+        # Array.prototype.map is not shadowed
+        self.assertEqual(g.eval('[1, 2]').map(g.sq).join(), '1,4')
+
+    def testCloneFrom(self):
+        a, b = jscore.Context(), jscore.Context()
+        a.eval('data = {name: "ref", xs: [1, 2, {k: true}],'
+               '        bytes: new Float64Array([0.5, 1.5]).subarray(1)};'
+               'data.self = data; data.again = data.xs;')
+        copy = b.clone_from(a.globalObject.data)
+        b.globalObject.copy = copy
+        self.assert_(b.eval('copy.self === copy && copy.again === copy.xs'))
+        self.assert_(b.eval('copy.xs[2].k && copy.name == "ref"'))
+        self.assert_(b.eval('copy.bytes instanceof Float64Array && '
+                            'copy.bytes.length == 1 && copy.bytes[0] == 1.5'))
+        self.assert_(b.cloned_bytes > 8)
+        self.assertRaises(ValueError, setattr, b.globalObject, 'x',
+                          a.globalObject.data)
+        self.assertRaises(TypeError, b.clone_from, a.eval('(function () {})'))
+
+    def testAccessor(self):
+        c = jscore.Context()
+        resp = c.eval('({data: {items: [{meta: {id: 1}}, {meta: {id: 2}}, {}],'
+                      '        grid: [[1, 2], [3]]}})')
+        ids = c.accessor('data.items[*].meta.id')
+        self.assertEqual(ids(resp), [1, 2, None])
+        self.assertEqual(ids(resp, default=0), [1, 2, 0])
+        self.assertEqual(c.accessor('data.items[1].meta.id')(resp), 2)
+        self.assertEqual(c.accessor('data.grid[*][*]')(resp), [[1, 2], [3]])
+        self.assertEqual(c.accessor('data.missing.id')(resp), None)
+        roots = c.eval('[{a: {b: 1}}, {a: {b: 2}}]')
+        self.assertEqual(c.accessor('a.b').map(roots), [1, 2])
+        self.assertEqual(c.accessor('a.b').map([roots[1], roots[0]]), [2, 1])
+        for path in ('', 'a..b', 'a[', 'a[x]', '.a', 'a.'):
+            self.assertRaises(ValueError, c.accessor, path)
+
+    def testBuffers(self):
+        c = jscore.Context()
+        xs = c.eval('[0.5, 1, 2.5]')
+        self.assertEqual(xs.js_to_buffer(), array.array('d', [0.5, 1, 2.5]))
+        self.assertEqual(xs.js_to_buffer('f').typecode, 'f')
+        self.assertEqual(c.eval('new Int32Array([1, -2, 3]).subarray(1)').js_to_buffer('i'),
+                         array.array('i', [-2, 3]))
+        out = array.array('h', [0, 0, 0])
+        self.assert_(c.eval('new Uint8Array([1, 2, 3])').js_to_buffer(out=out) is out)
+        self.assertEqual(list(out), [1, 2, 3])
+        self.assertRaises(ValueError, xs.js_to_buffer, out=array.array('d', [0]))
+        self.assertRaises(TypeError, c.eval('[1, "2"]').js_to_buffer)
+        self.assertRaises(OverflowError, c.eval('[256]').js_to_buffer, 'B')
+        self.assertRaises(TypeError, c.eval('({})').js_to_buffer)
+        self.assertRaises(ValueError, xs.js_to_buffer, 'q')
+        self.assertEqual(c.eval('({to_buffer: 1})').to_buffer, 1)
+        ys = c.array_from_buffer(array.array('d', [1.5, 2.5]))
+        self.assert_(c.eval('(function (a) { return a instanceof Float64Array && '
+                            'a[1] == 2.5; })')(ys))
+        ys = c.array_from_buffer(bytearray('\x01\x02'), 'i')
+        self.assertEqual(ys.js_to_buffer('i'), array.array('i', [1, 2]))
+
+    def testIdentity(self):
+        c = jscore.Context()
+        c.eval('var o = {valueOf: function () { return 1; }}, p = {}')
+        g = c.globalObject
+        self.assert_(g.o == g.o and g.o is not g.o)
+        self.assertEqual(hash(g.o), hash(g.o))
+        self.assert_(g.o != g.p)
+        self.assertEqual(len(set([g.o, g.o, g.p])), 2)
+        self.assertEqual({g.o: 1}.get(c.eval('o')), 1)
+        self.assert_(g.o.js_equals(1) and not g.o.js_equals(2))
+        self.assert_(g.p.js_equals(g.p) and not g.p.js_equals(c.eval('({})')))
+        # a method bound to o is not the bare function
+        c.eval('o.f = function () { return this; }')
+        self.assert_(g.o.f == g.o.f and g.o.f != c.eval('o.f'))
+        self.assertEqual(len(set([g.o.f, g.o.f, c.eval('o.f')])), 2)
+
+    def testMapBatch(self):
+        g = jscore.Context().globalObject
+        g.eval('function sqs(a) { return a.map(function (x) { return x * x; }); }')
+        g.eval('function adds(a) { return a.map(function (p) { return p[0] + p[1]; }); }')
+        self.assertEqual(list(g.sqs.js_map(range(10), chunk_size=3, batch=True)),
+                         [x * x for x in range(10)])
+        self.assertEqual(list(g.adds.js_starmap([(1, 2), (3, 4)], batch=True)), [3, 7])
+        g.eval('function fails(x) { if (x == 2) throw new Error("x"); return x; }')
+        it = g.fails.js_map(range(5))
+        self.assertRaises(jscore.error, list, it)
+        self.assertEqual(list(it), [])
+        self.assertRaises(ValueError, list, g.eval('(function (a) { return [1]; })').js_map(
+            range(3), batch=True))
+
 class TestPyProxyObjects(unittest.TestCase):
     def testFunctions(self):
         g = jscore.Context().globalObject
@@ -119,10 +393,14 @@ class TestPyProxyObjects(unittest.TestCase):
         self.assertEqual(o.a, 42)
         self.assert_(g.eval('o.a == 42'))
         
+        # the flags are read when an object is converted
         C.__jsflags__ = jscore.ALLOW_PRIVATE_ATTR
+        self.assert_(g.eval('o._p == undefined'))
+        g.o = o
         self.assert_(g.eval('o._p == 42'))
-        
+
         C.__jsflags__ = jscore.ALLOW_MODIFY_ATTR
+        g.o = o
         g.eval('o.a = 1')
         self.assert_(g.eval('o.a == 1'))
         self.assertEqual(o.a, 1)
@@ -134,13 +412,451 @@ class TestPyProxyObjects(unittest.TestCase):
         self.assert_(g.eval('o._p == undefined'))
         
         C.__jsflags__ = jscore.ALLOW_PRIVATE_ATTR
+        g.o = o
         self.assert_(g.eval('o._p == 42'))
-        
+
         C.__jsflags__ = jscore.ALLOW_PRIVATE_ATTR | jscore.ALLOW_MODIFY_ATTR
+        g.o = o
         g.eval('o._p = 1')
         self.assert_(g.eval('o._p == 1'))
         self.assertEqual(o._p, 1)
 
+    def testPolicy(self):
+        c = jscore.Context(jscore.STRICT_ACCESS)
+        g = c.globalObject
+
+        class C(object):
+            def __init__(self):
+                self.a, self._p = 1, 2
+        class D(C):
+            pass
+        g.o = C()
+        self.assert_(g.eval('o.a === undefined && !("a" in o)'))
+        self.assertRaises(TypeError, g.eval, 'o()')
+
+        c.allow(C)
+        g.o, g.d = C(), D()
+        self.assertEqual(g.eval('o.a + d.a'), 2)
+        self.assert_(g.eval('o._p === undefined'))
+        g.eval('o.a = 5')
+        self.assertEqual(g.o.a, 1)
+
+        c.allow(D, write=True, private=True)
+        g.d = d = D()
+        g.eval('d._p = d.a + 1; o.a = 7')
+        self.assertEqual((d._p, g.o.a), (2, 1))
+        g.len = len
+        self.assertRaises(TypeError, g.eval, 'len([])')
+        c.allow(type(len), read=False)
+        g.len = len
+        self.assertEqual(g.eval('len([1, 2])'), 2)
+
+    def testIterables(self):
+        c = jscore.Context()
+        g = c.globalObject
+        g.eval('function collect(it) { var out = []; for (var x of it) out.push(x); return out; }')
+        c.iter_batch = 3
+        self.assertEqual(list(g.collect(iter(xrange(10))).js_iter()), range(10))
+        self.assertEqual(list(g.collect((x * 2 for x in range(4))).js_iter()), [0, 2, 4, 6])
+        self.assertEqual(g.eval('(function (d) { return Array.from(d).length; })')({'a': 1}), 1)
+        def failing():
+            yield 1
+            raise ValueError('stop')
+        self.assertRaises(ValueError, g.collect, failing())
+
+    def testDicts(self):
+        g = jscore.Context().globalObject
+        d = g.cfg = {'timeout': 5, 'name': 'x', u'\u263a': 1}
+        self.assert_(g.eval('cfg.timeout === 5'))
+        self.assert_(g.eval('cfg["\\u263a"] === 1'))
+        self.assert_(g.eval('cfg.missing === undefined'))
+        self.assert_(g.eval('"timeout" in cfg && !("missing" in cfg)'))
+        self.assert_(g.eval('typeof cfg.keys == "function"'))
+        g.eval('cfg.timeout = 1; delete cfg.name')
+        self.assertEqual(d, {'timeout': 5, 'name': 'x', u'\u263a': 1})
+
+        class D(dict):
+            __jsflags__ = jscore.ALLOW_MODIFY_ATTR
+        d = g.cfg = D(timeout=5, name='x')
+        g.eval('cfg.timeout = 1; delete cfg.name; delete cfg.missing')
+        self.assertEqual(d, {'timeout': 1})
+
+        class Defaults(dict):
+            def __missing__(self, key):
+                if key == 'bad':
+                    raise ValueError(key)
+                return 'default'
+        g.cfg = Defaults(timeout=5)
+        self.assert_(g.eval('cfg.timeout === 5 && cfg.other === "default"'))
+        self.assertRaises(ValueError, g.eval, 'cfg.bad')
+
+    def testConstructors(self):
+        g = jscore.Context().globalObject
+        class Point(object):
+            def __init__(self, x, y):
+                self.x, self.y = x, y
+        g.Point = Point
+        p = g.eval('p = new Point(1, 2)')
+        self.assert_(isinstance(p, Point))
+        self.assertEqual((p.x, p.y), (1, 2))
+        self.assert_(g.eval('p instanceof Point'))
+        self.assert_(g.eval('!({} instanceof Point)'))
+        g.eval('function make() { return new Point(3, 4); }')
+        self.assertEqual(g.make().y, 4)
+
+class TestExports(unittest.TestCase):
+    def testExport(self):
+        class Metrics(object):
+            def __init__(self):
+                self.count = 0
+                self.name = 'm'
+            def incr(self, n):
+                self.count += n
+                return self.count
+            def other(self):
+                return 'dynamic'
+        jscore.export(Metrics, methods=['incr'], props=['count', 'name'],
+                      writable=['count'])
+        g = jscore.Context().globalObject
+        m = g.m = Metrics()
+        self.assertEqual(g.eval('m.incr(2); m.incr(3)'), 5)
+        self.assertEqual(g.eval('m.count'), 5)
+        g.eval('m.count = 10; m.name = "x"')
+        self.assertEqual((m.count, m.name), (10, 'm'))
+        self.assertEqual(g.eval('m.other()'), 'dynamic')
+        self.assert_(g.eval('m instanceof Object'))
+        self.assertRaises(jscore.error, g.eval, 'var f = m.incr; f(1)')
+        self.assertRaises(ValueError, jscore.export, Metrics,
+                          props=['count'], writable=['name'])
+
+    def testPolicy(self):
+        class Counter(object):
+            def __init__(self):
+                self.count = 0
+            def incr(self, n):
+                self.count += n
+                return self.count
+        jscore.export(Counter, methods=['incr'], props=['count'], writable=['count'])
+        c = jscore.Context()
+        g = c.globalObject
+        c.allow(Counter, call=False, write=True)
+        m = g.m = Counter()
+        self.assertRaises(TypeError, g.eval, 'm.incr(1)')
+        self.assertEqual(g.eval('m.count = 3; m.count'), 3)
+        c.allow(Counter)
+        m = g.m = Counter()
+        self.assertEqual(g.eval('m.count = 5; m.incr(1)'), 1)
+        self.assertEqual(m.count, 1)
+
+    def testDeclaration(self):
+        class Log(object):
+            __jsexport__ = ['write', 'lines', 'size']
+            def __init__(self):
+                self.lines = []
+            def write(self, line):
+                self.lines.append(line)
+            @property
+            def size(self):
+                return len(self.lines)
+        class SubLog(Log):
+            def write(self, line):
+                Log.write(self, line.upper())
+        g = jscore.Context().globalObject
+        log = g.log = Log()
+        sub = g.sub = SubLog()
+        g.eval('log.write("a"); log.write("b"); sub.write("c")')
+        self.assertEqual(log.lines, ['a', 'b'])
+        self.assertEqual(sub.lines, ['C'])
+        self.assertEqual(g.eval('log.size'), 2)
+
+class TestExecutor(unittest.TestCase):
+    prelude = ('function add(a, b) { return a + b; }'
+               'var lib = {tally: function (xs) {'
+               '    return {n: xs.length, keys: Object.keys(xs[0])}; }};')
+
+    def testSubmit(self):
+        if concurrent is None:
+            self.skipTest('needs concurrent.futures (the futures backport)')
+        with jscore.Executor(workers=2, prelude=self.prelude,
+                             flags=jscore.INT_NUMBERS) as ex:
+            self.assertEqual(ex.workers, 2)
+            futures = [ex.submit('add', i, 1) for i in range(20)]
+            self.assertEqual([f.result() for f in futures], range(1, 21))
+            self.assertEqual(ex.submit('lib.tally', [{'a': 1}, None]).result(),
+                             {'n': 2, 'keys': [u'a']})
+            self.assertEqual(ex.submit('[1, "x", null]').result(),
+                             [1, u'x', jscore.null])
+            self.assertRaises(jscore.error, ex.submit('missing()').result)
+            self.assertRaises(jscore.error, ex.submit('(function () {})').result)
+            self.assertRaises(TypeError, ex.submit, 'add', object())
+        self.assertRaises(RuntimeError, ex.submit, 'add', 1, 2)
+
+    def testPreludeError(self):
+        if concurrent is None:
+            self.skipTest('needs concurrent.futures (the futures backport)')
+        self.assertRaises(jscore.error, jscore.Executor, 1, 'throw 1')
+
+    def testShutdownWaitError(self):
+        if concurrent is None:
+            self.skipTest('needs concurrent.futures (the futures backport)')
+        class Bad(object):
+            def __nonzero__(self):
+                raise ZeroDivisionError
+        ex = jscore.Executor(1)
+        self.assertRaises(ZeroDivisionError, ex.shutdown, wait=Bad())
+        ex.shutdown()
+
+    def testCancelQueued(self):
+        if concurrent is None:
+            self.skipTest('needs concurrent.futures (the futures backport)')
+        prelude = ('var n = 0; function bump() { return ++n; }'
+                   'function spin(ms) { var t = Date.now(); while (Date.now() - t < ms); }')
+        with jscore.Executor(workers=1, prelude=prelude, flags=jscore.INT_NUMBERS) as ex:
+            busy = ex.submit('spin', 200)
+            queued = ex.submit('bump')
+            self.assert_(queued.cancel())
+            self.assertEqual(ex.submit('bump').result(), 1)
+            self.assert_(busy.done())
+            self.assert_(queued.cancelled())
+
+class TestAllocation(unittest.TestCase):
+    def testFreelistReuse(self):
+        g = jscore.Context().globalObject
+        g.eval('a = {b: {}}')
+        g.a.b
+        before = jscore.alloc_stats()['objects']['reuses']
+        for i in range(10):
+            g.a.b
+        self.assert_(jscore.alloc_stats()['objects']['reuses'] > before)
+
+    def testPrivateDataSlabs(self):
+        g = jscore.Context().globalObject
+        live = jscore.alloc_stats()['private_data']['live']
+        g.objs = [object() for i in range(10)]
+        g.eval('held = []; for (var i = 0; i < 10; i++) held.push(objs);')
+        self.assert_(jscore.alloc_stats()['private_data']['live'] > live)
+
+    def testAllocLimits(self):
+        stats = jscore.alloc_stats()
+        jscore.set_alloc_limits(objects=0)
+        self.assertEqual(jscore.alloc_stats()['objects']['free'], 0)
+        jscore.set_alloc_limits(objects=stats['objects']['limit'])
+        self.assertEqual(jscore.alloc_stats()['objects']['limit'],
+                         stats['objects']['limit'])
+
+class Holder(object):
+    pass
+
+class TestCollection(unittest.TestCase):
+    def testContextCycle(self):
+        c = jscore.Context()
+        h = Holder()
+        h.context = c
+        c.globalObject.h = h
+        ref = weakref.ref(h)
+        del c, h
+        gc.collect()
+        self.assert_(ref() is None)
+
+    def testCrossHeapCycle(self):
+        if not jscore.HAVE_SYNC_GC:
+            self.skipTest('built without a synchronous JS collection')
+        c = jscore.Context()
+        make = c.eval('(function (h) { return function () { return h; }; })')
+        h, kept = Holder(), Holder()
+        h.callback = make(h)
+        kept.callback = make(kept)
+        ref = weakref.ref(h)
+        del h
+        gc.collect()
+        self.assert_(ref() is not None)
+        released = c.collect()
+        # the stack is scanned conservatively, so the cycle may survive a
+        # collection; what is still referenced always does
+        self.assert_(released or ref() is not None)
+        self.assert_(kept.callback() is kept)
+
+    def testFinalizerKeepsRoots(self):
+        if not jscore.HAVE_SYNC_GC:
+            self.skipTest('built without a synchronous JS collection')
+        class Finalized(Holder):
+            def __del__(self):
+                pass
+        c = jscore.Context()
+        make = c.eval('(function (h) { return function () { return h; }; })')
+        h = Finalized()
+        h.callback = make(h)
+        ref = weakref.ref(h)
+        del h
+        c.collect()
+        self.assert_(ref().callback() is ref())
+
+    def testWithoutSyncGC(self):
+        if jscore.HAVE_SYNC_GC:
+            self.skipTest('built with a synchronous JS collection')
+        self.assertRaises(NotImplementedError, jscore.Context().collect)
+
+    def testWithoutWeakRef(self):
+        c = jscore.Context()
+        h = Holder()
+        h.callback = c.eval('(function (h) { return function () { return h; }; })')(h)
+        c.eval('delete this.WeakRef')
+        self.assertRaises(NotImplementedError, c.collect)
+        self.assert_(h.callback() is h)
+
+class TestCheckpoint(unittest.TestCase):
+    def testReset(self):
+        c = jscore.Context(timers=True)
+        g = c.globalObject
+        self.assertRaises(ValueError, c.reset)
+        c.eval('var config = {mode: "a"}; function helper() { return 1; }')
+        c.checkpoint()
+        c.eval('leaked = 1; helper = null; JSON = null; setTimeout(function () {}, 0)')
+        g.py = Holder()
+        self.assert_(c.reset() >= 4)
+        self.assert_('leaked' not in g and 'py' not in g)
+        self.assertEqual(c.eval('helper() + JSON.stringify(config)'), '1{"mode":"a"}')
+        self.assertEqual(c.pending_timers, 0)
+        self.assertEqual(c.reset(gc=True), 0)
+
+    def testDeclarations(self):
+        c = jscore.Context()
+        c.checkpoint()
+        c.eval('var late = 1; let kept = 2;')
+        self.assertEqual(c.reset(), 1)
+        self.assertEqual(c.eval('typeof late'), 'undefined')
+        self.assertEqual(c.reset(), 0)
+        c.eval('late = 3')
+        self.assertEqual(c.reset(), 1)
+        self.assertEqual(c.eval('typeof late'), 'undefined')
+        # lexical declarations are not globals' properties: they survive
+        self.assertEqual(c.eval('kept'), 2)
+        self.assertRaises(jscore.error, c.eval, 'let kept = 2;')
+
+class TestModules(unittest.TestCase):
+    def testRequire(self):
+        sources = {'a': 'exports.b = require("./b").value + 1;',
+                   'b': 'module.exports = {value: 41, id: __filename};'}
+        calls = []
+        def resolver(specifier, referrer):
+            calls.append((specifier, referrer))
+            name = specifier.lstrip('./')
+            if name in sources:
+                return name, sources[name]
+        group = jscore.ModuleGroup(resolver)
+        for i in range(2):
+            c = jscore.Context()
+            group.install(c)
+            self.assertEqual(c.eval('require("a").b + require("./b").id'), '42b')
+            self.assertRaises(jscore.error, c.eval, 'require("missing")')
+        self.assertRaises(ValueError, group.install, c)
+        # resolved and read once for both contexts; misses are not cached
+        self.assertEqual(len(calls), 5)
+        self.assertEqual(group.modules, 2)
+
+class TestStreams(unittest.TestCase):
+    def testTransformStream(self):
+        c = jscore.Context()
+        data = '{"a": 1}\n\n{"a": 2, "s": "\xe2\x98\xba"}\r\n{"a": 3}'
+        out = StringIO.StringIO()
+        stats = c.transform_stream('(function (r) { if (r.a != 2) return {b: r.a * 10}; })',
+                                   StringIO.StringIO(data), out, batch=2)
+        self.assertEqual(out.getvalue(), '{"b":10}\n{"b":30}\n')
+        self.assertEqual((stats['records'], stats['written'], stats['bytes_in']),
+                         (3, 2, len(data)))
+        self.assertEqual(stats['bytes_out'], len(out.getvalue()))
+
+        out = StringIO.StringIO()
+        c.eval('function lengths(rs) { return rs.map(function (r) { return r.s.length; }); }')
+        infile = StringIO.StringIO('{"s": "ab"}\n{"s": "\xe2\x98\xba"}\n')
+        c.transform_stream(c.globalObject.lengths, infile, out, vectorized=True)
+        self.assertEqual(out.getvalue(), '2\n1\n')
+        self.assertRaises(ValueError, c.transform_stream, 'JSON.stringify',
+                          StringIO.StringIO('{"a": 1}\n{oops}\n'), StringIO.StringIO())
+        try:
+            c.transform_stream('JSON.stringify', StringIO.StringIO('1\n2\0 3\n'),
+                               StringIO.StringIO())
+        except ValueError, e:
+            self.assert_('line 2' in str(e))
+        else:
+            self.fail('a line with a NUL was accepted')
+
+        # a record longer than the chunks read
+        out = StringIO.StringIO()
+        record = '{"s": "%s"}' % ('x' * 200000)
+        stats = c.transform_stream('(function (r) { return r.s.length; })',
+                                   StringIO.StringIO(record + '\n' + record), out)
+        self.assertEqual((out.getvalue(), stats['records']), ('200000\n200000\n', 2))
+
+class TestTimers(unittest.TestCase):
+    def testTimers(self):
+        c = jscore.Context(timers=True)
+        c.eval('var log = [];'
+               'setTimeout(function (x) { log.push(x); }, 20, "late");'
+               'setTimeout(function () { log.push("soon"); }, 0);'
+               'queueMicrotask(function () { log.push("micro"); });'
+               'var n = 0, t = setInterval(function () {'
+               '    if (++n == 3) clearInterval(t);'
+               '}, 1);'
+               'clearTimeout(setTimeout(function () { log.push("never"); }, 0));')
+        self.assertEqual(c.pending_timers, 3)
+        self.assert_(c.run_until_idle(time.time() + 5))
+        self.assertEqual(list(c.eval('log')), ['micro', 'soon', 'late'])
+        self.assertEqual(c.eval('n'), 3)
+        self.assertEqual(c.next_deadline(), None)
+        self.assertRaises(ValueError, setattr, jscore.Context(), 'timer_hook', None)
+
+    def testHook(self):
+        c = jscore.Context(timers=True)
+        delays = []
+        c.timer_hook = delays.append
+        c.eval('setTimeout(function () {}, 1000); setTimeout(function () {}, 5000);'
+               'setTimeout(function () { throw new Error("x"); }, 0)')
+        self.assertEqual(len(delays), 2)
+        self.assertRaises(jscore.error, c.run_ready)
+        self.assertEqual(c.run_ready(), 0)
+        self.assert_(0 < c.next_deadline() <= 1)
+        self.assertFalse(c.run_until_idle(time.time() + 0.01))
+
+    def testBusyInterval(self):
+        c = jscore.Context(timers=True)
+        c.eval('var n = 0; setInterval(function () { n++; }, 0)')
+        self.assertFalse(c.run_until_idle(time.time() + 0.05))
+        self.assert_(c.eval('n') > 0)
+
+class TestProfiler(unittest.TestCase):
+    def testProfile(self):
+        c = jscore.Context()
+        g = c.globalObject
+        g.add = lambda a, b: a + b
+        g.h = Holder()
+        g.h.x = 1
+        c.profiling = True
+        c.eval('for (var i = 0; i < 10; i++) { add(i, h.x); h.x; }')
+        c.profiling = False
+        c.eval('add(1, 2)')
+        stats = c.profile_stats(sort='calls')
+        self.assertEqual([row[:4] for row in stats],
+                         [('get', 'x', Holder, 20), ('call', None, g.add, 10)])
+        for kind, name, target, calls, total, convert in stats:
+            self.assert_(0 <= convert <= total)
+        self.assertRaises(ValueError, c.profile_stats, sort='name')
+        c.profile_reset()
+        self.assertEqual(c.profile_stats(), [])
+
+    def testBoundMethods(self):
+        class Counter(object):
+            def f(self):
+                return 1
+        c = jscore.Context()
+        g = c.globalObject
+        g.obj, g.xs = Counter(), []
+        c.profiling = True
+        c.eval('for (var i = 0; i < 1000; i++) { obj.f(); xs.append(i); }')
+        self.assertEqual(sorted(row[:4] for row in c.profile_stats() if row[0] == 'call'),
+                         [('call', None, Counter.f.im_func, 1000),
+                          ('call', 'append', list, 1000)])
+
 class TestExceptions(unittest.TestCase):
     class MyTestEx(Exception): pass
     @staticmethod